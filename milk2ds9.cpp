@@ -1,15 +1,33 @@
 
+#include <chrono>
+#include <thread>
+
 #include <fcntl.h>
 #include <signal.h>
 
 #define DS9INTERFACE_NO_EIGEN
 #include "mx/improc/ds9Interface.hpp"
+#include "mx/improc/fitsMmapCube.hpp"
+#include "mx/milk/displayBudget.hpp"
+#include "mx/milk/displayControl.hpp"
+#include "mx/milk/displayPipeline.hpp"
+#include "mx/milk/displayPipelinePSD.hpp"
+#include "mx/milk/fitsRecorder.hpp"
+#include "mx/milk/eventGate.hpp"
+#include "mx/milk/frameMetrics.hpp"
+#include "mx/milk/historyRing.hpp"
+#include "mx/milk/qosLadder.hpp"
+#include "mx/milk/semaphoreClaim.hpp"
+#include "mx/milk/streamMosaic.hpp"
+#include "mx/milk/streamRelay.hpp"
+#include "mx/milk/streamWindow.hpp"
 
 
 #include <ImageStruct.h>
 #include <ImageStreamIO.h>
 
 bool timeToDie;
+volatile sig_atomic_t freezeToggled; ///< Set by SIGUSR1 to freeze or thaw the history
 
 void sigHandler( int signum,
                  siginfo_t *siginf,
@@ -58,6 +76,286 @@ int setSigTermHandler()
    return 0;
 }
 
+void sigFreezeHandler( int signum,
+                       siginfo_t *siginf,
+                       void *ucont
+                     )
+{
+   static_cast<void>(signum);
+   static_cast<void>(siginf);
+   static_cast<void>(ucont);
+
+   freezeToggled = 1;
+}
+
+int setSigFreezeHandler()
+{
+   struct sigaction act;
+   sigset_t set;
+
+   act.sa_sigaction = sigFreezeHandler;
+   act.sa_flags = SA_SIGINFO;
+   sigemptyset(&set);
+   act.sa_mask = set;
+
+   errno = 0;
+   if( sigaction(SIGUSR1, &act, 0) < 0 )
+   {
+      std::cerr << " (" << "milk2ds9" << "): error setting SIGUSR1 handler: " << strerror(errno) << "\n";
+      return -1;
+   }
+
+   return 0;
+}
+
+/// Format the ImageStreamIO keywords of an image as FITS header cards
+/** Keywords which would clash with the mandatory image cards, and unused keywords, are skipped.
+  */
+void keywordHeader( mx::improc::fitsMemHeader & head,
+                    const IMAGE & image
+                  )
+{
+   static const char * reserved[] = {"SIMPLE", "BITPIX", "NAXIS", "NAXIS1", "NAXIS2", "NAXIS3", "BZERO", "BSCALE", "END"};
+
+   head.clear();
+
+   for(int i = 0; i < image.md[0].NBkw; ++i)
+   {
+      const IMAGE_KEYWORD & kw = image.kw[i];
+
+      std::string name(kw.name, strnlen(kw.name, KEYWORD_MAX_STRING));
+      std::string comment(kw.comment, strnlen(kw.comment, KEYWORD_MAX_COMMENT));
+
+      if(name == "") continue;
+      for(size_t n = 0; n < name.size(); ++n) name[n] = toupper(name[n]);
+
+      bool skip = false;
+      for(size_t n = 0; n < sizeof(reserved)/sizeof(reserved[0]); ++n) if(name == reserved[n]) skip = true;
+      if(skip) continue;
+
+      char val[32];
+      switch(kw.type)
+      {
+         case 'L':
+            snprintf(val, sizeof(val), "%ld", (long) kw.value.numl);
+            head.append(name, val, comment);
+            break;
+         case 'D':
+            snprintf(val, sizeof(val), "%.15g", kw.value.numf);
+            head.append(name, val, comment);
+            break;
+         case 'S':
+            head.appendString(name, std::string(kw.value.valstr, strnlen(kw.value.valstr, KEYWORD_MAX_STRING)), comment);
+            break;
+         default:
+            break;
+      }
+   }
+}
+
+/// Close a stream, whether it was opened by ImageStreamIO or through a window, releasing its semaphore first
+void closeStream( IMAGE & image,                   ///< [in] the stream
+                  mx::milk::streamWindow & window, ///< [in] the window, which is open if it was used
+                  mx::milk::semaphoreClaim & claim ///< [in] the semaphore claimed for the display, if any
+                )
+{
+   claim.release();
+
+   if(window.isOpen()) window.close();
+   else ImageStreamIO_closeIm(&image);
+}
+
+/// Set the region the metrics measure from the user's ROI
+/** This is not the ROI the display is using, which the QoS ladder shrinks under load, so that the published
+  * measurements don't change with the load on the viewer.  With a remap the ROI is in the remapped image, so the
+  * whole stream is measured.
+  */
+void metricsROI( mx::milk::frameMetrics & metrics,     ///< [in] the metrics
+                 const mx::milk::displayConfig & config, ///< [in] the user's configuration
+                 size_t nx,                              ///< [in] the first dimension of the stream
+                 size_t ny,                              ///< [in] the second dimension of the stream
+                 bool remapped                           ///< [in] whether the stream is remapped
+               )
+{
+   if(remapped)
+   {
+      metrics.roi(0, 0, nx, ny);
+      return;
+   }
+
+   size_t x0, y0, w, h;
+   mx::milk::displayROI(x0, y0, w, h, config, nx, ny);
+
+   metrics.roi(x0, y0, w, h);
+}
+
+/// Play the images of a FITS file through the display pipeline and into ds9, as if they came from a stream
+/** The images are read through a memory map, and timed from the first one, at the given rate or as fast as
+  * possible.  The achieved rate is reported at the end, which makes this a repeatable benchmark of the display path.
+  *
+  * \retval 0 on success
+  * \retval -1 on an error
+  */
+int replay( const std::string & fname,                                            ///< [in] the FITS file
+            double rate,                                                          ///< [in] the rate in Hz, 0 for as fast as possible
+            const mx::milk::displayConfig & config,                               ///< [in] the pipeline configuration
+            const std::shared_ptr<const mx::milk::remapTable> & remap,            ///< [in] the remap table, if any
+            bool psd,                                                             ///< [in] whether to show the power spectrum
+            int frameNo,                                                          ///< [in] the ds9 frame
+            mx::improc::ds9Interface & ds9,                                       ///< [in] the ds9 window
+            std::vector<std::unique_ptr<mx::improc::ds9Interface>> & mirrors      ///< [in] further windows
+          )
+{
+   mx::improc::fitsMmapCube cube;
+   if(cube.open(fname) < 0) return -1;
+
+   uint8_t datatype = mx::milk::milkDatatypeFromBitpix(cube.bitpix());
+   std::unique_ptr<mx::milk::displayPipeline> pipeline = psd ? mx::milk::makeDisplayPipelinePSD(datatype) : mx::milk::makeDisplayPipeline(datatype, remap);
+   if(!pipeline)
+   {
+      std::cerr << "milk2ds9: BITPIX of " << fname << " is not supported.\n";
+      return -1;
+   }
+
+   if(pipeline->configure(cube.dim1(), cube.dim2(), config) < 0)
+   {
+      std::cerr << "milk2ds9: ROI and binning leave nothing to display.\n";
+      return -1;
+   }
+
+   //Start the clock once ds9 is up, so its startup isn't counted
+   while(ds9.connect() > 0 && !timeToDie) usleep(10000);
+
+   std::vector<char> im(cube.dim1()*cube.dim2()*cube.pixsz());
+
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   size_t n;
+   for(n = 0; n < cube.dim3() && !timeToDie; ++n)
+   {
+      if(rate > 0) std::this_thread::sleep_until(start + std::chrono::duration<double>(n/rate));
+
+      cube.image(im.data(), n);
+
+      void * buf = ds9.displayBuffer(pipeline->bitpix(), pipeline->pixsz(), pipeline->dim1(), pipeline->dim2(), 1, frameNo);
+
+      if(buf)
+      {
+         pipeline->process(buf, im.data());
+         ds9.displayCommit(frameNo);
+
+         for(size_t m = 0; m < mirrors.size(); ++m) mirrors[m]->mirror(ds9, frameNo);
+      }
+   }
+
+   double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+   std::cerr << "milk2ds9: replayed " << n << " images in " << dt << " s: " << n/dt << " images/s, ";
+   std::cerr << n*im.size()/dt/1048576 << " MB/s read.\n";
+
+   return 0;
+}
+
+/// Display several streams as tiles of one ds9 frame
+/** Each stream is processed into its tile by its own thread as it posts, and the mosaic is sent to ds9 with one
+  * update per refresh.  With alignment, only sets of images matched by time or cnt0 are sent.  Runs until killed, re-opening all of the streams if any of them changes size or goes away.
+  *
+  * \retval 0 on success
+  * \retval -1 on an error
+  */
+int mosaic( const std::vector<std::string> & names,                           ///< [in] the streams
+            size_t cols,                                                      ///< [in] the number of columns of tiles, 0 for square
+            mx::milk::mosaicAlign align,                                      ///< [in] how to match the tiles
+            double tolerance,                                                 ///< [in] the tolerance for matching
+            const mx::milk::displayConfig & config,                           ///< [in] the pipeline configuration, used for each stream
+            const std::shared_ptr<const mx::milk::remapTable> & remap,        ///< [in] the remap table, if any
+            int semaphoreNumber,                                              ///< [in] the semaphore each tile waits on
+            int frameNo,                                                      ///< [in] the ds9 frame
+            int waitTime,                                                     ///< [in] the time, in usec, to wait after each refresh
+            int pauseTime,                                                    ///< [in] the time, in usec, to pause when nothing has changed
+            mx::milk::displayBudget & budget,                                 ///< [in] the host display budget
+            mx::improc::ds9Interface & ds9,                                   ///< [in] the ds9 window
+            std::vector<std::unique_ptr<mx::improc::ds9Interface>> & mirrors  ///< [in] further windows
+          )
+{
+   mx::milk::streamMosaic mos;
+   mos.setup(names, cols);
+   mos.align(align, tolerance);
+   mos.budget(&budget); //the tiles do most of the work, so ask and charge for it themselves
+
+   while(!timeToDie)
+   {
+      int rv;
+      int reported = 0;
+      while((rv = mos.open(config, remap, semaphoreNumber)) == 1 && !timeToDie)
+      {
+         if(!reported) std::cerr << "Not all ImageStreams found (yet).  Retrying . . . \n";
+         reported = 1;
+         sleep(1); //be patient
+      }
+
+      if(rv < 0) return -1;
+
+      bool force = true; //send the whole mosaic once, even if nothing has posted
+
+      while(!timeToDie)
+      {
+         if(!mos.valid())
+         {
+            std::cerr << "\nSize change detected!\n\n";
+            break;
+         }
+
+         if(ds9.pollVisibility() > 0) force = true;
+         bool visible = ds9.frameVisible(frameNo);
+         for(size_t n = 0; n < mirrors.size(); ++n)
+         {
+            if(mirrors[n]->pollVisibility() > 0) force = true;
+            visible = (visible || mirrors[n]->frameVisible(frameNo));
+         }
+         budget.visible(visible);
+
+         ds9.ready();
+         ds9.captureViewState();
+
+         for(size_t n = 0; n < mirrors.size(); ++n)
+         {
+            mirrors[n]->ready();
+            mirrors[n]->captureViewState();
+         }
+
+         if(visible && (force || mos.changed()) && budget.admit())
+         {
+            double cpu = mx::milk::displayBudget::threadCPU();
+
+            void * buf = ds9.displayBuffer(FLOAT_IMG, sizeof(float), mos.width(), mos.height(), 1, frameNo);
+
+            //With alignment there may be no new matched set yet
+            if(buf && mos.copy(static_cast<float *>(buf), force))
+            {
+               ds9.displayCommit(frameNo);
+
+               for(size_t n = 0; n < mirrors.size(); ++n) mirrors[n]->mirror(ds9, frameNo);
+
+               force = false;
+
+               budget.charge(mx::milk::displayBudget::threadCPU() - cpu);
+            }
+
+            usleep(waitTime);
+         }
+         else
+         {
+            usleep(pauseTime);
+         }
+      }
+
+      mos.close();
+   }
+
+   return 0;
+}
+
 void usage( const char * argv0,
             const char * err = 0
           )
@@ -70,22 +368,128 @@ void usage( const char * argv0,
    std::cerr << argv0 << ":\n";
    std::cerr << "Send images from a MILK shared memory buffer to the ds9 image viewer. Sends image to ds9 whenever the semaphore posts.  ";
    std::cerr << "Once started, runs until killed.\n\n";
-   std::cerr << "Usage: " << argv0 << " " << "[-h] [-f frameno] [-p pauseTime] [-s semaphoreNumber] [-t ds9Title] [-w waitTime] /path/to/filename\n\n";
+   std::cerr << "Usage: " << argv0 << " " << "[-h] [-a average] [-A tolerance] [-b bin] [-B priority[,cpu[,rate]]] [-c component] [-d decimate] [-E metricsStream[,radius]] [-f frameno] [-F replayFile] [-g threshold[,count[,pre[,post[,heartbeat]]]]] [-G maskFile] [-Y replayRate] [-H seconds] [-j backend] [-k] [-m remapFile] [-M cols] [-o outStream] [-O dumpDir] [-p pauseTime] [-P precision] [-Q maxLatency[,maxSkip]] [-r x0,y0,w,h] [-R recordBase] [-D recordDecimate] [-L limitMB] [-s semaphoreNumber] [-S recordSemaphore] [-t ds9Title] [-w waitTime] [-W slices] [-x control] [-z log|linear[,average]] /path/to/filename [/path/to/filename ...]\n\n";
    std::cerr << "Required Argument:\n";
-   std::cerr << "     /path/to/filename   the full path to the shared memory file.\n\n";
+   std::cerr << "     /path/to/filename   the full path to the shared memory file.\n";
+   std::cerr << "                         Given more than once, the streams are\n";
+   std::cerr << "                         shown as tiles of one frame.\n\n";
    std::cerr << "Options:\n";
    std::cerr << "     -h                 print this message and exit. \n";
+   std::cerr << "     -a average         with -o, average blocks of this many\n";
+   std::cerr << "                        images and publish them as floats.\n";
+   std::cerr << "                        Default is 1.\n";
+   std::cerr << "     -A tolerance       with several streams, show only sets of\n";
+   std::cerr << "                        images whose acquisition times agree\n";
+   std::cerr << "                        within tolerance seconds, or with\n";
+   std::cerr << "                        cnt0:N, whose cnt0 agree within N.\n";
+   std::cerr << "     -b bin             average bin x bin blocks of pixels before\n";
+   std::cerr << "                        display. Default is 1.\n";
+   std::cerr << "     -B priority,...    share the host's display budget with the\n";
+   std::cerr << "                        other viewers using -B, with this weight.\n";
+   std::cerr << "                        cpu (in cores) and rate (in images per\n";
+   std::cerr << "                        second) set the budget for all of them,\n";
+   std::cerr << "                        0 for no limit.\n";
+   std::cerr << "     -c component       for complex streams, the component to\n";
+   std::cerr << "                        display: amplitude, phase, real, or imag.\n";
+   std::cerr << "                        Default is amplitude.\n";
+   std::cerr << "     -d decimate        with -o, publish every decimate-th image\n";
+   std::cerr << "                        (or block, with -a).  Default is 1.\n";
+   std::cerr << "     -E metricsStream   measure the centroid, peak, flux, FWHM\n";
+   std::cerr << "                        and encircled energy within radius\n";
+   std::cerr << "                        (default 5) pixels of every image in the\n";
+   std::cerr << "                        ROI, publish them to this stream, and\n";
+   std::cerr << "                        mark the centroid in ds9.\n";
    std::cerr << "     -f frameNo         specify the frame in which to display.\n";
    std::cerr << "                        Default is 1.\n";
+   std::cerr << "     -F replayFile      play the images of a FITS file, e.g. a\n";
+   std::cerr << "                        recording, instead of a stream, then\n";
+   std::cerr << "                        report the rate achieved.  No image\n";
+   std::cerr << "                        name is needed.\n";
+   std::cerr << "     -Y replayRate      with -F, the rate in Hz to play at.\n";
+   std::cerr << "                        Default is 0, as fast as possible.\n";
+   std::cerr << "     -g threshold,...   gate the display on events: images with\n";
+   std::cerr << "                        at least count (default 1) pixels above\n";
+   std::cerr << "                        threshold are shown as they happen, with\n";
+   std::cerr << "                        pre and post images around them (default\n";
+   std::cerr << "                        0).  Otherwise the stream is shown at\n";
+   std::cerr << "                        heartbeat Hz.  Default is 1 Hz.\n";
+   std::cerr << "     -G maskFile        with -g, scan only the pixels which are\n";
+   std::cerr << "                        non-zero in this FITS image.\n";
+   std::cerr << "     -H seconds         keep this many seconds of images in\n";
+   std::cerr << "                        memory, at the full stream rate, which\n";
+   std::cerr << "                        can be frozen (also with SIGUSR1),\n";
+   std::cerr << "                        scrubbed and dumped to FITS with the\n";
+   std::cerr << "                        freeze, scrub and dump commands.\n";
+   std::cerr << "     -j backend         how the ds9 segments are allocated: auto,\n";
+   std::cerr << "                        sysv (shared memory), mmap (a memory\n";
+   std::cerr << "                        file), or huge (a memory file in huge\n";
+   std::cerr << "                        pages where available).  Default is\n";
+   std::cerr << "                        auto, sysv unless its limits are too\n";
+   std::cerr << "                        small for the image.\n";
+   std::cerr << "     -k                 send the stream keywords to ds9 in a FITS\n";
+   std::cerr << "                        header in front of the pixels.\n";
+   std::cerr << "     -m remapFile       remap the stream, taken as a vector, into\n";
+   std::cerr << "                        a 2D image using a FITS index map of the\n";
+   std::cerr << "                        display size.  Negative entries are\n";
+   std::cerr << "                        unused, and shown as NaN.\n";
+   std::cerr << "     -M cols            with several streams, the number of\n";
+   std::cerr << "                        columns of tiles.  Default is a square\n";
+   std::cerr << "                        grid.\n";
+   std::cerr << "     -o outStream       also publish the displayed images, after\n";
+   std::cerr << "                        ROI, binning and precision reduction, as\n";
+   std::cerr << "                        a new shared memory stream.\n";
+   std::cerr << "     -O dumpDir         the directory history dumps are written\n";
+   std::cerr << "                        to.  Default is the working directory.\n";
    std::cerr << "     -p pauseTime       specify the time, in usec, to pause \n";
    std::cerr << "                        before re-checking the semaphore.\n";
    std::cerr << "                        Default is 1000 usec.\n";
-   std::cerr << "     -s semaphoreNumber specify the semaphore number to monitor\n";
+   std::cerr << "     -P precision       the precision to send to ds9: native,\n";
+   std::cerr << "                        float (8 byte types sent as 4 byte\n";
+   std::cerr << "                        floats), or linear, sqrt, or log (wider\n";
+   std::cerr << "                        types auto-ranged and quantized to 16\n";
+   std::cerr << "                        bits with that stretch). Default is native.\n";
+   std::cerr << "     -Q maxLatency,...  when the display latency, in seconds, or\n";
+   std::cerr << "                        the fraction of ds9 updates skipped\n";
+   std::cerr << "                        (maxSkip, default 0.5) is too high, step\n";
+   std::cerr << "                        down to a lower rate, then 16 bit\n";
+   std::cerr << "                        precision, then 2x binning, then the\n";
+   std::cerr << "                        central quarter, and back up when it\n";
+   std::cerr << "                        recovers.  Default is 0, off.\n";
+   std::cerr << "     -r x0,y0,w,h       display only the region of interest of\n";
+   std::cerr << "                        width w and height h starting at x0,y0.\n";
+   std::cerr << "     -R recordBase      record the stream, at its full rate, to\n";
+   std::cerr << "                        FITS cubes named recordBase_NNNN.fits.\n";
+   std::cerr << "     -D recordDecimate  with -R, record every Nth image.\n";
+   std::cerr << "                        Default is 1.\n";
+   std::cerr << "     -L limitMB         with -R, start a new file when the next\n";
+   std::cerr << "                        image would take a file past this size.\n";
+   std::cerr << "                        Default is 2048.  0 is no limit.\n";
+   std::cerr << "     -s semaphoreNumber the semaphore for the display to try\n";
+   std::cerr << "                        first.  Default is any which no other\n";
+   std::cerr << "                        reader has claimed.\n";
+   std::cerr << "     -S recordSemaphore with -R, the semaphore for the recorder\n";
+   std::cerr << "                        to try first.  Default is any free one.\n";
    std::cerr << "     -t ds9Title        specify the title of the DS9 window to\n";
-   std::cerr << "                        use.  Default is the filename.\n";
+   std::cerr << "                        use.  Default is the filename.  May be\n";
+   std::cerr << "                        given more than once to feed several\n";
+   std::cerr << "                        windows from one copy of each image.\n";
    std::cerr << "     -w waitTime        specify the time, in usec, to wait\n";
    std::cerr << "                        after sending an image to DS9.  Default\n";
    std::cerr << "                        is 10000 usec.\n";
+   std::cerr << "     -W slices          map only this many slices of the stream\n";
+   std::cerr << "                        at a time, moving them with the newest,\n";
+   std::cerr << "                        to save memory on deep circular buffers.\n";
+   std::cerr << "                        Default is 0, the whole stream.\n";
+   std::cerr << "     -x control         the name of the XPA access point,\n";
+   std::cerr << "                        milk2ds9:control, which takes xpaset\n";
+   std::cerr << "                        commands rate, roi, bin, precision,\n";
+   std::cerr << "                        component, pause, frame and stats to\n";
+   std::cerr << "                        change settings while running.  Default\n";
+   std::cerr << "                        is the filename.\n";
+   std::cerr << "     -z scale,average   show the spatial power spectrum of the\n";
+   std::cerr << "                        ROI, with zero frequency at the center,\n";
+   std::cerr << "                        on a log or linear scale, averaged\n";
+   std::cerr << "                        over average images (default 1).\n";
 
 }
 
@@ -108,21 +512,69 @@ int main( int argc,
 
    timeToDie = false;
    
-   std::string ds9Title;
-   int semaphoreNumber {0}; ///< Number of the semaphore to monitor for new image data.  This determines the filename.
+   std::vector<std::string> ds9Titles;
+   int semaphoreNumber {-1}; ///< The semaphore to try first for the display, -1 for any which is free
 
    int waitTime {10000};
    int pauseTime {1000};
    int frameNo {1};
+   bool fitsHeader {false};
+   mx::improc::ds9SegmentBackend segmentBackend {mx::improc::ds9SegmentBackend::automatic};
+
+   std::string controlName;
+
+   double historySeconds {0};
+   std::string dumpDir {"."};
+
+   std::string recordBase;
+   int recordDecimate {1};
+   double recordLimitMB {2048};
+   int recordSemaphore {-1};
+
+   std::string remapFile;
+
+   double gateThreshold {0};
+   int gateCount {0}; //0 is no gating
+   int gatePre {0};
+   int gatePost {0};
+   double gateHeartbeat {1};
+   std::string gateMask;
+
+   std::string metricsStream;
+   double metricsRadius {5};
+
+   double qosLatency {0};
+   double qosSkip {0.5};
+
+   bool psd {false};
+
+   double budgetPriority {0}; //0 is not sharing a budget
+   double budgetCPU {-1};     //-1 leaves the host budget as it is
+   double budgetRate {0};
+
+   int windowSlices {0}; //0 maps the whole stream
+
+   size_t mosaicCols {0};
+   mx::milk::mosaicAlign mosaicAlign {mx::milk::alignNone};
+   double alignTolerance {0};
+
+   std::string replayFile;
+   double replayRate {0};
+
+   std::string outStream;
+   int decimate {1};
+   int average {1};
+
+   mx::milk::displayConfig config;
 
    bool help {false};
 
    opterr = 0;
 
    int c;
-   while ((c = getopt (argc, argv, "f:hp:s:t:w:")) != -1)
+   while ((c = getopt (argc, argv, "a:A:b:B:c:d:D:E:f:F:g:G:hH:j:kL:m:M:o:O:p:P:Q:r:R:s:S:t:w:W:x:Y:z:")) != -1)
    {
-      if(c != 'h')
+      if(c != 'h' && c != 'k')
       if (optarg[0] == '-')
       {
          optopt = c;
@@ -130,27 +582,180 @@ int main( int argc,
       }
       switch (c)
       {
+         case 'a':
+            average = atoi(optarg);
+            break;
+         case 'A':
+            if(strncmp(optarg, "cnt0:", 5) == 0)
+            {
+               mosaicAlign = mx::milk::alignCnt0;
+               alignTolerance = atof(optarg + 5);
+            }
+            else
+            {
+               mosaicAlign = mx::milk::alignTime;
+               alignTolerance = atof(optarg);
+            }
+            break;
+         case 'b':
+            config.bin = atoi(optarg);
+            break;
+         case 'B':
+            if(sscanf(optarg, "%lf,%lf,%lf", &budgetPriority, &budgetCPU, &budgetRate) < 1 || budgetPriority <= 0)
+            {
+               usage(argv[0], "budget must be specified as priority[,cpu[,rate]]");
+               return 1;
+            }
+            break;
+         case 'c':
+            if(mx::milk::parseComponent(config.component, optarg) < 0)
+            {
+               usage(argv[0], "component must be one of amplitude, phase, real, or imag");
+               return 1;
+            }
+            break;
+         case 'd':
+            decimate = atoi(optarg);
+            break;
+         case 'D':
+            recordDecimate = atoi(optarg);
+            break;
          case 'f':
             frameNo = atoi(optarg);
             break;
+         case 'E':
+         {
+            metricsStream = optarg;
+            size_t comma = metricsStream.find(',');
+            if(comma != std::string::npos)
+            {
+               metricsRadius = atof(metricsStream.c_str() + comma + 1);
+               metricsStream.erase(comma);
+            }
+            break;
+         }
+         case 'F':
+            replayFile = optarg;
+            break;
+         case 'g':
+            gateCount = 1;
+            if(sscanf(optarg, "%lf,%d,%d,%d,%lf", &gateThreshold, &gateCount, &gatePre, &gatePost, &gateHeartbeat) < 1 || gateCount < 1 || gatePre < 0 || gatePost < 0)
+            {
+               usage(argv[0], "gate must be specified as threshold[,count[,pre[,post[,heartbeat]]]]");
+               return 1;
+            }
+            break;
+         case 'G':
+            gateMask = optarg;
+            break;
          case 'h':
             help = true;
             break;
+         case 'H':
+            historySeconds = atof(optarg);
+            break;
+         case 'j':
+         {
+            std::string backend = optarg;
+            if(backend == "auto") segmentBackend = mx::improc::ds9SegmentBackend::automatic;
+            else if(backend == "sysv") segmentBackend = mx::improc::ds9SegmentBackend::sysv;
+            else if(backend == "mmap") segmentBackend = mx::improc::ds9SegmentBackend::mmap;
+            else if(backend == "huge") segmentBackend = mx::improc::ds9SegmentBackend::huge;
+            else
+            {
+               usage(argv[0], "backend must be one of auto, sysv, mmap, or huge");
+               return 1;
+            }
+            break;
+         }
+         case 'k':
+            fitsHeader = true;
+            break;
+         case 'L':
+            recordLimitMB = atof(optarg);
+            break;
+         case 'm':
+            remapFile = optarg;
+            break;
+         case 'M':
+            mosaicCols = atoi(optarg);
+            break;
+         case 'o':
+            outStream = optarg;
+            break;
+         case 'O':
+            dumpDir = optarg;
+            break;
          case 'p':
            waitTime = atoi(optarg);
            break;
+         case 'P':
+            if(mx::milk::parsePrecision(config.precision, optarg) < 0)
+            {
+               usage(argv[0], "precision must be one of native, float, linear, sqrt, or log");
+               return 1;
+            }
+            break;
+         case 'Q':
+            if(sscanf(optarg, "%lf,%lf", &qosLatency, &qosSkip) < 1 || qosLatency < 0)
+            {
+               usage(argv[0], "QoS limits must be specified as maxLatency[,maxSkip]");
+               return 1;
+            }
+            break;
+         case 'r':
+            if(sscanf(optarg, "%zu,%zu,%zu,%zu", &config.roiX, &config.roiY, &config.roiW, &config.roiH) != 4)
+            {
+               usage(argv[0], "ROI must be specified as x0,y0,w,h");
+               return 1;
+            }
+            break;
+         case 'R':
+            recordBase = optarg;
+            break;
          case 's':
             semaphoreNumber = atoi(optarg);
             break;
+         case 'S':
+            recordSemaphore = atoi(optarg);
+            break;
          case 't':
-           ds9Title = optarg;
+           ds9Titles.push_back(optarg);
            break;
          case 'w':
            waitTime = atoi(optarg);
            break;
+         case 'W':
+            windowSlices = atoi(optarg);
+            break;
+         case 'x':
+            controlName = optarg;
+            break;
+         case 'Y':
+            replayRate = atof(optarg);
+            break;
+         case 'z':
+         {
+            psd = true;
+            std::string scale = optarg;
+            size_t comma = scale.find(',');
+            if(comma != std::string::npos)
+            {
+               config.psdAverage = atoi(scale.c_str() + comma + 1);
+               scale.erase(comma);
+            }
+            if(scale == "log") config.psdLog = true;
+            else if(scale == "linear") config.psdLog = false;
+            else
+            {
+               usage(argv[0], "power spectra must be specified as log|linear[,average]");
+               return 1;
+            }
+            break;
+         }
          case '?':
             char err[256];
-            if (optopt == 'f' || optopt == 'p' || optopt == 's' || optopt == 't' || optopt == 'w')
+            if (optopt == 'a' || optopt == 'A' || optopt == 'b' || optopt == 'B' || optopt == 'c' || optopt == 'd' || optopt == 'D' || optopt == 'E' || optopt == 'f' || optopt == 'F' || optopt == 'g' || optopt == 'G' || optopt == 'H' || optopt == 'j' || optopt == 'L' || optopt == 'm' || optopt == 'M' || optopt == 'o' || optopt == 'p' || optopt == 'P' || optopt == 'Q' || optopt == 'r' || optopt == 'R' || optopt == 's' || optopt == 'S' || optopt == 't' || optopt == 'w' || optopt == 'W' || optopt == 'x' || optopt == 'Y' || optopt == 'z')
                snprintf(err, 256, "Option -%c requires an argument.", optopt);
             else if (isprint (optopt))
                snprintf(err, 256, "Unknown option `-%c'.", optopt);
@@ -172,27 +777,142 @@ int main( int argc,
    }
 
 
-   if( optind != argc-1)
+   if( optind == argc && replayFile == "")
+   {
+      usage(argv[0], "must specify shared memory file name as non-option argument.");
+      return -1;
+   }
+
+   if( argc - optind > 1 && replayFile != "")
+   {
+      usage(argv[0], "-F plays a single file.");
+      return -1;
+   }
+
+   std::vector<std::string> mosaicNames(argv + optind, argv + argc); //More than one is a mosaic
+
+   if(windowSlices > 0 && (historySeconds > 0 || recordBase != "" || gateCount > 0 || metricsStream != ""))
    {
-      usage(argv[0], "must specify shared memory file name as only non-option argument.");
+      usage(argv[0], "-W can not be used with -H, -R, -g or -E, which read the whole stream.");
       return -1;
    }
 
-   std::string shmem_key = argv[optind];
+   if(psd && (remapFile != "" || mosaicNames.size() > 1))
+   {
+      usage(argv[0], "-z can not be used with -m or several streams.");
+      return -1;
+   }
+
+   std::string shmem_key = (optind < argc) ? argv[optind] : replayFile;
    
-   if(ds9Title == "") ds9Title = shmem_key;
+   if(ds9Titles.size() == 0) ds9Titles.push_back(shmem_key);
+   if(controlName == "") controlName = shmem_key;
+
+   //Loaded once, and shared by each pipeline made for the stream
+   std::shared_ptr<mx::milk::remapTable> remap;
+   if(remapFile != "")
+   {
+      remap = std::make_shared<mx::milk::remapTable>();
+      if(remap->load(remapFile) < 0) return -1;
+   }
 
    IMAGE image;
 
    size_t type_size; ///< The size, in bytes, of the image data type
 
-   sem_t * sem {nullptr}; ///< The semaphore to monitor for new image data
+   mx::milk::semaphoreClaim semClaim; ///< The semaphore the display waits on for new image data, if claimed
+
+   std::unique_ptr<mx::milk::displayPipeline> pipeline; ///< The display stages, specialized for the image data type
+   std::unique_ptr<mx::milk::displayPipeline> relayPipeline; ///< The stages as configured, for the relay while the QoS ladder has changed the display's
 
-   int bitpix;
+   mx::milk::streamWindow window; ///< Maps only some of the slices, if windowing
+   window.setup(windowSlices);
 
    if(setSigTermHandler() < 0) return -1;
+   if(setSigFreezeHandler() < 0) return -1;
    
-   mx::improc::ds9Interface ds9(ds9Title);
+   mx::improc::ds9Interface ds9(ds9Titles[0]);
+   ds9.toggleFitsHeader(fitsHeader);
+   ds9.segmentBackend(segmentBackend);
+   ds9.toggleAsyncSpawn(true); //keep reading the stream while ds9 starts
+   ds9.toggleViewReplay(true); //restore the view if ds9 is restarted
+   ds9.toggleVisibilityCheck(true); //don't update frames ds9 isn't showing
+   ds9.toggleMonitor(true); //query ds9 off the display path
+
+   //Further windows show the first one's segment, so each costs a command rather than a copy
+   std::vector<std::unique_ptr<mx::improc::ds9Interface>> mirrors;
+   for(size_t n = 1; n < ds9Titles.size(); ++n)
+   {
+      mirrors.emplace_back(new mx::improc::ds9Interface(ds9Titles[n]));
+      mirrors.back()->toggleAsyncSpawn(true);
+      mirrors.back()->toggleViewReplay(true);
+      mirrors.back()->toggleVisibilityCheck(true);
+      mirrors.back()->toggleMonitor(true);
+   }
+
+   //Each window is paced by its own response time, so a slow one doesn't hold back the others
+   if(mirrors.size() > 0)
+   {
+      ds9.setPacing(0, true);
+      for(size_t n = 0; n < mirrors.size(); ++n) mirrors[n]->setPacing(0, true);
+   }
+
+   //Shares the host's display budget with the other viewers
+   mx::milk::displayBudget budget;
+   if(budgetPriority > 0)
+   {
+      if(budget.join(budgetPriority) < 0) return -1;
+      if(budgetCPU >= 0) budget.setBudget(budgetCPU, budgetRate);
+   }
+
+   if(replayFile != "") return replay(replayFile, replayRate, config, remap, psd, frameNo, ds9, mirrors);
+
+   if(mosaicNames.size() > 1) return mosaic(mosaicNames, mosaicCols, mosaicAlign, alignTolerance, config, remap, semaphoreNumber, frameNo, waitTime, pauseTime, budget, ds9, mirrors);
+
+   mx::improc::fitsMemHeader keywords;
+
+   //Republishes what is displayed, at the rate frames are processed
+   mx::milk::streamRelay relay;
+   if(outStream != "") relay.setup(outStream, decimate, average);
+   std::vector<char> relayBuffer; //used when the display buffer can't be republished
+
+   //Settings changed through XPA are applied between images, in the loop below
+   bool paused {false};
+   mx::milk::displayControl control;
+   mx::milk::displayControlState settings;
+   settings.config = config;
+   settings.waitTime = waitTime;
+   settings.frameNo = frameNo;
+   if(budget.joined()) settings.priority = budgetPriority;
+   control.open(controlName, settings);
+
+   //Records at the stream rate in its own thread, so it doesn't wait on the display
+   mx::milk::historyRing history;
+   history.setup(historySeconds);
+   size_t shownScrub = -1; //The history image in ds9, -1 if none
+
+   //Also in its own threads, writing from double buffers
+   mx::milk::fitsRecorder recorder;
+   recorder.setup(recordBase, recordDecimate, recordLimitMB*1048576);
+
+   //Scans every image in its own thread, so the loop below only shows events and a heartbeat
+   mx::milk::eventGate gate;
+   gate.setup(gateThreshold, gateCount, gatePre, gatePost);
+   if(gateMask != "" && gate.mask(gateMask) < 0) return -1;
+   std::vector<char> gateImage;
+   auto heartbeat = std::chrono::microseconds(gateHeartbeat > 0 ? static_cast<int64_t>(1e6/gateHeartbeat) : 0);
+   auto nextBeat = std::chrono::steady_clock::now();
+
+   //Measures every image in its own thread, and the display marks the latest centroid
+   mx::milk::frameMetrics metrics;
+   metrics.setup(metricsStream, metricsRadius);
+   mx::milk::frameMetricsResult measured;
+
+   //Trades rate, precision, binning and finally area for keeping up, leaving config and waitTime as requested
+   mx::milk::qosLadder qos;
+   qos.setup(qosLatency, qosSkip);
+   if(qos.enabled()) ds9.setPacing(0, true); //skipped updates are a measure of falling behind
+   std::chrono::steady_clock::time_point seenTime;
    
    while(!timeToDie)
    {
@@ -220,19 +940,23 @@ int main( int argc,
          reported = 0;
          close(SM_fd);
          
-         if( ImageStreamIO_openIm(&image, shmem_key.c_str()) == 0)
+         int rv = (windowSlices > 0) ? window.open(image, shmem_key) : ImageStreamIO_openIm(&image, shmem_key.c_str());
+         if( rv == 0)
          {
-            if(image.md[0].sem <= semaphoreNumber) 
+            if(image.md[0].sem <= (semaphoreNumber > 0 ? semaphoreNumber : 0))
             {
                std::cerr << "Creation not complete yet\n";
-               ImageStreamIO_closeIm(&image);
+               closeStream(image, window, semClaim);
                sleep(1); //We just need to wait for the server process to finish startup.
             }
             else
             {
-               sem = image.semptr[semaphoreNumber];
-               type_size = ImageStreamIO_typesize(image.md[0].datatype);
-               bitpix = ImageStreamIO_bitpix(image.md[0].datatype);
+               //Without a semaphore of its own the display polls cnt0, which works, but with up to pauseTime of latency
+               if(image.semptr && semClaim.claim(image, semaphoreNumber) < 0) std::cerr << "milk2ds9: polling for new images.\n";
+               type_size = mx::milk::milkTypeSize(image.md[0].datatype);
+               if(psd) pipeline = mx::milk::makeDisplayPipelinePSD(image.md[0].datatype);
+               else pipeline = mx::milk::makeDisplayPipeline(image.md[0].datatype, remap);
+               if(relay.name() != "" && qos.enabled()) relayPipeline = psd ? mx::milk::makeDisplayPipelinePSD(image.md[0].datatype) : mx::milk::makeDisplayPipeline(image.md[0].datatype, remap);
                opened = true;
             }
          }
@@ -242,53 +966,314 @@ int main( int argc,
          }
       }
 
+      if(!opened) break;
+
+      if(!pipeline)
+      {
+         std::cerr << "milk2ds9: datatype " << (int) image.md[0].datatype << " is not supported.\n";
+         closeStream(image, window, semClaim);
+         return -1;
+      }
+
       int curr_image;
       size_t snx, sny, snz;
       size_t last_snx = image.md[0].size[0];
       size_t last_sny = image.md[0].size[1];
       size_t last_snz = image.md[0].size[2];
 
+      //With a remap the ROI is in the remapped image
+      size_t roi_nx = remap ? remap->width : last_snx;
+      size_t roi_ny = remap ? remap->height : last_sny;
+
+      if(pipeline->configure(last_snx, last_sny, qos.config(config, roi_nx, roi_ny)) < 0 && pipeline->configure(last_snx, last_sny, config) < 0)
+      {
+         std::cerr << "milk2ds9: ROI and binning leave nothing to display.\n";
+         closeStream(image, window, semClaim);
+         return -1;
+      }
+
+      if(relayPipeline && relayPipeline->configure(last_snx, last_sny, config) < 0) relayPipeline.reset();
+
       uint64_t last_cnt0 = -1;
+
+      if(history.start(image, -1) < 0)
+      {
+         std::cerr << "milk2ds9: history will not be recorded.\n";
+      }
+
+      keywordHeader(keywords, image);
+      if(recorder.start(image, recordSemaphore, keywords) < 0)
+      {
+         std::cerr << "milk2ds9: stream will not be recorded.\n";
+      }
+
+      if(gateCount > 0 && gate.start(image, -1) < 0)
+      {
+         std::cerr << "milk2ds9: events can not be detected.  Showing every image.\n";
+      }
+
+      metricsROI(metrics, config, last_snx, last_sny, (remap != nullptr));
+      if(metrics.start(image, -1) < 0)
+      {
+         std::cerr << "milk2ds9: images will not be measured.\n";
+      }
       
       while(!timeToDie)
       {
-         errno = 0;
-         if(image.md->cnt0 != last_cnt0)
+         if(control.poll() > 0)
          {
-            if(image.md[0].size[2] > 0)
+            settings = control.state();
+
+            if(pipeline->configure(last_snx, last_sny, qos.config(settings.config, roi_nx, roi_ny)) < 0)
             {
-               curr_image = image.md[0].cnt1 - 1;
-               if(curr_image < 0) curr_image = image.md[0].size[2] - 1;
+               std::cerr << "milk2ds9: ROI and binning leave nothing to display.  Ignored.\n";
+               settings.config = config;
+               control.state(settings);
+               pipeline->configure(last_snx, last_sny, qos.config(config, roi_nx, roi_ny));
             }
-            else curr_image = 0;
 
-            snx = image.md[0].size[0];
-            sny = image.md[0].size[1];
-            snz = image.md[0].size[2];
-         
-            last_cnt0 = image.md->cnt0;
-            
-            if( snx != last_snx || sny != last_sny || snz != last_snz )
+            config = settings.config;
+            if(relayPipeline && relayPipeline->configure(last_snx, last_sny, config) < 0) relayPipeline.reset();
+            waitTime = settings.waitTime;
+            frameNo = settings.frameNo;
+            paused = settings.paused;
+
+            if(historySeconds <= 0 && settings.frozen)
             {
-               std::cerr << "\nSize change detected!\n\n";
-               break;
+               std::cerr << "milk2ds9: no history is being recorded (use -H).  Ignored.\n";
+               settings.frozen = false;
+               settings.dump = "";
+               control.state(settings);
             }
-         
+
+            history.freeze(settings.frozen);
+
+            budget.priority(settings.priority);
+            if(settings.budgetChanged)
+            {
+               if(budget.joined()) budget.setBudget(settings.budgetCPU, settings.budgetRate);
+               else std::cerr << "milk2ds9: not sharing a display budget (use -B).  Ignored.\n";
+               settings.budgetChanged = false;
+               control.state(settings);
+            }
+         }
+
+         if(qos.update() > 0)
+         {
+            if(pipeline->configure(last_snx, last_sny, qos.config(config, roi_nx, roi_ny)) < 0) pipeline->configure(last_snx, last_sny, config);
+         }
+
+         metricsROI(metrics, config, last_snx, last_sny, (remap != nullptr)); //follows a new -r ROI, but not the QoS ladder
+
+         //Hidden frames are not worth processing, and one which comes back into view gets the newest image at once
+         if(ds9.pollVisibility() > 0) last_cnt0 = -1;
+         bool visible = ds9.frameVisible(frameNo);
+         for(size_t n = 0; n < mirrors.size(); ++n)
+         {
+            if(mirrors[n]->pollVisibility() > 0) last_cnt0 = -1;
+            visible = (visible || mirrors[n]->frameVisible(frameNo));
+         }
+         budget.visible(visible && !paused && !settings.frozen);
+
+         //Sends the last image as soon as a starting ds9 is up
+         ds9.ready();
+         ds9.captureViewState();
+
+         for(size_t n = 0; n < mirrors.size(); ++n)
+         {
+            mirrors[n]->ready();
+            mirrors[n]->captureViewState();
+         }
+
+         if(freezeToggled)
+         {
+            freezeToggled = 0;
+
+            if(historySeconds > 0)
+            {
+               settings.frozen = !settings.frozen;
+               settings.scrub = 0;
+               control.state(settings);
+               history.freeze(settings.frozen);
+            }
+         }
+
+         //While frozen the history is shown in place of the live images
+         if(settings.frozen)
+         {
+            if(history.frozen())
+            {
+               if(settings.dump != "")
+               {
+                  keywordHeader(keywords, image);
+                  std::string fname = dumpDir + "/" + settings.dump;
+                  if(history.dump(fname, keywords) == 0) std::cerr << "milk2ds9: wrote history to " << fname << "\n";
+                  settings.dump = "";
+                  control.state(settings);
+               }
+
+               const void * im = history.frame(settings.scrub);
+
+               void * buf = nullptr;
+               if(im && settings.scrub != shownScrub) buf = ds9.displayBuffer(pipeline->bitpix(), pipeline->pixsz(), pipeline->dim1(), pipeline->dim2(), 1, frameNo);
+
+               if(buf)
+               {
+                  pipeline->process(buf, im);
+                  ds9.displayCommit(frameNo);
+
+                  for(size_t n = 0; n < mirrors.size(); ++n) mirrors[n]->mirror(ds9, frameNo);
+
+                  shownScrub = settings.scrub;
+               }
+            }
+
+            usleep(pauseTime);
+            continue;
+         }
+
+         if(shownScrub != (size_t) -1) last_cnt0 = -1; //put the live image back
+         shownScrub = -1;
+
+         //When gated, queued events go out as soon as they are found, and the live image only at the heartbeat
+         const void * gateIm = nullptr;
+         bool fresh = (image.md->cnt0 != last_cnt0);
+         bool queued = false;
+         if(gate.following())
+         {
+            queued = gate.waiting();
+            if(!queued && fresh && std::chrono::steady_clock::now() < nextBeat) fresh = false;
+         }
+
+         //Over the host's display budget nothing is taken, so the newest image, or the next event, goes out when there is room
+         if((fresh || queued) && !paused && visible && !budget.admit()) fresh = queued = false;
+
+         if(queued && gate.next(gateImage)) gateIm = gateImage.data();
+
+         errno = 0;
+         if(fresh || gateIm)
+         {
+            if(fresh)
+            {
+               semClaim.drain(); //the posts up to now are all for this image, or older ones
+
+               if(image.md[0].size[2] > 0)
+               {
+                  curr_image = image.md[0].cnt1 - 1;
+                  if(curr_image < 0) curr_image = image.md[0].size[2] - 1;
+               }
+               else curr_image = 0;
+
+               snx = image.md[0].size[0];
+               sny = image.md[0].size[1];
+               snz = image.md[0].size[2];
             
+               last_cnt0 = image.md->cnt0;
+               
+               if( snx != last_snx || sny != last_sny || snz != last_snz )
+               {
+                  std::cerr << "\nSize change detected!\n\n";
+                  break;
+               }
+
+               nextBeat = std::chrono::steady_clock::now() + heartbeat;
+               seenTime = std::chrono::steady_clock::now();
+            }
             
-            ds9.display( (void *) (image.array.SI8 + curr_image*snx*sny*type_size), bitpix, type_size, snx, sny, 1, frameNo);
+            if(fitsHeader) keywordHeader(keywords, image);
+
+            const void * im = gateIm;
+            if(!im) im = window.isOpen() ? window.slice(curr_image) : image.array.SI8 + curr_image*snx*sny*type_size;
+
+            //The relay carries the product as configured, so its shape doesn't follow the QoS ladder
+            mx::milk::displayPipeline * relayPipe = (relayPipeline && qos.level() >= mx::milk::qosPrecision) ? relayPipeline.get() : pipeline.get();
+
+            void * buf = nullptr;
+            if(!paused && visible && im) buf = ds9.displayBuffer(pipeline->bitpix(), pipeline->pixsz(), pipeline->dim1(), pipeline->dim2(), 1, keywords, frameNo);
+
+            if(buf)
+            {
+               double cpu = mx::milk::displayBudget::threadCPU();
+
+               pipeline->process(buf, im);
+               control.frameDone(pipeline->stats());
+               if(relayPipe == pipeline.get()) relay.publish(buf, pipeline->bitpix(), pipeline->dim1(), pipeline->dim2()); //before the commit puts it in FITS order
+               int rv = ds9.displayCommit(frameNo);
+
+               //Shown in a window which is visible, and skipped for pacing by a window which is visible
+               bool shown = (rv == 0);
+               bool paced = (rv == 1);
+
+               std::vector<int> mirrorRv(mirrors.size());
+               for(size_t n = 0; n < mirrors.size(); ++n)
+               {
+                  mirrorRv[n] = mirrors[n]->mirror(ds9, frameNo);
+                  shown = (shown || mirrorRv[n] == 0);
+                  paced = (paced || mirrorRv[n] == 1);
+               }
+
+               //Event images are late by design, so only live ones count against the latency.  Hidden windows are
+               //not falling behind, so only pacing counts as a skip.
+               if(qos.enabled() && !gateIm)
+               {
+                  timespec now;
+                  clock_gettime(CLOCK_REALTIME, &now);
+                  double latency = (now.tv_sec - image.md[0].atime.tv_sec) + (now.tv_nsec - image.md[0].atime.tv_nsec)/1e9;
+
+                  //Without a usable acquisition time, count from when the image was noticed
+                  if(image.md[0].atime.tv_sec == 0 || latency < 0 || latency > 60)
+                  {
+                     latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - seenTime).count();
+                  }
+
+                  qos.frame(latency, paced && !shown);
+               }
+
+               //The centroid, in ds9's 1-based coordinates of the displayed (binned) image, in each window showing it
+               if(shown && !remap && metrics.latest(measured))
+               {
+                  double bin = pipeline->config().bin;
+                  double x = (measured.x - pipeline->roiX() - 0.5*(bin-1))/bin + 1;
+                  double y = (measured.y - pipeline->roiY() - 0.5*(bin-1))/bin + 1;
+
+                  char reg[128];
+                  snprintf(reg, sizeof(reg), "image; point(%.2f,%.2f) # point=cross color=green", x, y);
+
+                  if(rv == 0) ds9.overlay("milk2ds9", reg, frameNo);
+
+                  for(size_t n = 0; n < mirrors.size(); ++n)
+                  {
+                     if(mirrorRv[n] == 0) mirrors[n]->overlay("milk2ds9", reg, frameNo);
+                  }
+               }
+
+               budget.charge(mx::milk::displayBudget::threadCPU() - cpu);
+            }
+
+            if(relay.name() != "" && im && (!buf || relayPipe != pipeline.get()))
+            {
+               relayBuffer.resize(relayPipe->dim1()*relayPipe->dim2()*relayPipe->pixsz());
+               relayPipe->process(relayBuffer.data(), im);
+               relay.publish(relayBuffer.data(), relayPipe->bitpix(), relayPipe->dim1(), relayPipe->dim2());
+            }
          
-            usleep(waitTime);
+            usleep(qos.waitTime(waitTime));
          }
          else
          {
             if(image.md[0].sem <= 0) break; //Indicates that the server has cleaned up.
-            
-            usleep(pauseTime);
+
+            //Woken by the next post, rather than at the next poll
+            if(semClaim.index() < 0) usleep(pauseTime);
+            else semClaim.wait(pauseTime);
          }
       }
 
-      if(opened) ImageStreamIO_closeIm(&image);
+      history.stop();
+      recorder.stop();
+      gate.stop();
+      metrics.stop();
+      closeStream(image, window, semClaim);
    }
    return 0;
 }
@@ -28,34 +28,52 @@
 #ifndef improc_ds9Interface_hpp
 #define improc_ds9Interface_hpp
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include <fnmatch.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <xpa.h>
 
 
 #include "../ipc/sharedMemSegment.hpp"
+#include "../ipc/fileMemSegment.hpp"
 #include "fitsUtils.hpp"
+#include "fitsMemHeader.hpp"
+#include "imageKernels.hpp"
 
 #ifndef DS9INTERFACE_NO_EIGEN
 #include "eigenImage.hpp"
 #endif
 
+extern char **environ;
+
 namespace mx
 {
 namespace improc
 {
 
 #ifndef DS9INTERFACE_SPAWN_SLEEP
-/// The time to sleep after spawning, in msecs, while checking for the new instance to be ready.
-/**
+/// The time to sleep after spawning, in msecs, between checks for the new instance's access point.
+/** This only bounds the latency of noticing the new instance, the wait ends as soon as it registers.
+  * 
   * \ingroup image_processing
   * \ingroup plotting
   */
-#define DS9INTERFACE_SPAWN_SLEEP (100)
+#define DS9INTERFACE_SPAWN_SLEEP (10)
 #endif
 
 #ifndef DS9INTERFACE_SPAWN_TIMEOUT
@@ -64,7 +82,52 @@ namespace improc
   * \ingroup image_processing
   * \ingroup plotting
   */
-#define DS9INTERFACE_SPAWN_TIMEOUT (2000)
+#define DS9INTERFACE_SPAWN_TIMEOUT (10000)
+#endif
+
+#ifndef DS9INTERFACE_CAPTURE_INTERVAL
+/// The minimum time between captures of the ds9 view state, in msecs.
+/**
+  * \ingroup image_processing
+  * \ingroup plotting
+  */
+#define DS9INTERFACE_CAPTURE_INTERVAL (2000)
+#endif
+
+#ifndef DS9INTERFACE_MONITOR_SLEEP
+/// The time the monitor thread sleeps between checks for work, in msecs.
+/**
+  * \ingroup image_processing
+  * \ingroup plotting
+  */
+#define DS9INTERFACE_MONITOR_SLEEP (50)
+#endif
+
+#ifndef DS9INTERFACE_VISIBILITY_INTERVAL
+/// The minimum time between polls of which frames ds9 is showing, in msecs.
+/**
+  * \ingroup image_processing
+  * \ingroup plotting
+  */
+#define DS9INTERFACE_VISIBILITY_INTERVAL (500)
+#endif
+
+#ifndef DS9INTERFACE_PACING_FACTOR
+/// With adaptive pacing, the minimum time between updates as a multiple of the time the last update took.
+/**
+  * \ingroup image_processing
+  * \ingroup plotting
+  */
+#define DS9INTERFACE_PACING_FACTOR (4)
+#endif
+
+#ifndef DS9INTERFACE_CACHE_MAX
+/// The maximum number of access points kept in the access point cache file.
+/**
+  * \ingroup image_processing
+  * \ingroup plotting
+  */
+#define DS9INTERFACE_CACHE_MAX (32)
 #endif
 
 #ifndef DS9INTERFACE_CMD_MAX_LENGTH
@@ -76,6 +139,19 @@ namespace improc
 #define DS9INTERFACE_CMD_MAX_LENGTH (512)
 #endif
 
+///How segments are allocated, see ds9Interface::segmentBackend
+/**
+  * \ingroup image_processing
+  * \ingroup plotting
+  */
+enum class ds9SegmentBackend
+{
+   automatic, ///< SysV shared memory, unless the segment is larger than the SysV limits allow
+   sysv,      ///< SysV shared memory, loaded with "shm"
+   mmap,      ///< A memory file, loaded with "mmap"
+   huge       ///< A memory file backed by huge pages where available, loaded with "mmap"
+};
+
 
 class ds9Segment : public ipc::sharedMemSegment
 {
@@ -84,7 +160,27 @@ public:
    size_t dim2 {0};
    size_t dim3 {0};
    int bitpix {0};
-   
+
+   bool fits {false}; ///< Whether the segment currently holds a FITS file rather than a bare array
+   size_t headerCards {0}; ///< The number of header cards currently in the segment, not including END
+   size_t headerSize {0}; ///< The size of the FITS header at the start of the segment, in bytes
+
+   improc::fitsMemHeader header; ///< Working space for formatting this frame's header
+
+   bool reload {false}; ///< Whether the next commit must send a new shm command rather than update
+   bool native {true}; ///< Whether the pixels in a FITS segment are still in native byte order
+
+   bool mirrored {false}; ///< Whether the memory belongs to another ds9Interface, see ds9Interface::mirror
+
+   ipc::fileMemSegment file; ///< The memory file holding the segment, if the file backend is used
+   std::string mapPath; ///< The path ds9 maps, empty if the segment is SysV shared memory
+
+   bool visible {true}; ///< Whether ds9 was showing this frame when last polled, see ds9Interface::pollVisibility
+
+   std::vector<std::string> view; ///< The commands which restore the captured view of this frame
+   std::string regions; ///< The captured regions of this frame, in ds9 format and image coordinates
+
+   std::string overlayTag; ///< The tag of the overlay last drawn in this frame, see ds9Interface::overlay
 };
 
 /// An interface to the ds9 image viewer.
@@ -115,6 +211,81 @@ protected:
    ///Whether or not the connect() procedure has completed successfully.
    bool m_connected {false};
 
+   ///Whether connect() returns immediately after spawning, rather than waiting for ds9 to be ready.
+   bool m_asyncSpawn {false};
+
+   ///Whether a spawned ds9 is still starting up
+   bool m_spawning {false};
+
+   ///The pid of the spawned ds9
+   pid_t m_spawnPid {0};
+
+   ///The time ds9 was spawned
+   std::chrono::steady_clock::time_point m_spawnTime;
+
+   ///The time ready() last looked up a starting ds9
+   std::chrono::steady_clock::time_point m_readyTime;
+
+   ///Whether the view state is captured and replayed after reconnecting
+   std::atomic<bool> m_viewReplay {false};
+
+   ///The time the view state was last captured
+   std::chrono::steady_clock::time_point m_captureTime;
+
+   ///Whether updates of frames ds9 is not showing are suspended
+   std::atomic<bool> m_visibilityCheck {false};
+
+   ///The time the visible frames were last polled
+   std::chrono::steady_clock::time_point m_visibilityTime;
+
+   ///The frame which was current when the view state was last captured, 0 if none.
+   size_t m_currentFrame {0};
+
+   ///The thread which queries ds9 off the display path, see toggleMonitor
+   std::thread m_monitor;
+
+   ///Whether the monitor thread is running
+   std::atomic<bool> m_monitorRun {false};
+
+   ///Protects the access point and the results shared with the monitor thread
+   std::mutex m_monitorMutex;
+
+   ///The ip:port the monitor thread queries, empty if not connected
+   std::string m_monitorAP;
+
+   ///The frame the monitor thread last captured the view of, 0 if nothing new
+   size_t m_capturedFrame {0};
+
+   ///The view the monitor thread last captured
+   std::vector<std::string> m_capturedView;
+
+   ///The regions the monitor thread last captured, empty if they could not be read
+   std::string m_capturedRegions;
+
+   ///Whether the monitor thread has polled the visible frames since they were last taken over
+   bool m_polled {false};
+
+   ///Whether the ds9 window was iconified when the monitor thread last polled
+   bool m_polledIconified {false};
+
+   ///The frame ds9 was showing when the monitor thread last polled, 0 if all
+   size_t m_polledFrame {0};
+
+   ///The minimum time between updates, in secs.
+   double m_minInterval {0};
+
+   ///Whether the time between updates also adapts to how long ds9 takes to respond
+   bool m_adaptivePacing {false};
+
+   ///The time the last shm or update command was sent
+   std::chrono::steady_clock::time_point m_sendTime;
+
+   ///How long ds9 took to respond to the last shm or update command, in secs.
+   double m_sendDuration {0};
+
+   ///The frame last selected by mirror, 0 if none
+   size_t m_mirrorFrame {0};
+
    ///A vector of shared memory segments, one per frame
    //std::vector<ipc::sharedMemSegment> m_segs;
    std::vector<ds9Segment> m_segs;
@@ -125,6 +296,12 @@ protected:
    bool m_preservePan{true};
    bool m_panPreserved {false};
 
+   ///Whether to write a FITS header in front of the pixels and load with "shm fits"
+   bool m_fitsHeader {false};
+
+   ///How new segments are allocated
+   ds9SegmentBackend m_segmentBackend {ds9SegmentBackend::automatic};
+
 
 public:
 
@@ -177,24 +354,223 @@ public:
 
    ///Establish the existence of the desired DS9 XPA access point, spawning a new instance if needed.
    /** This isn't really a "connection", the main point is to get the unique ip:port name of the
-     * DS9 instance we will be communicating with.
+     * DS9 instance we will be communicating with.  An access point found previously is tried first,
+     * from the cache file, so that a restarted program reattaches without a name server lookup.
+     *
+     * After spawning, the access point is checked every DS9INTERFACE_SPAWN_SLEEP msecs, so the wait ends
+     * as soon as ds9 registers.  With async spawning on, connect returns 1 instead of waiting, and each
+     * later call checks again.  Images displayed in the meantime are kept in their segments and sent
+     * as soon as ds9 is ready.
      *
      * \retval 0 on success.
+     * \retval 1 if a spawned ds9 is still starting up, with async spawning on.
      * \retval -1 on error.
      */
    int connect();
 
+   ///Check whether a spawned ds9 is ready, sending any images displayed while it was starting if so.
+   /** Call this periodically, so that the last image appears as soon as ds9 is ready, and a spawned ds9 which has
+     * exited is reaped.
+     *
+     * \retval 0 if connected
+     * \retval 1 if a spawned ds9 is still starting up
+     * \retval -1 on error.
+     */
+   int ready();
+
+   ///Turn async spawning on or off
+   /** See \ref connect.
+     */
+   void toggleAsyncSpawn(bool onoff);
+
    int XPASet( const char * cmd );
 
+   ///Send a command with data, as with xpaset.
+   /**
+     * \retval 0 on sucess
+     * \retval -1 on an error.
+     */
+   int XPASet( const char * cmd, ///< [in] the command
+               const char * buf, ///< [in] the data to send
+               size_t len        ///< [in] the length of the data
+             );
+
+   ///Query ds9, as with xpaget.
+   /** Trailing whitespace is removed from the result.  Only queries an existing connection.
+     *
+     * \retval 0 on sucess
+     * \retval -1 on an error, or if not connected.
+     */
+   int XPAGet( std::string & result, ///< [out] the reply
+               const char * cmd      ///< [in] the query
+             );
+
+   ///Turn capture and replay of the view state on or off
+   /** See \ref captureViewState.
+     */
+   void toggleViewReplay(bool onoff);
+
+   ///Start or stop the monitor thread
+   /** The monitor thread makes the queries of \ref captureViewState and \ref pollVisibility with its own XPA handle,
+     * so that a slow ds9 does not hold up the display loop.  Its results are taken over by the next call of each.
+     */
+   void toggleMonitor(bool onoff);
+
+   ///Capture the view state of the current ds9 frame.
+   /** If the current frame is one of ours, its zoom, pan, rotation, scale, colormap and regions are
+     * recorded.  After a reconnect, for instance when ds9 is restarted after a crash, every frame's
+     * captured state is replayed right after its image is re-sent, and the current frame is restored.
+     *
+     * The capture takes several XPAGet queries, made at most every DS9INTERFACE_CAPTURE_INTERVAL msecs unless forced.
+     * With the monitor thread running they are made there, and this only stores its latest capture.
+     *
+     * \retval 0 on success, or if nothing was done
+     * \retval -1 on an error.
+     */
+   int captureViewState( bool force = false /**< [in] [optional] capture even if the interval has not passed */);
+
+   ///Turn suspending updates of frames ds9 is not showing on or off
+   /** See \ref pollVisibility.
+     */
+   void toggleVisibilityCheck(bool onoff);
+
+   ///Poll ds9 for which of our frames it is showing.
+   /** With the check on, a frame is hidden if the ds9 window is iconified, or if ds9 is in single frame mode and the
+     * frame is not the current one.  In tile or blink mode all frames are shown.  Hidden frames are neither selected
+     * nor updated: \ref displayCommit and \ref mirror skip them, and \ref display skips the copy as well.  Callers
+     * producing images with \ref displayBuffer should check \ref frameVisible first and skip the work too.
+     *
+     * The poll takes a few XPAGet queries, made at most every DS9INTERFACE_VISIBILITY_INTERVAL msecs unless forced.
+     * With the monitor thread running they are made there, and this only applies its latest poll.
+     *
+     * \retval 1 if a frame became visible, so its newest image should be displayed now
+     * \retval 0 if no frame became visible, or if nothing was done
+     * \retval -1 on an error.
+     */
+   int pollVisibility( bool force = false /**< [in] [optional] poll even if the interval has not passed */);
+
+   ///Check whether ds9 was showing a frame when last polled.
+   /** Always true with the check off, or for a frame not yet displayed.
+     */
+   bool frameVisible( int frame /**< [in] the frame*/) const;
+
 protected:
+   ///Get the lock serializing calls into the XPA library, which keeps global state
+   static std::mutex & xpaMutex();
+
+   ///Query an access point with an XPA handle, as with xpaget.
+   /** Trailing whitespace is removed from the result.
+     *
+     * \retval 0 on sucess
+     * \retval -1 on an error.
+     */
+   static int xpaGet( XPA x,                          ///< [in] the XPA handle
+                      const std::string & ipAndPort, ///< [in] the access point
+                      std::string & result,          ///< [out] the reply
+                      const char * cmd               ///< [in] the query
+                    );
+
+   ///Query the view state of the current ds9 frame.
+   /**
+     * \retval 0 on sucess
+     * \retval -1 on an error.
+     */
+   static int queryViewState( XPA x,                          ///< [in] the XPA handle
+                              const std::string & ipAndPort, ///< [in] the access point
+                              size_t & frame,                ///< [out] the current frame
+                              std::vector<std::string> & view, ///< [out] the commands which restore its view
+                              std::string & regions           ///< [out] its regions, empty if they could not be read
+                            );
+
+   ///Query which frames ds9 is showing.
+   /**
+     * \retval 0 on sucess
+     * \retval -1 on an error.
+     */
+   static int queryVisibility( XPA x,                          ///< [in] the XPA handle
+                               const std::string & ipAndPort, ///< [in] the access point
+                               bool & iconified,              ///< [out] whether the window is iconified
+                               size_t & current               ///< [out] the frame shown, 0 if all are
+                             );
+
+   ///The monitor thread
+   void monitor();
+
    ///Spawn (open) the ds9 image viewer
-   /** This forks and execs.  An error is returned if exec fails.
+   /** This uses posix_spawn, which avoids copying the page tables of a large calling process.
+     * An error is returned if ds9 can not be started.
      *
      * \retval 0 on sucess
      * \retval -1 on an error.
      */
    int spawn();
 
+   ///Get the XPA template for the access point, based on the title
+   std::string accessTemplate();
+
+   ///Look up the access point
+   /**
+     * \retval 0 if found, in which case ipAndPort is set
+     * \retval -1 if not found
+     */
+   int lookup( std::string & ipAndPort,            ///< [out] the ip:port of the access point
+               const std::string & tmpl,           ///< [in] the template to look up, either a class:name or an ip:port
+               std::string * className = nullptr ///< [out] [optional] the class:name of the access point found
+             );
+
+   ///Reap a spawned ds9 which has exited, so it does not linger as a zombie.
+   /**
+     * \retval true if it had exited
+     * \retval false if it is running, or none was spawned
+     */
+   bool reap();
+
+   ///Finish connecting to an access point.
+   /** Records the access point in the cache, and sends any images waiting in the segments.
+     */
+   int connected( const std::string & tmpl,     ///< [in] the template used for the lookup
+                  const std::string & ipAndPort ///< [in] the ip:port found
+                );
+
+   ///Get the path of the access point cache file
+   /** This is $XDG_RUNTIME_DIR/ds9Interface.cache if set, otherwise /tmp/ds9Interface.<uid>.cache
+     */
+   static std::string cachePath();
+
+   ///Get the ip:port cached for a template
+   /**
+     * \retval 0 if found
+     * \retval -1 if not
+     */
+   static int cacheGet( std::string & ipAndPort, ///< [out] the cached ip:port
+                        const std::string & tmpl ///< [in] the template
+                      );
+
+   ///Store the ip:port for a template in the cache
+   /** If ipAndPort is empty, the entry for the template is removed.
+     */
+   static void cachePut( const std::string & tmpl,     ///< [in] the template
+                         const std::string & ipAndPort ///< [in] the ip:port
+                       );
+
+   ///Whether an update now would be too soon under the pacing settings.
+   bool paced();
+
+   ///Replay the captured view state of each frame, then restore the current frame.
+   /** ds9 8 and later parse a command line of several commands, each after the first given with a leading dash,
+     * so the views of all frames are sent as one batch.  Older versions get one command at a time.  Regions carry
+     * data, so are sent separately for each frame which has any.
+     */
+   int replayViewState();
+
+   ///Send the shm or update command for a segment
+   /** The frame must already be current in ds9.
+     *
+     * \retval 0 on sucess
+     * \retval -1 on an error.
+     */
+   int sendSegment( size_t frame /**< [in] the frame number */);
+
    ///Add a segment corresponding to a particular frame in ds9
    /** Nothing is done if the frame already exists.  Note that this does not open a new frame in ds9.
      *
@@ -205,6 +581,21 @@ protected:
      */
    int addsegment(size_t frame /**< [in] the number of the new frame to initialize.  \note frame must be >= 1. */);
 
+   ///Allocate the memory of a segment with the configured backend
+   /**
+     * \retval 0 on sucess
+     * \retval -1 on an error
+     */
+   int createSegment( ds9Segment & seg, ///< [in] the segment, which must not be allocated
+                      size_t sz         ///< [in] the size to allocate
+                    );
+
+   ///Release the memory of a segment
+   void releaseSegment( ds9Segment & seg /**< [in] the segment */);
+
+   ///Check whether a new SysV segment of a given size fits within the kernel's limits
+   bool sysvFits( size_t sz /**< [in] the size of the segment */);
+
 public:
    ///Open a frame in ds9
    /** Nothing is done if the frame already exists.  First calls \ref addsegment.
@@ -222,11 +613,35 @@ public:
 
    int togglePreservePan(bool onoff);
 
+   ///Turn FITS header mode on or off
+   /** In FITS header mode a FITS header is written in front of the pixel data in each segment, and
+     * ds9 loads it with "shm fits".  This lets header keywords travel with the pixels, in the same command.
+     * Takes effect with the next call to display.
+     */
+   void toggleFitsHeader(bool onoff);
+
+   ///Get whether FITS header mode is on
+   bool fitsHeader();
+
+   ///Set how segments are allocated
+   /** SysV shared memory is limited by the kernel's shmmax and shmall, which some hosts set low, and a segment
+     * outlives a process which crashes.  The alternative is a memory file, made with memfd_create (or in /dev/shm),
+     * which ds9 loads with its "mmap" command.  It is freed when the last process using it exits, and can use
+     * huge pages.  In automatic mode SysV is used unless the segment won't fit in the limits.  Takes effect as
+     * segments are next allocated.
+     */
+   void segmentBackend(ds9SegmentBackend backend /**< [in] the backend for new segments */);
+
+   ///Get how segments are allocated
+   ds9SegmentBackend segmentBackend();
+
    ///Display an image in ds9.
    /** A new ds9 instance is opened if necessary, and a new sharedmemory segment is added if necessary.
      * The image is described by a pointer and its 2 or 3 dimensions.
      *
      * \retval 0 on sucess
+     * \retval 1 if the update was skipped for pacing
+     * \retval 2 if the update was skipped because the frame is hidden
      * \retval -1 on an error
      *
      */
@@ -239,6 +654,94 @@ public:
                 int frame = 1    ///< [in] [optional] the number of the new frame to initialize.  \note frame must be >= 1.
               );
 
+   ///Display an image in ds9, with header keywords.
+   /** As for \ref display(const void*, int, size_t, size_t, size_t, size_t, int), but in FITS header mode the
+     * keywords are written after the mandatory cards.  Between frames of the same shape only the cards which
+     * changed are rewritten.  The keywords are ignored if FITS header mode is off.
+     *
+     * \retval 0 on sucess
+     * \retval 1 if the update was skipped for pacing
+     * \retval 2 if the update was skipped because the frame is hidden
+     * \retval -1 on an error
+     *
+     */
+   int display( const void *im,                  ///< [in] the address of the image
+                int bitpix,                      ///< [in] the cfitsio image type
+                size_t pixsz,                    ///< [in] the size of a pixel, in bytes
+                size_t dim1,                     ///< [in] the first dimension of the image (in pixels)
+                size_t dim2,                     ///< [in] the second dimension of the image (in pixels)
+                size_t dim3,                     ///< [in] the third dimension of the image (in pixels), set to 1 if not a cube.
+                const fitsMemHeader & keywords,  ///< [in] the keyword cards to add to the header
+                int frame = 1                    ///< [in] [optional] the number of the new frame to initialize.  \note frame must be >= 1.
+              );
+
+   ///Get the buffer to write an image into, for display with \ref displayCommit
+   /** This lets a caller produce an image directly in the shared memory segment, avoiding a copy.
+     * The segment is re-allocated if necessary.  The pixels should be written in native order,
+     * any conversion needed for FITS header mode is done by displayCommit.
+     *
+     * \returns a pointer to the pixel data of the segment, which holds dim1*dim2*dim3*pixsz bytes
+     * \returns nullptr on an error
+     */
+   void * displayBuffer( int bitpix,                      ///< [in] the cfitsio image type
+                         size_t pixsz,                    ///< [in] the size of a pixel, in bytes
+                         size_t dim1,                     ///< [in] the first dimension of the image (in pixels)
+                         size_t dim2,                     ///< [in] the second dimension of the image (in pixels)
+                         size_t dim3,                     ///< [in] the third dimension of the image (in pixels), set to 1 if not a cube.
+                         const fitsMemHeader & keywords,  ///< [in] the keyword cards to add to the header in FITS header mode
+                         int frame = 1                    ///< [in] [optional] the number of the frame.  \note frame must be >= 1.
+                       );
+
+   ///Get the buffer to write an image into, for display with \ref displayCommit
+   /**
+     * \overload
+     */
+   void * displayBuffer( int bitpix,     ///< [in] the cfitsio image type
+                         size_t pixsz,   ///< [in] the size of a pixel, in bytes
+                         size_t dim1,    ///< [in] the first dimension of the image (in pixels)
+                         size_t dim2,    ///< [in] the second dimension of the image (in pixels)
+                         size_t dim3,    ///< [in] the third dimension of the image (in pixels), set to 1 if not a cube.
+                         int frame = 1   ///< [in] [optional] the number of the frame.  \note frame must be >= 1.
+                       );
+
+   ///Tell ds9 to display the image written into the buffer from \ref displayBuffer
+   /** If pacing is set (see \ref setPacing) and the last update was too recent, ds9 is not told.  It will
+     * show the image in the buffer, or a newer one, with a later update.
+     *
+     * \retval 0 on sucess
+     * \retval 1 if the update was skipped for pacing
+     * \retval 2 if the update was skipped because the frame is hidden
+     * \retval -1 on an error
+     */
+   int displayCommit( int frame = 1 /**< [in] [optional] the number of the frame.  \note frame must be >= 1.*/);
+
+   ///Show an image from another ds9Interface's segment in this one's ds9.
+   /** No image data are copied: this ds9 is told to load the source's shared memory segment, which the source
+     * has already filled with \ref display or \ref displayCommit.  So one copy of an image can feed several
+     * ds9 instances, each one costing only the XPA command.  After the first time, the frame is only
+     * selected in ds9 if a different frame was mirrored last, so with one frame per ds9 each update is
+     * a single command.
+     *
+     * This instance's pacing applies, so a slow ds9 can be updated less often than a fast one.
+     *
+     * \retval 0 on sucess
+     * \retval 1 if the update was skipped for pacing
+     * \retval 2 if the update was skipped because the frame is hidden
+     * \retval -1 on an error
+     */
+   int mirror( const ds9Interface & source, ///< [in] the ds9Interface which owns the segment
+               int frame = 1                ///< [in] [optional] the frame of the source to show, which is also the frame used here.
+             );
+
+   ///Set the pacing of updates.
+   /** Updates are not sent more often than minInterval.  With adaptive pacing they are also not sent more often
+     * than DS9INTERFACE_PACING_FACTOR times the time ds9 took to respond to the last one.  New shm commands,
+     * which are needed when the image changes shape, are never skipped.
+     */
+   void setPacing( double minInterval, ///< [in] the minimum time between updates, in secs.  0 for no minimum.
+                   bool adaptive       ///< [in] whether to also adapt to the ds9 response time
+                 );
+
    ///Display an image in ds9.
    /** A new ds9 instance is opened if necessary, and a new sharedmemory segment is added if necessary.
      * The image is described by a pointer and its 2 or 3 dimensions.
@@ -255,10 +758,26 @@ public:
                 int frame = 1    ///< [in] [optional] the number of the new frame to initialize.  \note frame must be >= 1.
               );
 
+   ///Display a view of an image inside a larger array in ds9.
+   /** The view is gathered straight into the shared memory segment, in one pass, so a sub-block, a transposed or
+     * flipped matrix, or a strided view needs no temporary copy.  See \ref imageView.
+     *
+     * \retval 0 on sucess
+     * \retval 1 if the update was skipped for pacing
+     * \retval 2 if the update was skipped because the frame is hidden
+     * \retval -1 on an error
+     */
+   template<typename dataT>
+   int display( const imageView<dataT> & view, ///< [in] the view to display
+                int frame = 1                  ///< [in] [optional] the number of the new frame to initialize.  \note frame must be >= 1.
+              );
+
    #ifndef DS9INTERFACE_NO_EIGEN
 
    /// Display an Eigen-like array in ds9.
-   /** Uses the rows(), cols(), and possibly planes(), methods of arrayT.
+   /** Uses the rows(), cols(), and possibly planes(), methods of arrayT.  Single images are displayed through
+     * their innerStride() and outerStride(), so blocks and maps of larger arrays, and row-major arrays, are shown
+     * correctly without a copy.
      *
      * see \ref display<typename dataT>(const dataT *im, size_t dim1, size_t dim2, size_t dim3, int frame=1) for more.
      *
@@ -292,6 +811,20 @@ public:
    
    int loadRegion( const std::string & fname
                  );
+
+   ///Replace an overlay of regions in a frame.
+   /** The regions are tagged, and the ones drawn by the last call are deleted first, so an overlay which follows the
+     * images (a centroid marker, say) can be redrawn with each one without disturbing the user's regions.  Call it
+     * after \ref displayCommit, when the frame is current.  Hidden frames are skipped.
+     *
+     * \retval 0 on sucess
+     * \retval 1 if the frame is hidden
+     * \retval -1 on an error
+     */
+   int overlay( const std::string & tag,     ///< [in] the tag of the overlay
+                const std::string & regions, ///< [in] the regions, in ds9 format, without the tag
+                int frame = 1                ///< [in] [optional] the frame, which should be current
+              );
    
    
    ///Shutdown the ds9 interface
@@ -334,13 +867,17 @@ ds9Interface::ds9Interface( const arrayT & array,
 
 ds9Interface::~ds9Interface()
 {
+   toggleMonitor(false);
    shutdown();
+
+   std::lock_guard<std::mutex> lock(xpaMutex());
    XPAClose(xpa);
 }
 
 inline
 void ds9Interface::initialize()
 {
+   std::lock_guard<std::mutex> lock(xpaMutex());
    xpa = XPAOpen(NULL);
 }
 
@@ -360,24 +897,8 @@ int ds9Interface::title(const std::string & nn)
 }
 
 inline
-int ds9Interface::connect()
+std::string ds9Interface::accessTemplate()
 {
-   
-   if(xpa) 
-   {
-      shutdown();
-      xpa = NULL;
-   }
-   
-   if(xpa == NULL)
-   {
-      xpa = XPAOpen(NULL);
-   }
-   
-   int  n = 1;
-   char *names[1];
-   names[0] = NULL;
-
    std::string tmpl;
    if( m_title.find(':', 0) == std::string::npos)
    {
@@ -391,89 +912,696 @@ int ds9Interface::connect()
       tmpl = m_title;
    }
 
+   return tmpl;
+}
+
+inline
+int ds9Interface::lookup( std::string & ipAndPort,
+                          const std::string & tmpl,
+                          std::string * className
+                        )
+{
+   int  n = 1;
+   char *names[1];
+   names[0] = NULL;
+
    char paramlist[] = "gsi";
 
+   std::unique_lock<std::mutex> lock(xpaMutex());
    int rv = XPAAccess(xpa, const_cast<char *>(tmpl.c_str()), paramlist, NULL, names, NULL, n);
+   lock.unlock();
 
-   if(rv == 0)
+   if(rv == 0 || names[0] == NULL)
    {
-      if( spawn() != 0) return -1;
-      if(names[0]) 
-      {
-         free(names[0]);
-         names[0] = NULL;
-      }
-      
-      int slept = 0;
-      while(rv == 0 && slept < DS9INTERFACE_SPAWN_TIMEOUT)
-      {
-         rv = XPAAccess(xpa, const_cast<char *>(tmpl.c_str()), paramlist, NULL, names, NULL, n);
+      if(names[0]) free(names[0]);
+      return -1;
+   }
 
-         usleep(DS9INTERFACE_SPAWN_SLEEP*1000);
-         slept += DS9INTERFACE_SPAWN_SLEEP;
-      }
+   char * st = strchr(names[0], ' ');
 
-      if(rv == 0)
-      {
-         std::cerr << "ds9Interface: failed to connect after attempting to spawn.  Timed out.\n";
-         if(names[0]) free(names[0]);
-         return -1;
-      }
+   if(st == NULL)
+   {
+      free(names[0]);
+      return -1;
    }
 
-   char * st = strchr(names[0], ' ');
+   ipAndPort = st + 1;
 
-   m_ipAndPort = st + 1;
+   if(className) className->assign(names[0], st - names[0]);
 
    free(names[0]);
 
-   m_connected = true;
-
    return 0;
 }
 
 inline
-int ds9Interface::spawn()
+std::string ds9Interface::cachePath()
 {
-   if(m_title == "" || m_title == "*") m_title = "ds9";
+   const char * rtdir = getenv("XDG_RUNTIME_DIR");
+
+   if(rtdir) return std::string(rtdir) + "/ds9Interface.cache";
+
+   return "/tmp/ds9Interface." + std::to_string(getuid()) + ".cache";
+}
+
+inline
+int ds9Interface::cacheGet( std::string & ipAndPort,
+                            const std::string & tmpl
+                          )
+{
+   std::ifstream fin(cachePath());
 
-   int pid = fork();
-   if (pid==0)
+   std::string t, ip;
+   while(fin >> t >> ip)
    {
-      /* Create a new SID for the child process so it is detached*/
-      pid_t sid = setsid();
-     
-      if (sid < 0) 
+      if(t == tmpl)
       {
-         std::cerr << "ds9Interface: failed to detach.\n";
-         perror("ds9Interface");
+         ipAndPort = ip;
+         return 0;
       }
-      
-      errno = 0;
-      execlp("ds9", "ds9", "-title", m_title.c_str(), (char *) 0);
-
-      std::cerr << "ds9Interface: spawning failed, execlp returned.\n";
-      perror("ds9Interface");
-
-      return -1;
    }
 
-   return 0;
+   return -1;
 }
 
 inline
-int ds9Interface::XPASet( const char * cmd )
+void ds9Interface::cachePut( const std::string & tmpl,
+                             const std::string & ipAndPort
+                           )
 {
-   if(!m_connected) if(connect() < 0) return -1;
+   std::vector<std::string> tmpls, ips;
 
+   //Most recent first, dropping the old entry for this template
+   if(ipAndPort != "")
+   {
+      tmpls.push_back(tmpl);
+      ips.push_back(ipAndPort);
+   }
+
+   std::string path = cachePath();
+
+   {
+      std::ifstream fin(path);
+      std::string t, ip;
+      while(fin >> t >> ip && tmpls.size() < DS9INTERFACE_CACHE_MAX)
+      {
+         if(t == tmpl) continue;
+         tmpls.push_back(t);
+         ips.push_back(ip);
+      }
+   }
+
+   //Write then rename, so concurrent readers never see a partial file
+   //mkstemp makes a new file, 0600, with an unpredictable name, so a link planted in /tmp is never followed
+   std::vector<char> tmpPath(path.begin(), path.end());
+   const char suffix[] = ".XXXXXX";
+   tmpPath.insert(tmpPath.end(), suffix, suffix + sizeof(suffix));
+
+   int fd = mkstemp(tmpPath.data());
+   if(fd < 0) return;
+
+   FILE * fout = fdopen(fd, "w");
+   if(fout == NULL)
+   {
+      close(fd);
+      unlink(tmpPath.data());
+      return;
+   }
+
+   bool ok = true;
+   for(size_t i = 0; i < tmpls.size(); ++i) ok = ok && (fprintf(fout, "%s %s\n", tmpls[i].c_str(), ips[i].c_str()) > 0);
+
+   if(fclose(fout) != 0 || !ok || rename(tmpPath.data(), path.c_str()) != 0) unlink(tmpPath.data());
+}
+
+inline
+int ds9Interface::connected( const std::string & tmpl,
+                             const std::string & ipAndPort
+                           )
+{
+   m_ipAndPort = ipAndPort;
+   m_connected = true;
+   m_spawning = false;
+   m_mirrorFrame = 0;
+
+   {
+      std::lock_guard<std::mutex> lock(m_monitorMutex);
+      m_monitorAP = ipAndPort;
+   }
+
+   cachePut(tmpl, ipAndPort);
+
+   //Send any images displayed while we were not connected
+   for(size_t i = 0; i < m_segs.size(); ++i)
+   {
+      if(!m_segs[i].reload || m_segs[i].size == 0) continue;
+
+      std::string cmd = "frame " + std::to_string(i+1);
+      if(XPASet(cmd.c_str()) < 0 || sendSegment(i+1) < 0)
+      {
+         m_connected = false;
+         return -1;
+      }
+   }
+
+   if(m_viewReplay) replayViewState();
+
+   return 0;
+}
+
+inline
+int ds9Interface::connect()
+{
+   std::string tmpl = accessTemplate();
+   std::string ipAndPort;
+
+   if(!m_spawning)
+   {
+      //Start over with the XPA handle, but keep the segments so their images can be sent again
+      {
+         std::lock_guard<std::mutex> lock(xpaMutex());
+         if(xpa) XPAClose(xpa);
+         xpa = XPAOpen(NULL);
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(m_monitorMutex);
+         m_monitorAP = "";
+      }
+
+      m_connected = false;
+      m_regionsPreserved = false;
+      m_panPreserved = false;
+
+      for(size_t i = 0; i < m_segs.size(); ++i) m_segs[i].reload = true;
+
+      //Reap a previously spawned instance which has exited
+      reap();
+
+      if(cacheGet(ipAndPort, tmpl) == 0)
+      {
+         //The port may since have been taken by another ds9, so it must still answer to our template
+         std::string found, className;
+         if(lookup(found, ipAndPort, &className) == 0 && fnmatch(tmpl.c_str(), className.c_str(), FNM_CASEFOLD) == 0)
+         {
+            return connected(tmpl, found);
+         }
+
+         cachePut(tmpl, "");
+      }
+
+      if(lookup(ipAndPort, tmpl) == 0) return connected(tmpl, ipAndPort);
+
+      if( spawn() != 0) return -1;
+   }
+
+   while(1)
+   {
+      if(lookup(ipAndPort, tmpl) == 0) return connected(tmpl, ipAndPort);
+
+      //Give up early if ds9 has already exited
+      if(reap())
+      {
+         std::cerr << "ds9Interface: ds9 exited while starting up.\n";
+         m_spawning = false;
+         return -1;
+      }
+
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_spawnTime;
+
+      if(elapsed.count()*1000 >= DS9INTERFACE_SPAWN_TIMEOUT)
+      {
+         std::cerr << "ds9Interface: failed to connect after attempting to spawn.  Timed out.\n";
+         m_spawning = false;
+         return -1;
+      }
+
+      if(m_asyncSpawn) return 1;
+
+      usleep(DS9INTERFACE_SPAWN_SLEEP*1000);
+   }
+}
+
+inline
+bool ds9Interface::reap()
+{
+   if(m_spawnPid <= 0) return false;
+
+   if(waitpid(m_spawnPid, NULL, WNOHANG) != m_spawnPid) return false;
+
+   m_spawnPid = 0;
+
+   return true;
+}
+
+inline
+int ds9Interface::ready()
+{
+   //A spawned ds9 the user closed is reaped here, rather than at the next reconnect
+   reap();
+
+   if(m_connected) return 0;
+
+   if(!m_spawning) return -1;
+
+   //Don't ask the name server on every call while ds9 starts
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   if(std::chrono::duration<double>(now - m_readyTime).count()*1000 < DS9INTERFACE_SPAWN_SLEEP) return 1;
+   m_readyTime = now;
+
+   return connect();
+}
+
+inline
+void ds9Interface::toggleAsyncSpawn(bool onoff)
+{
+   m_asyncSpawn = onoff;
+}
+
+inline
+int ds9Interface::spawn()
+{
+   if(m_title == "" || m_title == "*") m_title = "ds9";
+
+   posix_spawnattr_t attr;
+   posix_spawnattr_init(&attr);
+
+#ifdef POSIX_SPAWN_SETSID
+   //Create a new SID for the child process so it is detached
+   posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#endif
+
+   char * argv[] = { const_cast<char *>("ds9"), const_cast<char *>("-title"), const_cast<char *>(m_title.c_str()), NULL };
+
+   pid_t pid;
+   int rv = posix_spawnp(&pid, "ds9", NULL, &attr, argv, environ);
+
+   posix_spawnattr_destroy(&attr);
+
+   if(rv != 0)
+   {
+      std::cerr << "ds9Interface: spawning failed: " << strerror(rv) << "\n";
+      return -1;
+   }
+
+   m_spawnPid = pid;
+   m_spawnTime = std::chrono::steady_clock::now();
+   m_spawning = true;
+
+   return 0;
+}
+
+inline
+int ds9Interface::XPASet( const char * cmd )
+{
+   if(!m_connected) if(connect() != 0) return -1;
+
+   std::unique_lock<std::mutex> lock(xpaMutex());
    int rv = ::XPASet(xpa, const_cast<char *>(m_ipAndPort.c_str()), const_cast<char *>(cmd), NULL, NULL, 0, NULL, NULL, 1);
+   lock.unlock();
+
+   if(rv != 1)
+   {
+      std::cerr << "ds9Interface::XPASet: did not send cmd properly.\n";
+      return -1;
+   }
+   
+   return 0;
+}
+
+inline
+int ds9Interface::XPASet( const char * cmd,
+                          const char * buf,
+                          size_t len
+                        )
+{
+   if(!m_connected) if(connect() != 0) return -1;
+
+   std::unique_lock<std::mutex> lock(xpaMutex());
+   int rv = ::XPASet(xpa, const_cast<char *>(m_ipAndPort.c_str()), const_cast<char *>(cmd), NULL, const_cast<char *>(buf), len, NULL, NULL, 1);
+   lock.unlock();
+
+   if(rv != 1)
+   {
+      std::cerr << "ds9Interface::XPASet: did not send cmd properly.\n";
+      return -1;
+   }
+   
+   return 0;
+}
+
+inline
+int ds9Interface::XPAGet( std::string & result,
+                          const char * cmd
+                        )
+{
+   if(!m_connected) return -1;
+
+   return xpaGet(xpa, m_ipAndPort, result, cmd);
+}
+
+inline
+std::mutex & ds9Interface::xpaMutex()
+{
+   static std::mutex mtx;
+
+   return mtx;
+}
+
+inline
+int ds9Interface::xpaGet( XPA x,
+                          const std::string & ipAndPort,
+                          std::string & result,
+                          const char * cmd
+                        )
+{
+   char * bufs[1] = {NULL};
+   size_t lens[1] = {0};
+   char * names[1] = {NULL};
+   char * messages[1] = {NULL};
+
+   std::unique_lock<std::mutex> lock(xpaMutex());
+   int rv = ::XPAGet(x, const_cast<char *>(ipAndPort.c_str()), const_cast<char *>(cmd), NULL, bufs, lens, names, messages, 1);
+   lock.unlock();
+
+   bool ok = (rv == 1 && bufs[0] != NULL && messages[0] == NULL);
+
+   if(ok)
+   {
+      result.assign(bufs[0], lens[0]);
+
+      size_t e = result.find_last_not_of(" \t\n\r");
+      if(e == std::string::npos) result.clear();
+      else result.erase(e+1);
+   }
+
+   if(bufs[0]) free(bufs[0]);
+   if(names[0]) free(names[0]);
+   if(messages[0]) free(messages[0]);
+
+   return ok ? 0 : -1;
+}
+
+inline
+void ds9Interface::toggleViewReplay(bool onoff)
+{
+   m_viewReplay = onoff;
+}
+
+inline
+void ds9Interface::toggleMonitor(bool onoff)
+{
+   if(onoff == m_monitorRun) return;
+
+   if(onoff)
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_monitorMutex);
+         m_monitorAP = m_connected ? m_ipAndPort : "";
+      }
+
+      m_monitorRun = true;
+      m_monitor = std::thread(&ds9Interface::monitor, this);
+   }
+   else
+   {
+      m_monitorRun = false;
+      m_monitor.join();
+   }
+}
+
+inline
+int ds9Interface::queryViewState( XPA x,
+                                  const std::string & ipAndPort,
+                                  size_t & frame,
+                                  std::vector<std::string> & view,
+                                  std::string & regions
+                                )
+{
+   std::string val;
+
+   if(xpaGet(x, ipAndPort, val, "frame") < 0) return -1;
+
+   frame = strtoul(val.c_str(), NULL, 10);
+
+   view.clear();
+
+   if(xpaGet(x, ipAndPort, val, "zoom") == 0) view.push_back("zoom to " + val);
+   if(xpaGet(x, ipAndPort, val, "rotate") == 0) view.push_back("rotate to " + val);
+   if(xpaGet(x, ipAndPort, val, "pan image") == 0) view.push_back("pan to " + val + " image");
+   if(xpaGet(x, ipAndPort, val, "scale") == 0) view.push_back("scale " + val);
+
+   if(xpaGet(x, ipAndPort, val, "scale mode") == 0)
+   {
+      if(val == "user")
+      {
+         if(xpaGet(x, ipAndPort, val, "scale limits") == 0) view.push_back("scale limits " + val);
+      }
+      else view.push_back("scale mode " + val);
+   }
+
+   if(xpaGet(x, ipAndPort, val, "cmap") == 0) view.push_back("cmap " + val);
+   if(xpaGet(x, ipAndPort, val, "cmap value") == 0) view.push_back("cmap value " + val);
+
+   regions.clear();
+   if(xpaGet(x, ipAndPort, val, "regions -format ds9 -system image") == 0) regions = val;
+
+   return 0;
+}
+
+inline
+void ds9Interface::monitor()
+{
+   XPA x;
+
+   {
+      std::lock_guard<std::mutex> lock(xpaMutex());
+      x = XPAOpen(NULL);
+   }
+
+   std::chrono::steady_clock::time_point captureTime;
+   std::chrono::steady_clock::time_point visibilityTime;
+
+   while(m_monitorRun)
+   {
+      std::string ipAndPort;
+
+      {
+         std::lock_guard<std::mutex> lock(m_monitorMutex);
+         ipAndPort = m_monitorAP;
+      }
+
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+      if(ipAndPort != "" && m_viewReplay && std::chrono::duration<double>(now - captureTime).count()*1000 >= DS9INTERFACE_CAPTURE_INTERVAL)
+      {
+         captureTime = now;
+
+         size_t frame;
+         std::vector<std::string> view;
+         std::string regions;
+
+         if(queryViewState(x, ipAndPort, frame, view, regions) == 0)
+         {
+            std::lock_guard<std::mutex> lock(m_monitorMutex);
+            m_capturedFrame = frame;
+            m_capturedView.swap(view);
+            m_capturedRegions.swap(regions);
+         }
+      }
+
+      if(ipAndPort != "" && m_visibilityCheck && std::chrono::duration<double>(now - visibilityTime).count()*1000 >= DS9INTERFACE_VISIBILITY_INTERVAL)
+      {
+         visibilityTime = now;
+
+         bool iconified;
+         size_t current;
+
+         if(queryVisibility(x, ipAndPort, iconified, current) == 0)
+         {
+            std::lock_guard<std::mutex> lock(m_monitorMutex);
+            m_polled = true;
+            m_polledIconified = iconified;
+            m_polledFrame = current;
+         }
+      }
+
+      usleep(DS9INTERFACE_MONITOR_SLEEP*1000);
+   }
+
+   std::lock_guard<std::mutex> lock(xpaMutex());
+   XPAClose(x);
+}
+
+inline
+int ds9Interface::captureViewState( bool force )
+{
+   if(!m_viewReplay || !m_connected) return 0;
+
+   size_t frame = 0;
+   std::vector<std::string> view;
+   std::string regions;
+
+   if(m_monitorRun && !force)
+   {
+      std::lock_guard<std::mutex> lock(m_monitorMutex);
+      frame = m_capturedFrame;
+      m_capturedFrame = 0;
+      view.swap(m_capturedView);
+      regions.swap(m_capturedRegions);
+   }
+   else
+   {
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+      if(!force && std::chrono::duration<double>(now - m_captureTime).count()*1000 < DS9INTERFACE_CAPTURE_INTERVAL) return 0;
+
+      m_captureTime = now;
+
+      if(queryViewState(xpa, m_ipAndPort, frame, view, regions) < 0) return -1;
+   }
+
+   //Nothing new, or not one of ours
+   if(frame < 1 || frame > m_segs.size()) return 0;
+
+   m_currentFrame = frame;
+
+   m_segs[frame-1].view = view;
+
+   if(regions != "") m_segs[frame-1].regions = regions;
+
+   return 0;
+}
+
+inline
+void ds9Interface::toggleVisibilityCheck(bool onoff)
+{
+   m_visibilityCheck = onoff;
+
+   if(!onoff) for(size_t i = 0; i < m_segs.size(); ++i) m_segs[i].visible = true;
+}
+
+inline
+int ds9Interface::queryVisibility( XPA x,
+                                   const std::string & ipAndPort,
+                                   bool & iconified,
+                                   size_t & current
+                                 )
+{
+   std::string val;
+
+   current = 0; //0 for all frames shown
+   iconified = (xpaGet(x, ipAndPort, val, "iconify") == 0 && val == "yes");
+
+   if(iconified) return 0;
+
+   bool all = (xpaGet(x, ipAndPort, val, "tile") == 0 && val == "yes");
+   if(!all) all = (xpaGet(x, ipAndPort, val, "blink") == 0 && val == "yes");
+
+   if(all) return 0;
+
+   if(xpaGet(x, ipAndPort, val, "frame") < 0) return -1;
+   current = strtoul(val.c_str(), NULL, 10);
+
+   return 0;
+}
+
+inline
+int ds9Interface::pollVisibility( bool force )
+{
+   if(!m_visibilityCheck || !m_connected) return 0;
+
+   bool iconified;
+   size_t current;
+
+   if(m_monitorRun && !force)
+   {
+      std::lock_guard<std::mutex> lock(m_monitorMutex);
+
+      if(!m_polled) return 0;
+
+      m_polled = false;
+      iconified = m_polledIconified;
+      current = m_polledFrame;
+   }
+   else
+   {
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+      if(!force && std::chrono::duration<double>(now - m_visibilityTime).count()*1000 < DS9INTERFACE_VISIBILITY_INTERVAL) return 0;
+
+      m_visibilityTime = now;
+
+      if(queryVisibility(xpa, m_ipAndPort, iconified, current) < 0) return -1;
+   }
+
+   int rv = 0;
+   for(size_t i = 0; i < m_segs.size(); ++i)
+   {
+      bool visible = !iconified && (current == 0 || current == i+1);
+
+      if(visible && !m_segs[i].visible) rv = 1;
+      m_segs[i].visible = visible;
+   }
+
+   return rv;
+}
+
+inline
+bool ds9Interface::frameVisible( int frame ) const
+{
+   if(!m_visibilityCheck || frame < 1 || (size_t) frame > m_segs.size()) return true;
+
+   return m_segs[frame-1].visible;
+}
+
+inline
+int ds9Interface::replayViewState()
+{
+   std::string val;
+   bool batch = (XPAGet(val, "version") == 0 && val.find(' ') != std::string::npos && atoi(val.c_str() + val.find(' ') + 1) >= 8);
+
+   std::string cmds;
+
+   for(size_t i = 0; i < m_segs.size(); ++i)
+   {
+      if(m_segs[i].view.size() == 0) continue;
+
+      std::string cmd = "frame " + std::to_string(i+1);
+
+      if(batch)
+      {
+         cmds += (cmds == "") ? cmd : " -" + cmd;
+         for(size_t n = 0; n < m_segs[i].view.size(); ++n) cmds += " -" + m_segs[i].view[n];
+         continue;
+      }
 
-   if(rv != 1)
+      if(XPASet(cmd.c_str()) < 0) return -1;
+
+      for(size_t n = 0; n < m_segs[i].view.size(); ++n)
+      {
+         if(XPASet(m_segs[i].view[n].c_str()) < 0) return -1;
+      }
+   }
+
+   if(cmds != "" && XPASet(cmds.c_str()) < 0) return -1;
+
+   for(size_t i = 0; i < m_segs.size(); ++i)
    {
-      std::cerr << "ds9Interface::XPASet: did not send cmd properly.\n";
-      return -1;
+      if(m_segs[i].regions == "") continue;
+
+      std::string cmd = "frame " + std::to_string(i+1);
+      if(XPASet(cmd.c_str()) < 0) return -1;
+
+      if(XPASet("regions -format ds9 -system image", m_segs[i].regions.c_str(), m_segs[i].regions.size()) < 0) return -1;
    }
-   
+
+   if(m_currentFrame > 0 && m_currentFrame <= m_segs.size())
+   {
+      std::string cmd = "frame " + std::to_string(m_currentFrame);
+      if(XPASet(cmd.c_str()) < 0) return -1;
+   }
+
    return 0;
 }
 
@@ -494,6 +1622,7 @@ int ds9Interface::addsegment( size_t frame )
    {
       m_segs[i].initialize();
       m_segs[i].setKey(0, IPC_PRIVATE);
+      m_segs[i].file.initialize();
    }
 
    return 0;
@@ -509,7 +1638,7 @@ int ds9Interface::addframe( size_t frame )
 
    snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "frame %zu", frame);
 
-   if(!m_connected) if(connect() < 0) return -1;
+   if(!m_connected) if(connect() != 0) return -1;
 
    int rv = XPASet(cmd);
 
@@ -599,6 +1728,104 @@ int ds9Interface::togglePreservePan(bool onoff)
    return 0;
 }
 
+inline
+void ds9Interface::toggleFitsHeader(bool onoff)
+{
+   m_fitsHeader = onoff;
+}
+
+inline
+bool ds9Interface::fitsHeader()
+{
+   return m_fitsHeader;
+}
+
+inline
+void ds9Interface::segmentBackend(ds9SegmentBackend backend)
+{
+   m_segmentBackend = backend;
+}
+
+inline
+ds9SegmentBackend ds9Interface::segmentBackend()
+{
+   return m_segmentBackend;
+}
+
+inline
+int ds9Interface::createSegment( ds9Segment & seg,
+                                 size_t sz
+                               )
+{
+   bool sysv = (m_segmentBackend == ds9SegmentBackend::sysv);
+   if(m_segmentBackend == ds9SegmentBackend::automatic) sysv = sysvFits(sz);
+
+   if(sysv)
+   {
+      if(seg.create(sz) == 0)
+      {
+         seg.mapPath.clear();
+         return 0;
+      }
+
+      if(m_segmentBackend == ds9SegmentBackend::sysv)
+      {
+         std::cerr << "ds9Interface: could not allocate a " << sz << " byte SysV segment.\n";
+         return -1;
+      }
+
+      std::cerr << "ds9Interface: could not allocate a " << sz << " byte SysV segment, using a memory file.\n";
+   }
+
+   if(seg.file.create(sz, m_segmentBackend == ds9SegmentBackend::huge) < 0)
+   {
+      std::cerr << "ds9Interface: could not allocate a " << sz << " byte memory file segment.\n";
+      return -1;
+   }
+
+   seg.shmemid = -1;
+   seg.addr = seg.file.addr;
+   seg.size = seg.file.size;
+   seg.mapPath = seg.file.path;
+
+   return 0;
+}
+
+inline
+void ds9Interface::releaseSegment( ds9Segment & seg )
+{
+   if(seg.mapPath.size() > 0) seg.file.detach();
+   else seg.detach();
+
+   seg.addr = 0;
+   seg.size = 0;
+   seg.mapPath.clear();
+}
+
+inline
+bool ds9Interface::sysvFits( size_t sz )
+{
+   struct shminfo info;
+   if(shmctl(0, IPC_INFO, reinterpret_cast<struct shmid_ds *>(&info)) < 0) return true; //let shmget decide
+
+   struct shm_info used;
+   if(shmctl(0, SHM_INFO, reinterpret_cast<struct shmid_ds *>(&used)) < 0) return true;
+
+   static const size_t page = sysconf(_SC_PAGESIZE);
+
+   //create() adds the address block
+   size_t need = sz + sizeof(uintptr_t);
+
+   if(need > info.shmmax) return false;
+
+   //shmall is in pages, and is often set near the largest value, so compare in pages
+   unsigned long pages = (need + page - 1)/page;
+   if(info.shmall < (unsigned long) used.shm_tot || info.shmall - used.shm_tot < pages) return false;
+
+   return true;
+}
+
+inline
 int ds9Interface::display( const void * im,
                            int bitpix,
                            size_t pixsz,
@@ -607,71 +1834,231 @@ int ds9Interface::display( const void * im,
                            size_t dim3,
                            int frame
                           )
+{
+   static const fitsMemHeader noKeywords;
+
+   return display(im, bitpix, pixsz, dim1, dim2, dim3, noKeywords, frame);
+}
+
+inline
+void * ds9Interface::displayBuffer( int bitpix,
+                                    size_t pixsz,
+                                    size_t dim1,
+                                    size_t dim2,
+                                    size_t dim3,
+                                    int frame
+                                  )
+{
+   static const fitsMemHeader noKeywords;
+
+   return displayBuffer(bitpix, pixsz, dim1, dim2, dim3, noKeywords, frame);
+}
+
+inline
+void * ds9Interface::displayBuffer( int bitpix,
+                                    size_t pixsz,
+                                    size_t dim1,
+                                    size_t dim2,
+                                    size_t dim3,
+                                    const fitsMemHeader & keywords,
+                                    int frame
+                                  )
 {
    size_t tot_size;
-   char cmd[DS9INTERFACE_CMD_MAX_LENGTH];
 
    if(frame < 1)
    {
       std::cerr <<  "ds9Interface: frame must >= 1\n" << "\n";
-      return -1;
+      return nullptr;
    }
 
-   if(!m_connected) if(connect() < 0) return -1;
+   if(!m_connected) if(connect() < 0) return nullptr;
 
-   if(addframe(frame) < 0) 
+   if(m_connected && frameVisible(frame))
    {
-      m_connected = false;
-      return -1;
+      if(addframe(frame) < 0) 
+      {
+         m_connected = false;
+         return nullptr;
+      }
+   }
+   else
+   {
+      //ds9 is starting up, or not showing the frame, so the image waits in the segment
+      addsegment(frame);
    }
+
+   ds9Segment & seg = m_segs[frame-1];
+
    //Calculate total size
    tot_size= pixsz;
    tot_size*=dim1;
    tot_size*=dim2;
    tot_size*=dim3;
    
+   size_t seg_size = tot_size;
+   size_t head_size = 0;
+
+   if(m_fitsHeader)
+   {
+      if(seg.header.image(bitpix, dim1, dim2, dim3) < 0)
+      {
+         std::cerr << "ds9Interface: bitpix " << bitpix << " not supported in FITS header mode.\n";
+         return nullptr;
+      }
+      seg.header.append(keywords);
+
+      head_size = seg.header.size();
+      seg_size = head_size + fitsBlockPad(tot_size);
+   }
+
    bool realloc = false;
 
    //Re-allocate shared memory if necessary
-   if(tot_size > m_segs[frame-1].size)
+   if(seg_size > seg.size)
    {
-      if( m_segs[frame-1].size > 0 )
+      if( seg.size > 0 )
       {
-         m_segs[frame-1].detach();
+         releaseSegment(seg);
       }
-      m_segs[frame-1].create(tot_size);
+
+      if(createSegment(seg, seg_size) < 0) return nullptr;
       
       realloc = true;
    }
    else
    {
-      if( dim1 != m_segs[frame-1].dim1 || dim2 != m_segs[frame-1].dim2 || dim3 != m_segs[frame-1].dim3 || bitpix != m_segs[frame-1].bitpix)
+      if( dim1 != seg.dim1 || dim2 != seg.dim2 || dim3 != seg.dim3 || bitpix != seg.bitpix)
       {
          realloc = true; //force a new shm command
       }
+      else if(m_fitsHeader != seg.fits || head_size != seg.headerSize)
+      {
+         realloc = true; //the data moved, so ds9 has to reload
+      }
    }
 
-   memcpy( m_segs[frame-1].addr, im, tot_size );
+   char * addr = static_cast<char *>(seg.addr);
 
-   m_segs[frame-1].dim1 = dim1;
-   m_segs[frame-1].dim2 = dim2;
-   m_segs[frame-1].dim3 = dim3;
-   m_segs[frame-1].bitpix = bitpix;
-   
-   if(realloc)
+   if(m_fitsHeader)
+   {
+      //Only touch the cards that changed unless the layout did
+      if(realloc || seg.header.cards() != seg.headerCards)
+      {
+         seg.header.write(addr);
+         memset(addr + head_size + tot_size, 0, seg_size - head_size - tot_size);
+      }
+      else
+      {
+         seg.header.update(addr);
+      }
+
+      seg.headerCards = seg.header.cards();
+   }
+   else
+   {
+      seg.headerCards = 0;
+   }
+
+   seg.dim1 = dim1;
+   seg.dim2 = dim2;
+   seg.dim3 = dim3;
+   seg.bitpix = bitpix;
+   seg.fits = m_fitsHeader;
+   seg.headerSize = head_size;
+   seg.reload = (seg.reload || realloc);
+   seg.native = true;
+
+   return addr + head_size;
+}
+
+inline
+int ds9Interface::displayCommit( int frame )
+{
+   if(frame < 1 || (size_t) frame > m_segs.size())
+   {
+      std::cerr <<  "ds9Interface: no buffer for frame " << frame << "\n";
+      return -1;
+   }
+
+   ds9Segment & seg = m_segs[frame-1];
+
+   if(seg.fits && seg.native)
+   {
+      char * data = static_cast<char *>(seg.addr) + seg.headerSize;
+      fitsBigEndianCopy(data, data, seg.dim1*seg.dim2*seg.dim3, seg.bitpix);
+      seg.native = false;
+   }
+
+   if(!m_connected)
    {
+      //Connecting sends every segment, including this one
+      int rv = connect();
+      if(rv < 0) return -1;
+      if(rv > 0) return 0; //sent when ds9 is ready
+   }
+   else
+   {
+      if(!frameVisible(frame)) return 2;
+
+      if(!seg.reload && paced()) return 1;
+
+      if(sendSegment(frame) < 0) return -1;
+   }
+
+   if( m_regionsPreserved != m_preserveRegions ) togglePreserveRegions(m_preserveRegions);
+   if( m_panPreserved != m_preservePan ) togglePreservePan(m_preservePan);
+
+
+   return 0;
+
+}
+
+inline
+int ds9Interface::sendSegment( size_t frame )
+{
+   char cmd[DS9INTERFACE_CMD_MAX_LENGTH];
+
+   ds9Segment & seg = m_segs[frame-1];
+
+   if(seg.reload)
+   {
+      if(seg.mapPath.size() > 0)
+      {
+         //A memory file, where the shm commands take a SysV id
+         if(seg.fits)
+         {
+            snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "mmap fits %s", seg.mapPath.c_str());
+         }
+         else if(seg.dim3 == 1)
+         {
+            snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "mmap array %s[xdim=%zu,ydim=%zu,bitpix=%i]",
+                                           seg.mapPath.c_str(),
+                                           seg.dim1, seg.dim2, seg.bitpix);
+         }
+         else
+         {
+            snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "mmap array %s[xdim=%zu,ydim=%zu,zdim=%zu,bitpix=%i]",
+                                           seg.mapPath.c_str(),
+                                           seg.dim1, seg.dim2, seg.dim3, seg.bitpix);
+         }
+      }
+      else if(seg.fits)
+      {
+         snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "shm fits shmid %i", seg.shmemid);
+      }
       //Handle single image so that the cube dialog doesn't open up if dim3=1
-      if(dim3 == 1)
+      else if(seg.dim3 == 1)
       {
          snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "shm array shmid %i [xdim=%zu,ydim=%zu,bitpix=%i]",
-                                         m_segs[frame-1].shmemid,
-                                        dim1, dim2, bitpix);
+                                         seg.shmemid,
+                                        seg.dim1, seg.dim2, seg.bitpix);
       }
       else
       {
          snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "shm array shmid %i [xdim=%zu,ydim=%zu,zdim=%zu,bitpix=%i]",
-                                         m_segs[frame-1].shmemid,
-                                        dim1, dim2, dim3, bitpix);
+                                         seg.shmemid,
+                                        seg.dim1, seg.dim2, seg.dim3, seg.bitpix);
       }
    }
    else
@@ -679,21 +2066,138 @@ int ds9Interface::display( const void * im,
       snprintf(cmd, DS9INTERFACE_CMD_MAX_LENGTH, "update");
    }
 
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
    int rv = XPASet(cmd);
 
    if(rv != 0)
    {
-      std::cerr << "ds9Interface: sending shm array command to ds9 failed.\n";
+      std::cerr << "ds9Interface: sending shm command to ds9 failed.\n";
       m_connected = false;
       return -1;
    }
 
-   if( m_regionsPreserved != m_preserveRegions ) togglePreserveRegions(m_preserveRegions);
-   if( m_panPreserved != m_preservePan ) togglePreservePan(m_preservePan);
+   m_sendTime = std::chrono::steady_clock::now();
+   m_sendDuration = std::chrono::duration<double>(m_sendTime - start).count();
 
+   seg.reload = false;
 
    return 0;
+}
+
+inline
+bool ds9Interface::paced()
+{
+   double interval = m_minInterval;
+
+   if(m_adaptivePacing && DS9INTERFACE_PACING_FACTOR*m_sendDuration > interval) interval = DS9INTERFACE_PACING_FACTOR*m_sendDuration;
+
+   if(interval <= 0) return false;
+
+   return (std::chrono::duration<double>(std::chrono::steady_clock::now() - m_sendTime).count() < interval);
+}
+
+inline
+void ds9Interface::setPacing( double minInterval,
+                              bool adaptive
+                            )
+{
+   m_minInterval = minInterval;
+   m_adaptivePacing = adaptive;
+}
+
+inline
+int ds9Interface::mirror( const ds9Interface & source,
+                          int frame
+                        )
+{
+   if(frame < 1 || (size_t) frame > source.m_segs.size() || source.m_segs[frame-1].size == 0)
+   {
+      std::cerr <<  "ds9Interface::mirror: no source segment for frame " << frame << "\n";
+      return -1;
+   }
+
+   const ds9Segment & src = source.m_segs[frame-1];
+
+   if(src.fits && src.native)
+   {
+      std::cerr <<  "ds9Interface::mirror: source frame " << frame << " has not been committed\n";
+      return -1;
+   }
+
+   if(!m_connected) if(connect() < 0) return -1;
+
+   if(m_connected && !frameVisible(frame)) return 2;
+
+   addsegment(frame);
+
+   ds9Segment & seg = m_segs[frame-1];
+
+   if( !seg.mirrored || seg.shmemid != src.shmemid || seg.mapPath != src.mapPath || seg.dim1 != src.dim1 || seg.dim2 != src.dim2 || seg.dim3 != src.dim3 ||
+         seg.bitpix != src.bitpix || seg.fits != src.fits || seg.headerSize != src.headerSize )
+   {
+      seg.reload = true;
+   }
+
+   seg.mirrored = true;
+   seg.shmemid = src.shmemid;
+   seg.mapPath = src.mapPath;
+   seg.size = src.size;
+   seg.dim1 = src.dim1;
+   seg.dim2 = src.dim2;
+   seg.dim3 = src.dim3;
+   seg.bitpix = src.bitpix;
+   seg.fits = src.fits;
+   seg.headerSize = src.headerSize;
+
+   //Still starting up, sent when ready
+   if(!m_connected) return 0;
+
+   if(!seg.reload && paced()) return 1;
 
+   if(seg.reload || m_mirrorFrame != (size_t) frame)
+   {
+      std::string cmd = "frame " + std::to_string(frame);
+      if(XPASet(cmd.c_str()) < 0)
+      {
+         m_connected = false;
+         return -1;
+      }
+      m_mirrorFrame = frame;
+   }
+
+   return sendSegment(frame);
+}
+
+inline
+int ds9Interface::display( const void * im,
+                           int bitpix,
+                           size_t pixsz,
+                           size_t dim1,
+                           size_t dim2,
+                           size_t dim3,
+                           const fitsMemHeader & keywords,
+                           int frame
+                          )
+{
+   if(m_connected && !frameVisible(frame)) return 2; //not even copied
+
+   void * buf = displayBuffer(bitpix, pixsz, dim1, dim2, dim3, keywords, frame);
+
+   if(buf == nullptr) return -1;
+
+   if(m_segs[frame-1].fits)
+   {
+      //Convert while copying rather than in place afterwards
+      fitsBigEndianCopy(buf, im, dim1*dim2*dim3, bitpix);
+      m_segs[frame-1].native = false;
+   }
+   else
+   {
+      memcpy( buf, im, pixsz*dim1*dim2*dim3 );
+   }
+
+   return displayCommit(frame);
 }
 
 template<typename dataT>
@@ -707,6 +2211,22 @@ int ds9Interface::display( const dataT * im,
    return display(im, getFitsBITPIX<dataT>(), sizeof(dataT), dim1, dim2, dim3, frame);
 }
 
+template<typename dataT>
+int ds9Interface::display( const imageView<dataT> & view,
+                           int frame
+                         )
+{
+   if(m_connected && !frameVisible(frame)) return 2;
+
+   void * buf = displayBuffer(getFitsBITPIX<dataT>(), sizeof(dataT), view.outDim1(), view.outDim2(), view.dim3, frame);
+
+   if(buf == nullptr) return -1;
+
+   imageViewGather(static_cast<dataT *>(buf), view);
+
+   return displayCommit(frame);
+}
+
 #ifndef DS9INTERFACE_NO_EIGEN
 template<typename arrayT>
 int ds9Interface::display( const arrayT & array,
@@ -715,7 +2235,20 @@ int ds9Interface::display( const arrayT & array,
 {
    eigenArrPlanes<arrayT> planes;
 
-   return display(array.data(), array.rows(), array.cols(), planes(array), frame);
+   size_t np = planes(array);
+   if(np > 1) return display(array.data(), array.rows(), array.cols(), np, frame); //cubes are dense
+
+   typedef typename std::remove_cv<typename std::remove_reference<decltype(*array.data())>::type>::type dataT;
+
+   //Rows are the first dimension.  For column-major arrays they are the inner one.
+   imageView<dataT> view;
+   view.data = array.data();
+   view.dim1 = array.rows();
+   view.dim2 = array.cols();
+   view.stride1 = (arrayT::IsRowMajor ? array.outerStride() : array.innerStride())*sizeof(dataT);
+   view.stride2 = (arrayT::IsRowMajor ? array.innerStride() : array.outerStride())*sizeof(dataT);
+
+   return display(view, frame);
 }
 
 template<typename arrayT>
@@ -728,6 +2261,49 @@ int ds9Interface::operator()( const arrayT & array,
 
 #endif //DS9INTERFACE_NO_EIGEN
 
+inline
+int ds9Interface::overlay( const std::string & tag,
+                           const std::string & regions,
+                           int frame
+                         )
+{
+   if(frame < 1 || (size_t) frame > m_segs.size() || !m_connected) return -1;
+
+   if(!frameVisible(frame)) return 1;
+
+   ds9Segment & seg = m_segs[frame-1];
+
+   std::string cmd;
+
+   if(seg.overlayTag != "")
+   {
+      cmd = "regions group " + seg.overlayTag + " delete";
+      if(XPASet(cmd.c_str()) < 0) return -1;
+      seg.overlayTag = "";
+   }
+
+   //Tag every region, one per line
+   std::string tagged;
+   size_t pos = 0;
+   while(pos < regions.size())
+   {
+      size_t end = regions.find('\n', pos);
+      if(end == std::string::npos) end = regions.size();
+
+      std::string line = regions.substr(pos, end-pos);
+      if(line.find('(') != std::string::npos) line += (line.find('#') == std::string::npos ? " # tag={" : " tag={") + tag + "}";
+      tagged += line + "\n";
+
+      pos = end + 1;
+   }
+
+   if(XPASet("regions", tagged.c_str(), tagged.size()) < 0) return -1;
+
+   seg.overlayTag = tag;
+
+   return 0;
+}
+
 inline
 int ds9Interface::loadRegion( size_t frame,
                               const std::string & fname
@@ -780,7 +2356,10 @@ int ds9Interface::shutdown()
 {
    size_t i;
 
-   for(i=0; i < m_segs.size(); i++) m_segs[i].detach();
+   for(i=0; i < m_segs.size(); i++)
+   {
+      if(!m_segs[i].mirrored) releaseSegment(m_segs[i]);
+   }
 
    m_segs.clear();
 
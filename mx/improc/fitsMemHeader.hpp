@@ -0,0 +1,493 @@
+/** \file fitsMemHeader.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Declares and defines utilities to format FITS headers and data directly in memory
+  * \ingroup fits_processing_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef improc_fitsMemHeader_hpp
+#define improc_fitsMemHeader_hpp
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "fitsUtils.hpp"
+
+namespace mx
+{
+namespace improc
+{
+
+/** \ingroup fits_utils
+  * @{
+  */
+
+///The size of a FITS logical record, in bytes.  Headers and data are padded to a multiple of this.
+#define fitsBlockSize (2880)
+
+///The length of a FITS header card, in bytes.
+#define fitsCardSize (80)
+
+/// Get the on-disk FITS BITPIX and BZERO for a cfitsio image type
+/** cfitsio uses pseudo-BITPIX values (e.g. USHORT_IMG = 20) for types which the FITS standard
+  * stores as signed integers with an offset.  This returns the standard BITPIX and the BZERO string
+  * to write, along with the bit mask which maps the native value onto the stored value.
+  *
+  * \returns the standard FITS BITPIX (8, 16, 32, 64, -32, or -64)
+  * \returns 0 if the bitpix is not recognized
+  */
+inline int fitsStdBitpix( int bitpix,           ///< [in] the cfitsio image type
+                          const char *& bzero,  ///< [out] the BZERO value string, or nullptr if not needed
+                          uint64_t & flip       ///< [out] the mask to XOR with native values
+                        )
+{
+   bzero = nullptr;
+   flip = 0;
+
+   switch(bitpix)
+   {
+      case BYTE_IMG:
+      case SHORT_IMG:
+      case LONG_IMG:
+      case LONGLONG_IMG:
+      case FLOAT_IMG:
+      case DOUBLE_IMG:
+         return bitpix;
+      case SBYTE_IMG:
+         bzero = "-128";
+         flip = 0x80;
+         return BYTE_IMG;
+      case USHORT_IMG:
+         bzero = "32768";
+         flip = 0x8000;
+         return SHORT_IMG;
+      case ULONG_IMG:
+         bzero = "2147483648";
+         flip = 0x80000000;
+         return LONG_IMG;
+      case ULONGLONG_IMG:
+         bzero = "9223372036854775808";
+         flip = 0x8000000000000000;
+         return LONGLONG_IMG;
+      default:
+         return 0;
+   }
+}
+
+/// Round a size in bytes up to a whole number of FITS blocks
+inline size_t fitsBlockPad( size_t sz /**< [in] the size to pad */)
+{
+   return ((sz + fitsBlockSize - 1)/fitsBlockSize)*fitsBlockSize;
+}
+
+inline uint8_t fitsByteSwap(uint8_t v)
+{
+   return v;
+}
+
+inline uint16_t fitsByteSwap(uint16_t v)
+{
+   return __builtin_bswap16(v);
+}
+
+inline uint32_t fitsByteSwap(uint32_t v)
+{
+   return __builtin_bswap32(v);
+}
+
+inline uint64_t fitsByteSwap(uint64_t v)
+{
+   return __builtin_bswap64(v);
+}
+
+/// Copy native pixels to FITS (big-endian, BZERO-offset) order
+/** Written as a plain loop over fixed-width words so the compiler vectorizes it.
+  * The destination may be the same as the source, for conversion in place.
+  *
+  * \tparam uintT is the unsigned integer type with the same width as the pixel type
+  */
+template<typename uintT>
+void fitsBigEndianCopy( void * dest,       ///< [out] the destination, must hold n pixels
+                        const void * src,  ///< [in] the native pixels
+                        size_t n,          ///< [in] the number of pixels
+                        uintT flip         ///< [in] the mask to XOR with each pixel before swapping
+                      )
+{
+   uintT * d = static_cast<uintT *>(dest);
+   const uintT * s = static_cast<const uintT *>(src);
+
+   for(size_t i = 0; i < n; ++i) d[i] = fitsByteSwap(static_cast<uintT>(s[i] ^ flip));
+}
+
+/// Copy native pixels of a cfitsio image type to FITS order
+/**
+  * \retval 0 on success
+  * \retval -1 if the bitpix is not recognized
+  */
+inline int fitsBigEndianCopy( void * dest,       ///< [out] the destination, must hold n pixels
+                              const void * src,  ///< [in] the native pixels
+                              size_t n,          ///< [in] the number of pixels
+                              int bitpix         ///< [in] the cfitsio image type of the pixels
+                            )
+{
+   const char * bzero;
+   uint64_t flip;
+
+   switch(fitsStdBitpix(bitpix, bzero, flip))
+   {
+      case BYTE_IMG:
+         fitsBigEndianCopy<uint8_t>(dest, src, n, flip);
+         return 0;
+      case SHORT_IMG:
+         fitsBigEndianCopy<uint16_t>(dest, src, n, flip);
+         return 0;
+      case LONG_IMG:
+      case FLOAT_IMG:
+         fitsBigEndianCopy<uint32_t>(dest, src, n, flip);
+         return 0;
+      case LONGLONG_IMG:
+      case DOUBLE_IMG:
+         fitsBigEndianCopy<uint64_t>(dest, src, n, flip);
+         return 0;
+      default:
+         return -1;
+   }
+}
+
+/// Copy FITS order pixels to native order
+/** The inverse of \ref fitsBigEndianCopy.  The destination may be the same as the source.
+  *
+  * \tparam uintT is the unsigned integer type with the same width as the pixel type
+  */
+template<typename uintT>
+void fitsNativeCopy( void * dest,       ///< [out] the destination, must hold n pixels
+                     const void * src,  ///< [in] the FITS order pixels
+                     size_t n,          ///< [in] the number of pixels
+                     uintT flip         ///< [in] the mask to XOR with each pixel after swapping
+                   )
+{
+   uintT * d = static_cast<uintT *>(dest);
+   const uintT * s = static_cast<const uintT *>(src);
+
+   for(size_t i = 0; i < n; ++i) d[i] = static_cast<uintT>(fitsByteSwap(s[i]) ^ flip);
+}
+
+/// Copy FITS order pixels of a cfitsio image type to native order
+/**
+  * \retval 0 on success
+  * \retval -1 if the bitpix is not recognized
+  */
+inline int fitsNativeCopy( void * dest,       ///< [out] the destination, must hold n pixels
+                           const void * src,  ///< [in] the FITS order pixels
+                           size_t n,          ///< [in] the number of pixels
+                           int bitpix         ///< [in] the cfitsio image type of the pixels
+                         )
+{
+   const char * bzero;
+   uint64_t flip;
+
+   switch(fitsStdBitpix(bitpix, bzero, flip))
+   {
+      case BYTE_IMG:
+         fitsNativeCopy<uint8_t>(dest, src, n, flip);
+         return 0;
+      case SHORT_IMG:
+         fitsNativeCopy<uint16_t>(dest, src, n, flip);
+         return 0;
+      case LONG_IMG:
+      case FLOAT_IMG:
+         fitsNativeCopy<uint32_t>(dest, src, n, flip);
+         return 0;
+      case LONGLONG_IMG:
+      case DOUBLE_IMG:
+         fitsNativeCopy<uint64_t>(dest, src, n, flip);
+         return 0;
+      default:
+         return -1;
+   }
+}
+
+/// A FITS header formatted in memory, card by card.
+/** Cards are formatted with \ref fitsPopulateCard, so this can be used without linking cfitsio.
+  * The header can be written in full to a buffer, or updated in place, in which case only the cards
+  * which differ from those already in the buffer are copied.
+  */
+class fitsMemHeader
+{
+protected:
+   ///The formatted cards, each exactly 80 characters, not including END.
+   std::vector<std::string> m_cards;
+
+public:
+
+   ///Remove all cards.
+   void clear();
+
+   ///Get the number of cards, not including END.
+   size_t cards() const;
+
+   ///Get the size of the header in bytes, including END and padded to a multiple of 2880.
+   size_t size() const;
+
+   ///Append a card with the value string copied verbatim.
+   /** Keywords longer than 8 characters are written with the HIERARCH convention.
+     */
+   void append( const std::string & keyword, ///< [in] the keyword
+                const std::string & value,   ///< [in] the value string, which should already be quoted if a string
+                const std::string & comment  ///< [in] the comment
+              );
+
+   ///Append a card with a string value, which is quoted.
+   void appendString( const std::string & keyword, ///< [in] the keyword
+                      const std::string & value,   ///< [in] the string value, unquoted
+                      const std::string & comment  ///< [in] the comment
+                    );
+
+   ///Append the cards of another header.
+   void append( const fitsMemHeader & head /**< [in] the header whose cards to append */);
+
+   ///Set up the mandatory image cards
+   /** Clears the header, then appends SIMPLE, BITPIX, NAXIS, NAXISn, and BZERO/BSCALE if needed.
+     *
+     * \retval 0 on success
+     * \retval -1 if the bitpix is not recognized
+     */
+   int image( int bitpix,   ///< [in] the cfitsio image type of the data
+              size_t dim1,  ///< [in] the first dimension of the image
+              size_t dim2,  ///< [in] the second dimension of the image
+              size_t dim3   ///< [in] the third dimension of the image.  NAXIS3 is only written if this is > 1.
+            );
+
+   ///Write the full header, including END and padding.
+   /**
+     * \returns the number of bytes written, which is size()
+     */
+   size_t write( char * dest /**< [out] the destination, must hold size() bytes */) const;
+
+   ///Update the header in place, copying only those cards which differ.
+   /** The buffer must already contain a header with the same number of cards.
+     *
+     * \returns the number of cards changed
+     */
+   size_t update( char * dest /**< [in.out] the header to update */) const;
+
+   ///Replace the value of an existing card, returning true if found.
+   bool replace( const std::string & keyword, ///< [in] the keyword of the card to replace
+                 const std::string & value,   ///< [in] the new value string
+                 const std::string & comment  ///< [in] the new comment
+               );
+
+protected:
+
+   ///Format one card, padding to 80 characters.
+   static std::string format( const std::string & keyword,
+                              const std::string & value,
+                              const std::string & comment
+                            );
+};
+
+inline
+void fitsMemHeader::clear()
+{
+   m_cards.clear();
+}
+
+inline
+size_t fitsMemHeader::cards() const
+{
+   return m_cards.size();
+}
+
+inline
+size_t fitsMemHeader::size() const
+{
+   return fitsBlockPad( (m_cards.size()+1)*fitsCardSize );
+}
+
+inline
+std::string fitsMemHeader::format( const std::string & keyword,
+                                   const std::string & value,
+                                   const std::string & comment
+                                 )
+{
+   char headStr[81];
+
+   if(keyword.size() > 8)
+   {
+      memset(headStr, ' ', 80);
+      headStr[80] = '\0';
+      snprintf(headStr, 81, "HIERARCH %s = %s / %s", keyword.c_str(), value.c_str(), comment.c_str());
+   }
+   else
+   {
+      fitsPopulateCard(headStr, const_cast<char *>(keyword.c_str()), const_cast<char *>(value.c_str()), const_cast<char *>(comment.c_str()));
+   }
+
+   //the snprintfs leave a terminator inside the card
+   for(size_t i = 0; i < fitsCardSize; ++i) if(headStr[i] == '\0') headStr[i] = ' ';
+
+   return std::string(headStr, fitsCardSize);
+}
+
+inline
+void fitsMemHeader::append( const std::string & keyword,
+                            const std::string & value,
+                            const std::string & comment
+                          )
+{
+   m_cards.push_back(format(keyword, value, comment));
+}
+
+inline
+void fitsMemHeader::appendString( const std::string & keyword,
+                                  const std::string & value,
+                                  const std::string & comment
+                                )
+{
+   std::string qval = "'";
+
+   for(size_t i = 0; i < value.size(); ++i)
+   {
+      if(value[i] == '\'') qval += '\''; //FITS escapes quotes by doubling
+      qval += value[i];
+   }
+
+   //Strings are padded to at least 8 characters.
+   while(qval.size() < 9) qval += ' ';
+   qval += '\'';
+
+   append(keyword, qval, comment);
+}
+
+inline
+void fitsMemHeader::append( const fitsMemHeader & head )
+{
+   m_cards.insert(m_cards.end(), head.m_cards.begin(), head.m_cards.end());
+}
+
+inline
+int fitsMemHeader::image( int bitpix,
+                          size_t dim1,
+                          size_t dim2,
+                          size_t dim3
+                        )
+{
+   const char * bzero;
+   uint64_t flip;
+
+   int stdBitpix = fitsStdBitpix(bitpix, bzero, flip);
+
+   if(stdBitpix == 0) return -1;
+
+   clear();
+
+   append("SIMPLE", "T", "conforms to FITS standard");
+   append("BITPIX", std::to_string(stdBitpix), "array data type");
+
+   if(dim3 > 1)
+   {
+      append("NAXIS", "3", "number of array dimensions");
+   }
+   else
+   {
+      append("NAXIS", "2", "number of array dimensions");
+   }
+
+   append("NAXIS1", std::to_string(dim1), "");
+   append("NAXIS2", std::to_string(dim2), "");
+   if(dim3 > 1) append("NAXIS3", std::to_string(dim3), "");
+
+   if(bzero)
+   {
+      append("BZERO", bzero, "offset data range to that of unsigned");
+      append("BSCALE", "1", "default scaling factor");
+   }
+
+   return 0;
+}
+
+inline
+size_t fitsMemHeader::write( char * dest ) const
+{
+   for(size_t i = 0; i < m_cards.size(); ++i)
+   {
+      memcpy(dest + i*fitsCardSize, m_cards[i].data(), fitsCardSize);
+   }
+
+   size_t pos = m_cards.size()*fitsCardSize;
+   size_t sz = size();
+
+   memset(dest + pos, ' ', sz - pos);
+   memcpy(dest + pos, "END", 3);
+
+   return sz;
+}
+
+inline
+size_t fitsMemHeader::update( char * dest ) const
+{
+   size_t changed = 0;
+
+   for(size_t i = 0; i < m_cards.size(); ++i)
+   {
+      if(memcmp(dest + i*fitsCardSize, m_cards[i].data(), fitsCardSize) != 0)
+      {
+         memcpy(dest + i*fitsCardSize, m_cards[i].data(), fitsCardSize);
+         ++changed;
+      }
+   }
+
+   return changed;
+}
+
+inline
+bool fitsMemHeader::replace( const std::string & keyword,
+                             const std::string & value,
+                             const std::string & comment
+                           )
+{
+   std::string card = format(keyword, value, comment);
+
+   //Match on everything up to the value indicator
+   size_t klen = card.find('=');
+   if(klen == std::string::npos) return false;
+
+   for(size_t i = 0; i < m_cards.size(); ++i)
+   {
+      if(m_cards[i].compare(0, klen, card, 0, klen) == 0)
+      {
+         m_cards[i] = card;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+///@}
+
+} //namespace improc
+} //namespace mx
+
+#endif //improc_fitsMemHeader_hpp
@@ -0,0 +1,280 @@
+/** \file fitsMmapCube.hpp
+  * \brief Read access to the images of a FITS file through a memory map
+  * \ingroup fits_processing_files
+  * \author Jared R. Males (jaredmales@gmail.com)
+  *
+  */
+
+#ifndef __fitsMmapCube__
+#define __fitsMmapCube__
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fitsMemHeader.hpp"
+
+namespace mx
+{
+namespace improc
+{
+
+/** \ingroup fits_utils
+  * @{
+  */
+
+/// A FITS image or cube in the primary HDU, memory mapped so images are read straight from the page cache.
+/** Only the header cards needed to locate the images are parsed: BITPIX, NAXIS, NAXISn, BZERO and BSCALE.  The
+  * standard BZERO offsets for unsigned and signed byte types are recognized and reported as the cfitsio pseudo
+  * types (e.g. USHORT_IMG), and any other scaling is rejected.
+  */
+class fitsMmapCube
+{
+protected:
+   int m_fd {-1};            ///< The file
+   char * m_map {nullptr};   ///< The mapping of the whole file
+   size_t m_mapSize {0};     ///< The size of the mapping
+
+   int m_bitpix {0};         ///< The cfitsio image type
+   size_t m_dim1 {0};        ///< The first dimension
+   size_t m_dim2 {0};        ///< The second dimension
+   size_t m_dim3 {0};        ///< The number of images
+   size_t m_dataOffset {0};  ///< The offset of the data from the start of the file
+
+public:
+
+   ~fitsMmapCube();
+
+   ///Open and map a file, parsing its header.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int open( const std::string & fname /**< [in] the file to open*/);
+
+   ///Unmap and close the file.
+   void close();
+
+   ///Get the cfitsio image type of the data.
+   int bitpix() const;
+
+   ///Get the first dimension.
+   size_t dim1() const;
+
+   ///Get the second dimension.
+   size_t dim2() const;
+
+   ///Get the number of images.
+   size_t dim3() const;
+
+   ///Get the size of a pixel in bytes.
+   size_t pixsz() const;
+
+   ///Get an image in FITS order, straight from the mapping.
+   const void * raw( size_t n /**< [in] the image number*/) const;
+
+   ///Copy an image to native order.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int image( void * dest, ///< [out] the destination, must hold dim1()*dim2()*pixsz() bytes
+              size_t n     ///< [in] the image number
+            ) const;
+};
+
+inline
+fitsMmapCube::~fitsMmapCube()
+{
+   close();
+}
+
+inline
+int fitsMmapCube::open( const std::string & fname )
+{
+   close();
+
+   m_fd = ::open(fname.c_str(), O_RDONLY);
+   if(m_fd < 0)
+   {
+      std::cerr << "fitsMmapCube: could not open " << fname << ": " << strerror(errno) << "\n";
+      return -1;
+   }
+
+   struct stat st;
+   if(fstat(m_fd, &st) < 0 || st.st_size < fitsBlockSize)
+   {
+      std::cerr << "fitsMmapCube: " << fname << " is not a FITS file\n";
+      close();
+      return -1;
+   }
+
+   m_mapSize = st.st_size;
+   void * map = mmap(nullptr, m_mapSize, PROT_READ, MAP_PRIVATE, m_fd, 0);
+   if(map == MAP_FAILED)
+   {
+      std::cerr << "fitsMmapCube: could not map " << fname << ": " << strerror(errno) << "\n";
+      m_mapSize = 0;
+      close();
+      return -1;
+   }
+   m_map = static_cast<char *>(map);
+
+   //Images are read in order
+   madvise(m_map, m_mapSize, MADV_SEQUENTIAL);
+
+   int bitpix = 0;
+   int naxis = 0;
+   size_t naxes[3] = {1, 1, 1};
+   double bzero = 0;
+   double bscale = 1;
+
+   size_t card = 0;
+   bool end = false;
+   while(!end && (card+1)*fitsCardSize <= m_mapSize)
+   {
+      const char * c = m_map + card*fitsCardSize;
+      ++card;
+
+      std::string key(c, 8);
+      key.erase(key.find_last_not_of(' ') + 1);
+
+      if(key == "END")
+      {
+         end = true;
+         break;
+      }
+
+      if(c[8] != '=') continue;
+
+      std::string val(c+10, fitsCardSize-10);
+
+      if(key == "BITPIX") bitpix = atoi(val.c_str());
+      else if(key == "NAXIS") naxis = atoi(val.c_str());
+      else if(key == "NAXIS1") naxes[0] = strtoull(val.c_str(), nullptr, 10);
+      else if(key == "NAXIS2") naxes[1] = strtoull(val.c_str(), nullptr, 10);
+      else if(key == "NAXIS3") naxes[2] = strtoull(val.c_str(), nullptr, 10);
+      else if(key == "BZERO") bzero = strtod(val.c_str(), nullptr);
+      else if(key == "BSCALE") bscale = strtod(val.c_str(), nullptr);
+   }
+
+   if(!end || naxis < 2 || naxis > 3)
+   {
+      std::cerr << "fitsMmapCube: " << fname << " is not a FITS image or cube\n";
+      close();
+      return -1;
+   }
+
+   if(bscale != 1) bitpix = 0;
+   else if(bzero != 0)
+   {
+      if(bitpix == BYTE_IMG && bzero == -128) bitpix = SBYTE_IMG;
+      else if(bitpix == SHORT_IMG && bzero == 32768) bitpix = USHORT_IMG;
+      else if(bitpix == LONG_IMG && bzero == 2147483648.) bitpix = ULONG_IMG;
+      else if(bitpix == LONGLONG_IMG && bzero == 9223372036854775808.) bitpix = ULONGLONG_IMG;
+      else bitpix = 0;
+   }
+
+   const char * bz;
+   uint64_t flip;
+   if(fitsStdBitpix(bitpix, bz, flip) == 0)
+   {
+      std::cerr << "fitsMmapCube: " << fname << " has an unsupported BITPIX or scaling\n";
+      close();
+      return -1;
+   }
+
+   m_bitpix = bitpix;
+   m_dim1 = naxes[0];
+   m_dim2 = naxes[1];
+   m_dim3 = (naxis == 3) ? naxes[2] : 1;
+   m_dataOffset = fitsBlockPad(card*fitsCardSize);
+
+   if(m_dataOffset + m_dim1*m_dim2*m_dim3*pixsz() > m_mapSize)
+   {
+      std::cerr << "fitsMmapCube: " << fname << " is truncated\n";
+      close();
+      return -1;
+   }
+
+   return 0;
+}
+
+inline
+void fitsMmapCube::close()
+{
+   if(m_map) munmap(m_map, m_mapSize);
+   if(m_fd >= 0) ::close(m_fd);
+
+   m_map = nullptr;
+   m_mapSize = 0;
+   m_fd = -1;
+   m_bitpix = 0;
+   m_dim1 = m_dim2 = m_dim3 = 0;
+}
+
+inline
+int fitsMmapCube::bitpix() const
+{
+   return m_bitpix;
+}
+
+inline
+size_t fitsMmapCube::dim1() const
+{
+   return m_dim1;
+}
+
+inline
+size_t fitsMmapCube::dim2() const
+{
+   return m_dim2;
+}
+
+inline
+size_t fitsMmapCube::dim3() const
+{
+   return m_dim3;
+}
+
+inline
+size_t fitsMmapCube::pixsz() const
+{
+   const char * bz;
+   uint64_t flip;
+
+   return abs(fitsStdBitpix(m_bitpix, bz, flip))/8;
+}
+
+inline
+const void * fitsMmapCube::raw( size_t n ) const
+{
+   if(n >= m_dim3) return nullptr;
+
+   return m_map + m_dataOffset + n*m_dim1*m_dim2*pixsz();
+}
+
+inline
+int fitsMmapCube::image( void * dest,
+                         size_t n
+                       ) const
+{
+   const void * src = raw(n);
+   if(src == nullptr) return -1;
+
+   return fitsNativeCopy(dest, src, m_dim1*m_dim2, m_bitpix);
+}
+
+/// @}
+
+} //namespace improc
+} //namespace mx
+
+#endif //__fitsMmapCube__
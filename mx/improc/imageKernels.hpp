@@ -0,0 +1,589 @@
+/** \file imageKernels.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Per-type kernels for preparing images for display
+  * \ingroup image_processing_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef improc_imageKernels_hpp
+#define improc_imageKernels_hpp
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace mx
+{
+namespace improc
+{
+
+/** \addtogroup image_processing
+  * @{
+  */
+
+/// The type used to accumulate sums of pixels of a given type while binning.
+/** Integers accumulate in 64 bits.  32 bits would overflow for bins larger than 181x181 of 16 bit data, and
+  * neither -b nor the bin command limits the bin, so the sums are kept exact for any bin of 8, 16 and 32 bit data.
+  */
+template<typename dataT>
+struct binAccumType
+{
+   typedef int64_t type;
+};
+
+template<> struct binAccumType<float> { typedef float type; };
+template<> struct binAccumType<double> { typedef double type; };
+
+/// Copy a region of interest from an image, row by row.
+/** Images are stored with the first dimension fastest.
+  */
+template<typename dataT>
+void imageCopyROI( dataT * __restrict__ out,      ///< [out] the w x h output image
+                   const dataT * __restrict__ in, ///< [in] the input image
+                   size_t nx,                     ///< [in] the first dimension of the input image
+                   size_t x0,                     ///< [in] the first column of the ROI
+                   size_t y0,                     ///< [in] the first row of the ROI
+                   size_t w,                      ///< [in] the width of the ROI
+                   size_t h                       ///< [in] the height of the ROI
+                 )
+{
+   for(size_t j = 0; j < h; ++j)
+   {
+      memcpy(out + j*w, in + (y0+j)*nx + x0, w*sizeof(dataT));
+   }
+}
+
+/// Bin a region of interest from an image, averaging bin x bin blocks.
+/** The output is (w/bin) x (h/bin), any remainder of the ROI is dropped.  Each output row is accumulated
+  * in a row buffer so that the inner loops run contiguously over the input.
+  */
+template<typename dataT>
+void imageBinROI( dataT * __restrict__ out,      ///< [out] the (w/bin) x (h/bin) output image
+                  const dataT * __restrict__ in, ///< [in] the input image
+                  size_t nx,                     ///< [in] the first dimension of the input image
+                  size_t x0,                     ///< [in] the first column of the ROI
+                  size_t y0,                     ///< [in] the first row of the ROI
+                  size_t w,                      ///< [in] the width of the ROI
+                  size_t h,                      ///< [in] the height of the ROI
+                  size_t bin,                    ///< [in] the binning factor, >= 1
+                  std::vector<typename binAccumType<dataT>::type> & acc ///< [in.out] working space for the row accumulator
+                )
+{
+   typedef typename binAccumType<dataT>::type accumT;
+
+   size_t ow = w/bin;
+   size_t oh = h/bin;
+
+   acc.resize(ow);
+
+   accumT norm = bin*bin;
+
+   for(size_t oj = 0; oj < oh; ++oj)
+   {
+      accumT * __restrict__ a = acc.data();
+
+      for(size_t i = 0; i < ow; ++i) a[i] = 0;
+
+      for(size_t j = 0; j < bin; ++j)
+      {
+         const dataT * __restrict__ row = in + (y0 + oj*bin + j)*nx + x0;
+
+         for(size_t i = 0; i < ow; ++i)
+         {
+            for(size_t k = 0; k < bin; ++k) a[i] += row[i*bin + k];
+         }
+      }
+
+      dataT * __restrict__ orow = out + oj*ow;
+      for(size_t i = 0; i < ow; ++i) orow[i] = a[i]/norm;
+   }
+}
+
+/// Simple statistics of an image
+struct imageStats
+{
+   double min {0};
+   double max {0};
+   double mean {0};
+};
+
+/// Check whether a pixel is finite, which integers always are.
+/** Floating point values are checked by their exponent bits, since -Ofast (-ffinite-math-only) lets the compiler
+  * assume std::isfinite is always true.
+  */
+template<typename dataT>
+bool imageIsFinite( dataT v /**< [in] the pixel*/)
+{
+   static_cast<void>(v);
+   return true;
+}
+
+template<>
+inline
+bool imageIsFinite<float>( float v )
+{
+   uint32_t b;
+   memcpy(&b, &v, sizeof(b));
+   return ((b & 0x7f800000u) != 0x7f800000u);
+}
+
+template<>
+inline
+bool imageIsFinite<double>( double v )
+{
+   uint64_t b;
+   memcpy(&b, &v, sizeof(b));
+   return ((b & 0x7ff0000000000000ull) != 0x7ff0000000000000ull);
+}
+
+/// Calculate the min, max, and mean of an image in one pass.
+/** The min and max are tracked in the native type, so the loop vectorizes for all types.  Only finite pixels are
+  * included, so NaN (e.g. unused remap pixels) and inf (e.g. the log of zero power) don't spoil the range.  If no
+  * pixel is finite the statistics are all 0.
+  */
+template<typename dataT>
+void imageMinMaxMean( imageStats & stats,          ///< [out] the statistics
+                      const dataT * __restrict__ im, ///< [in] the image
+                      size_t n                     ///< [in] the number of pixels
+                    )
+{
+   dataT lo = std::numeric_limits<dataT>::max();
+   dataT hi = std::numeric_limits<dataT>::lowest();
+   double sum = 0;
+   size_t nfinite = 0;
+
+   for(size_t i = 0; i < n; ++i)
+   {
+      bool ok = imageIsFinite(im[i]);
+      lo = (ok && im[i] < lo) ? im[i] : lo;
+      hi = (ok && im[i] > hi) ? im[i] : hi;
+      sum += ok ? static_cast<double>(im[i]) : 0.0;
+      nfinite += ok;
+   }
+
+   if(nfinite == 0)
+   {
+      stats = imageStats();
+      return;
+   }
+
+   stats.min = lo;
+   stats.max = hi;
+   stats.mean = sum/nfinite;
+}
+
+/// Convert an image to single precision.
+template<typename dataT>
+void imageToFloat( float * __restrict__ out,      ///< [out] the converted image
+                   const dataT * __restrict__ in, ///< [in] the image
+                   size_t n                       ///< [in] the number of pixels
+                 )
+{
+   for(size_t i = 0; i < n; ++i) out[i] = in[i];
+}
+
+/// The number of entries in a quantization lookup table
+#define IMAGE_QUANTIZE_LUT_SIZE (4096)
+
+#ifndef IMAGE_QUANTIZE_NONFINITE
+/// The 16 bit value given to non-finite pixels when quantizing
+#define IMAGE_QUANTIZE_NONFINITE (-32768)
+#endif
+
+/// Stretches for quantizing images to 16 bits
+enum imageStretch
+{
+   stretchLinear, ///< Linear
+   stretchSqrt,   ///< Square root
+   stretchLog     ///< Logarithmic, with the same exponent (1000) ds9 uses by default
+};
+
+/// Fill a lookup table mapping the normalized range [0,1] to 16 bit values with a stretch.
+inline
+void imageQuantizeLUT( std::vector<int16_t> & lut, ///< [out] the table, resized to IMAGE_QUANTIZE_LUT_SIZE
+                       imageStretch stretch        ///< [in] the stretch to apply
+                     )
+{
+   lut.resize(IMAGE_QUANTIZE_LUT_SIZE);
+
+   for(size_t i = 0; i < lut.size(); ++i)
+   {
+      double t = ((double) i)/(lut.size()-1);
+
+      switch(stretch)
+      {
+         case stretchSqrt:
+            t = sqrt(t);
+            break;
+         case stretchLog:
+            t = log10(1.0 + 1000.0*t)/log10(1001.0);
+            break;
+         default:
+            break;
+      }
+
+      lut[i] = static_cast<int16_t>( static_cast<int32_t>(t*65535.0 + 0.5) - 32768 );
+   }
+}
+
+/// Quantize an image to 16 bits, linearly mapping [min,max] onto the full range of int16_t.
+/** Arithmetic is done in single precision, which is plenty for display, so the loop vectorizes for all types.
+  * Non-finite pixels are set to \ref IMAGE_QUANTIZE_NONFINITE.  min and max must be finite, as from
+  * \ref imageMinMaxMean.
+  */
+template<typename dataT>
+void imageQuantizeLinear( int16_t * __restrict__ out,    ///< [out] the quantized image
+                          const dataT * __restrict__ in, ///< [in] the image
+                          size_t n,                      ///< [in] the number of pixels
+                          double min,                    ///< [in] the value mapped to -32768
+                          double max                     ///< [in] the value mapped to 32767
+                        )
+{
+   float mn = min;
+   float scale = (max > min) ? 65535.0/(max - min) : 0;
+
+   for(size_t i = 0; i < n; ++i)
+   {
+      float v = (static_cast<float>(in[i]) - mn)*scale;
+      v = (v < 0) ? 0 : v;
+      v = (v > 65535.0f) ? 65535.0f : v;
+
+      //Replaced before the conversion to int, which is undefined for NaN
+      bool ok = imageIsFinite(in[i]) && imageIsFinite(v);
+      v = ok ? v : 0;
+
+      int16_t q = static_cast<int16_t>(static_cast<int32_t>(v + 0.5f) - 32768);
+      out[i] = ok ? q : static_cast<int16_t>(IMAGE_QUANTIZE_NONFINITE);
+   }
+}
+
+/// Quantize an image to 16 bits through a stretch lookup table, mapping [min,max] onto the table.
+/** Non-finite pixels are set to \ref IMAGE_QUANTIZE_NONFINITE.  min and max must be finite, as from
+  * \ref imageMinMaxMean.
+  */
+template<typename dataT>
+void imageQuantize( int16_t * __restrict__ out,      ///< [out] the quantized image
+                    const dataT * __restrict__ in,   ///< [in] the image
+                    size_t n,                        ///< [in] the number of pixels
+                    double min,                      ///< [in] the value mapped to the first table entry
+                    double max,                      ///< [in] the value mapped to the last table entry
+                    const std::vector<int16_t> & lut ///< [in] the table from \ref imageQuantizeLUT
+                  )
+{
+   const int16_t * __restrict__ l = lut.data();
+   int32_t top = lut.size() - 1;
+
+   float mn = min;
+   float scale = (max > min) ? top/(max - min) : 0;
+
+   for(size_t i = 0; i < n; ++i)
+   {
+      //Clamped in float, before the conversion to int, which is undefined out of range or for NaN
+      float v = (static_cast<float>(in[i]) - mn)*scale + 0.5f;
+      v = (v < 0) ? 0 : v;
+      v = (v > top) ? top : v;
+
+      bool ok = imageIsFinite(in[i]) && imageIsFinite(v);
+      v = ok ? v : 0;
+
+      int16_t q = l[static_cast<int32_t>(v)];
+      out[i] = ok ? q : static_cast<int16_t>(IMAGE_QUANTIZE_NONFINITE);
+   }
+}
+
+/// Components which can be extracted from complex images
+enum complexComponent
+{
+   componentAmplitude, ///< The modulus
+   componentPhase,     ///< The argument, in radians
+   componentReal,      ///< The real part
+   componentImag       ///< The imaginary part
+};
+
+/// Extract a real component from a complex image.
+/** The complex type must have members re and im, as the ImageStreamIO complex types do.  The choice of
+  * component is made outside the loops, so each loop is a simple strided pass the compiler vectorizes.
+  */
+template<typename realT, typename complexT>
+void imageComplexComponent( realT * __restrict__ out,         ///< [out] the component
+                            const complexT * __restrict__ in, ///< [in] the complex image
+                            size_t n,                         ///< [in] the number of pixels
+                            complexComponent comp             ///< [in] the component to extract
+                          )
+{
+   switch(comp)
+   {
+      case componentPhase:
+         for(size_t i = 0; i < n; ++i) out[i] = atan2(in[i].im, in[i].re);
+         break;
+      case componentReal:
+         for(size_t i = 0; i < n; ++i) out[i] = in[i].re;
+         break;
+      case componentImag:
+         for(size_t i = 0; i < n; ++i) out[i] = in[i].im;
+         break;
+      default:
+         for(size_t i = 0; i < n; ++i) out[i] = sqrt(in[i].re*in[i].re + in[i].im*in[i].im);
+         break;
+   }
+}
+
+/// Gather pixels through an index table, filling unused outputs with NaN
+/** Unused outputs are given a valid (clamped) index and a mask of 0, so the loop has no branches and the
+  * compiler can vectorize it with gather and blend instructions.
+  */
+template<typename outT, typename inT>
+void imageRemapGather( outT * __restrict__ out,          ///< [out] the remapped image, n pixels
+                       const inT * __restrict__ in,      ///< [in] the input
+                       const int32_t * __restrict__ idx, ///< [in] the index into in of each output, always valid
+                       const uint8_t * __restrict__ use, ///< [in] 1 for outputs which are used, 0 for NaN
+                       size_t n                          ///< [in] the number of output pixels
+                     )
+{
+   const outT fill = std::numeric_limits<outT>::quiet_NaN();
+
+   for(size_t i = 0; i < n; ++i) out[i] = use[i] ? static_cast<outT>(in[idx[i]]) : fill;
+}
+
+/// Count the pixels of an image above a threshold.
+/** The comparison is accumulated as 0 or 1, with no branches, so the loop vectorizes for all types.
+  */
+template<typename dataT>
+size_t imageCountAbove( const dataT * __restrict__ im, ///< [in] the image
+                        size_t n,                      ///< [in] the number of pixels
+                        dataT thresh                   ///< [in] the threshold
+                      )
+{
+   size_t count = 0;
+   for(size_t i = 0; i < n; ++i) count += (im[i] > thresh);
+
+   return count;
+}
+
+/// Count the pixels of an image above a threshold, within a mask.
+template<typename dataT>
+size_t imageCountAbove( const dataT * __restrict__ im,      ///< [in] the image
+                        const uint8_t * __restrict__ mask, ///< [in] 1 for pixels to count, 0 for pixels to ignore
+                        size_t n,                           ///< [in] the number of pixels
+                        dataT thresh                        ///< [in] the threshold
+                      )
+{
+   size_t count = 0;
+   for(size_t i = 0; i < n; ++i) count += (im[i] > thresh) & mask[i];
+
+   return count;
+}
+
+/// Sums of the pixels of a region, and their first and second moments, for centroid and width estimates.
+struct imageMoments
+{
+   double flux {0};  ///< The sum of the pixels
+   double sumX {0};  ///< The sum of x times the pixels
+   double sumY {0};  ///< The sum of y times the pixels
+   double sumXX {0}; ///< The sum of x squared times the pixels
+   double sumYY {0}; ///< The sum of y squared times the pixels
+
+   double inside {0}; ///< The sum of the pixels within the circle
+
+   double peak {0};   ///< The largest pixel
+   size_t peakX {0};  ///< The column of the largest pixel
+   size_t peakY {0};  ///< The row of the largest pixel
+};
+
+/// Calculate the moments of a region of interest in one pass.
+/** Coordinates are in pixels of the full image.  The sum within a circle, for encircled energy, is accumulated in
+  * the same pass, so the circle has to be known in advance.  Each row is accumulated with no branches, so the loop
+  * vectorizes, and the peak is located only in rows whose maximum is a new peak.
+  */
+template<typename dataT>
+void imageMomentsROI( imageMoments & m,              ///< [out] the moments
+                      const dataT * __restrict__ in, ///< [in] the image
+                      size_t nx,                     ///< [in] the first dimension of the image
+                      size_t x0,                     ///< [in] the first column of the ROI
+                      size_t y0,                     ///< [in] the first row of the ROI
+                      size_t w,                      ///< [in] the width of the ROI
+                      size_t h,                      ///< [in] the height of the ROI
+                      double cx,                     ///< [in] the column of the center of the circle
+                      double cy,                     ///< [in] the row of the center of the circle
+                      double radius                  ///< [in] the radius of the circle
+                    )
+{
+   m = imageMoments();
+   if(w == 0 || h == 0) return;
+
+   double r2 = radius*radius;
+   bool first = true;
+
+   for(size_t j = 0; j < h; ++j)
+   {
+      const dataT * row = in + (y0 + j)*nx + x0;
+
+      double y = y0 + j;
+      double dy2 = (y - cy)*(y - cy);
+
+      double s = 0, sx = 0, sxx = 0, inside = 0;
+      dataT rmax = row[0];
+
+      for(size_t i = 0; i < w; ++i)
+      {
+         double v = row[i];
+         double x = x0 + i;
+
+         s += v;
+         sx += v*x;
+         sxx += v*x*x;
+         inside += v*((x - cx)*(x - cx) + dy2 <= r2);
+
+         rmax = (row[i] > rmax) ? row[i] : rmax;
+      }
+
+      m.flux += s;
+      m.sumX += sx;
+      m.sumXX += sxx;
+      m.sumY += s*y;
+      m.sumYY += s*y*y;
+      m.inside += inside;
+
+      if(first || rmax > m.peak)
+      {
+         size_t i = 0;
+         while(i + 1 < w && row[i] != rmax) ++i;
+
+         m.peak = rmax;
+         m.peakX = x0 + i;
+         m.peakY = y0 + j;
+         first = false;
+      }
+   }
+}
+
+#ifndef IMAGE_GATHER_BLOCK
+/// The side of the square blocks, in pixels, in which strided views are gathered
+#define IMAGE_GATHER_BLOCK (32)
+#endif
+
+/// A view of an image, or cube of images, inside a larger array.
+/** The pixel at (i,j,k) is at byte offset i*stride1 + j*stride2 + k*stride3 from data.  Strides of 0 mean dense.
+  * Strides may be negative, and transposing or flipping only changes how the view is read, so sub-blocks, column
+  * or row-major matrices, and every-Nth-pixel views can all be described without copying.
+  *
+  * The dimensions are those of the view as stored: with transpose the displayed image is dim2 x dim1.
+  */
+template<typename dataT>
+struct imageView
+{
+   const dataT * data {nullptr}; ///< The pixel (0,0,0)
+
+   size_t dim1 {0}; ///< The first dimension
+   size_t dim2 {0}; ///< The second dimension
+   size_t dim3 {1}; ///< The number of images
+
+   ptrdiff_t stride1 {0}; ///< Bytes between pixels along the first dimension, 0 for sizeof(dataT)
+   ptrdiff_t stride2 {0}; ///< Bytes between pixels along the second dimension, 0 for dense
+   ptrdiff_t stride3 {0}; ///< Bytes between images, 0 for dense
+
+   bool transpose {false}; ///< Swap the first and second dimensions when displayed
+   bool flip1 {false};     ///< Reverse the first displayed dimension
+   bool flip2 {false};     ///< Reverse the second displayed dimension
+
+   ///Get the first dimension as displayed.
+   size_t outDim1() const
+   {
+      return transpose ? dim2 : dim1;
+   }
+
+   ///Get the second dimension as displayed.
+   size_t outDim2() const
+   {
+      return transpose ? dim1 : dim2;
+   }
+};
+
+/// Gather a view into a dense image, as displayed.
+/** The output is written in order, and when the input is not also read in order the image is done in
+  * IMAGE_GATHER_BLOCK square blocks, so the lines of input touched by a block stay in cache.  Rows which are dense in
+  * the input are copied with memcpy.
+  */
+template<typename dataT>
+void imageViewGather( dataT * __restrict__ out,   ///< [out] the outDim1() x outDim2() x dim3 image
+                      const imageView<dataT> & v  ///< [in] the view
+                    )
+{
+   ptrdiff_t s1 = v.stride1 ? v.stride1 : static_cast<ptrdiff_t>(sizeof(dataT));
+   ptrdiff_t s2 = v.stride2 ? v.stride2 : s1*static_cast<ptrdiff_t>(v.dim1);
+   ptrdiff_t s3 = v.stride3 ? v.stride3 : s2*static_cast<ptrdiff_t>(v.dim2);
+
+   //Strides and extents along the displayed dimensions
+   size_t n1 = v.outDim1();
+   size_t n2 = v.outDim2();
+   ptrdiff_t o1 = v.transpose ? s2 : s1;
+   ptrdiff_t o2 = v.transpose ? s1 : s2;
+
+   for(size_t k = 0; k < v.dim3; ++k)
+   {
+      const char * base = reinterpret_cast<const char *>(v.data) + static_cast<ptrdiff_t>(k)*s3;
+
+      //Flips start from the other end and step backwards
+      if(v.flip1) base += static_cast<ptrdiff_t>(n1-1)*o1;
+      if(v.flip2) base += static_cast<ptrdiff_t>(n2-1)*o2;
+
+      ptrdiff_t d1 = v.flip1 ? -o1 : o1;
+      ptrdiff_t d2 = v.flip2 ? -o2 : o2;
+
+      dataT * o = out + k*n1*n2;
+
+      if(d1 == static_cast<ptrdiff_t>(sizeof(dataT)))
+      {
+         for(size_t j = 0; j < n2; ++j) memcpy(o + j*n1, base + static_cast<ptrdiff_t>(j)*d2, n1*sizeof(dataT));
+         continue;
+      }
+
+      for(size_t jb = 0; jb < n2; jb += IMAGE_GATHER_BLOCK)
+      {
+         size_t je = (jb + IMAGE_GATHER_BLOCK < n2) ? jb + IMAGE_GATHER_BLOCK : n2;
+
+         for(size_t ib = 0; ib < n1; ib += IMAGE_GATHER_BLOCK)
+         {
+            size_t ie = (ib + IMAGE_GATHER_BLOCK < n1) ? ib + IMAGE_GATHER_BLOCK : n1;
+
+            for(size_t j = jb; j < je; ++j)
+            {
+               const char * row = base + static_cast<ptrdiff_t>(j)*d2;
+               for(size_t i = ib; i < ie; ++i)
+               {
+                  memcpy(o + j*n1 + i, row + static_cast<ptrdiff_t>(i)*d1, sizeof(dataT)); //the input need not be aligned
+               }
+            }
+         }
+      }
+   }
+}
+
+/// @}
+
+} //namespace improc
+} //namespace mx
+
+#endif //improc_imageKernels_hpp
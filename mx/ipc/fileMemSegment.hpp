@@ -0,0 +1,210 @@
+/** \file fileMemSegment.hpp
+  * \brief A shared memory segment backed by a memory file, which other processes map by path
+  * \ingroup IPC_sharedmem
+  * \author Jared R. Males (jaredmales@gmail.com)
+  *
+  */
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef ipc_fileMemSegment_hpp
+#define ipc_fileMemSegment_hpp
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ipc.hpp"
+
+#ifndef MX_IPC_HUGEPAGE_SIZE
+///The huge page size, to which huge page segments are rounded up
+#define MX_IPC_HUGEPAGE_SIZE (2*1024*1024)
+#endif
+
+namespace mx
+{
+namespace ipc
+{
+
+/** \addtogroup IPC_sharedmem
+  * @{
+  */
+
+/// A shared memory segment backed by a memory file, which another process attaches to by opening \ref path
+/** Unlike a SysV segment this is not limited by shmmax and shmall.  The file is made with memfd_create, and \ref path
+  * is its /proc/<pid>/fd/<n> link, so it is freed when the last process using it closes it, even if that is by
+  * crashing.  Where memfd_create is not available, a file in /dev/shm is used instead, readable only by this user,
+  * which is removed by \ref detach.  If the process crashes first that file is left behind, holding its memory until
+  * it is deleted.
+  *
+  * With huge pages the file is made with MFD_HUGETLB and its size rounded up to \ref MX_IPC_HUGEPAGE_SIZE, falling
+  * back to normal pages if none are available.
+  */
+class fileMemSegment
+{
+public:
+   ///The path another process opens to map the segment
+   char path[MX_IPC_KEYLEN];
+
+   ///The file descriptor, -1 if not created
+   int fd;
+
+   ///The base address of the segment
+   void * addr;
+
+   ///The size of the segment
+   size_t size;
+
+   ///Whether the segment is backed by huge pages
+   bool hugePages;
+
+   ///Whether path is a file to remove on detach, rather than a memfd link
+   bool unlinkPath;
+
+public:
+
+   ///Initialize the class
+   void initialize();
+
+   ///Create and map the segment
+   /**
+     * \param sz the size of the segment to create
+     * \param huge whether to try huge pages
+     *
+     * \returns 0 on success
+     * \returns -1 on an error
+     */
+   int create( size_t sz,
+               bool huge = false
+             );
+
+   ///Unmap and close the segment
+   int detach();
+
+protected:
+   ///Open the backing file, with memfd_create where possible
+   int openFile( bool huge );
+};
+
+inline
+void fileMemSegment::initialize()
+{
+   path[0] = 0;
+   fd = -1;
+   addr = 0;
+   size = 0;
+   hugePages = false;
+   unlinkPath = false;
+}
+
+inline
+int fileMemSegment::openFile( bool huge )
+{
+#ifdef MFD_CLOEXEC
+   unsigned int flags = MFD_CLOEXEC;
+#ifdef MFD_HUGETLB
+   if(huge) flags |= MFD_HUGETLB;
+#else
+   if(huge) return -1;
+#endif
+
+   fd = memfd_create("mxFileMemSegment", flags);
+   if(fd >= 0)
+   {
+      snprintf(path, MX_IPC_KEYLEN, "/proc/%d/fd/%d", (int) getpid(), fd);
+      unlinkPath = false;
+      return 0;
+   }
+
+   if(errno != ENOSYS) return -1;
+#endif
+
+   if(huge) return -1;
+
+   static int count = 0;
+   snprintf(path, MX_IPC_KEYLEN, "/dev/shm/mxFileMemSegment.%d.%d", (int) getpid(), count++);
+
+   //Only for this user, which ds9 must run as to reach a memfd anyway
+   fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+   if(fd < 0) return -1;
+
+   unlinkPath = true;
+
+   return 0;
+}
+
+inline
+int fileMemSegment::create( size_t sz,
+                            bool huge
+                          )
+{
+   for(int tryHuge = (huge ? 1 : 0); tryHuge >= 0; --tryHuge)
+   {
+      size_t fsz = sz;
+      if(tryHuge) fsz = ((sz + MX_IPC_HUGEPAGE_SIZE - 1)/MX_IPC_HUGEPAGE_SIZE)*MX_IPC_HUGEPAGE_SIZE;
+
+      if(openFile(tryHuge) < 0) continue;
+
+      if(ftruncate(fd, fsz) == 0)
+      {
+         addr = mmap(0, fsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+         if(addr != MAP_FAILED)
+         {
+            size = fsz;
+            hugePages = tryHuge;
+            return 0;
+         }
+      }
+
+      //e.g. no huge pages are reserved
+      addr = 0;
+      close(fd);
+      fd = -1;
+      if(unlinkPath) unlink(path);
+      path[0] = 0;
+   }
+
+   fprintf(stderr, "Could not create a memory file segment of %zu bytes\n", sz);
+
+   return -1;
+}
+
+inline
+int fileMemSegment::detach()
+{
+   if(addr != 0) munmap(addr, size);
+   if(fd >= 0) close(fd);
+   if(unlinkPath && path[0] != 0) unlink(path);
+
+   initialize();
+
+   return 0;
+}
+
+/// @}
+
+}//namespace ipc
+}//namespace mx
+
+#endif //ipc_fileMemSegment_hpp
@@ -0,0 +1,575 @@
+/** \file displayBudget.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief A display budget shared by all of the viewers on a host
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_displayBudget_hpp
+#define milk_displayBudget_hpp
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DISPLAYBUDGET_NAME
+/// The name of the POSIX shared memory segment holding the budget, to which .<uid> is added
+#define DISPLAYBUDGET_NAME "/milk2ds9_budget"
+#endif
+
+#ifndef DISPLAYBUDGET_SLOTS
+/// The most viewers which can share the budget
+#define DISPLAYBUDGET_SLOTS (128)
+#endif
+
+#ifndef DISPLAYBUDGET_BURST
+/// The time, in seconds, of its share a viewer can save up.  Beyond this the share goes to the common pool.
+#define DISPLAYBUDGET_BURST (0.25)
+#endif
+
+#ifndef DISPLAYBUDGET_STALE
+/// The time, in seconds, after which a viewer which has not asked to display gives up its share
+#define DISPLAYBUDGET_STALE (2.0)
+#endif
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// The kinds of budget, each a separate bucket.
+enum displayBudgetKind
+{
+   budgetCPU,   ///< CPU seconds per second, i.e. cores
+   budgetRate,  ///< Images per second
+   budgetKinds  ///< The number of kinds
+};
+
+/// One viewer's place in the \ref displayBudgetShared segment.
+struct displayBudgetSlot
+{
+   pid_t pid;                   ///< The viewer's process, 0 if the slot is free
+   double priority;             ///< The viewer's weight
+   int visible;                 ///< Whether the viewer is showing anything.  Hidden viewers get no share.
+   double lastSeen;             ///< When the viewer last asked to display, on CLOCK_MONOTONIC
+   double tokens[budgetKinds];  ///< The viewer's saved share, which may go negative by one image
+};
+
+/// The shared memory segment holding a host's display budget.
+struct displayBudgetShared
+{
+   std::atomic<uint32_t> magic;  ///< Set to DISPLAYBUDGET_MAGIC once the segment is initialized
+   pthread_mutex_t mutex;        ///< Protects everything below, process shared and robust
+   double limit[budgetKinds];    ///< The budget, 0 for no limit
+   double pool[budgetKinds];     ///< Shares not needed by their viewers, which any viewer can draw on
+   double lastRefill;            ///< When the buckets were last filled, on CLOCK_MONOTONIC
+   displayBudgetSlot slots[DISPLAYBUDGET_SLOTS]; ///< The viewers
+};
+
+/// The display budget shared by all of a user's viewers on a host, as token buckets in shared memory.
+/** Each viewer joins with a priority, and asks with \ref admit before each image it displays, then reports the CPU
+  * time the image took with \ref charge.  The host-wide budget, in CPU time and in images per second, is divided
+  * between the viewers which are visible and have asked recently, in proportion to their priorities.  What a viewer
+  * does not use beyond \ref DISPLAYBUDGET_BURST seconds of its share goes to a common pool, so a busy viewer can use
+  * the share of an idle one.  When a viewer has neither share nor pool it skips images until there is room.
+  *
+  * The budget is kept in the segment, so it survives the viewers, and can be changed by any of them at any time with
+  * \ref setBudget.  A viewer which dies holding the lock does not block the others.
+  */
+class displayBudget
+{
+protected:
+   displayBudgetShared * m_shared {nullptr}; ///< The mapped segment, nullptr if not joined
+   int m_slot {-1};                          ///< This viewer's slot
+
+   bool m_visible {true}; ///< The visibility last set
+
+public:
+
+   ~displayBudget();
+
+   ///Join the user's budget on this host, creating it if this is the first viewer.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int join( double priority /**< [in] this viewer's weight, > 0*/);
+
+   ///Leave the budget.  Its share goes to the other viewers.
+   void leave();
+
+   ///Check whether this viewer has joined a budget.
+   bool joined() const;
+
+   ///Set the host-wide budget, for all viewers.
+   void setBudget( double cpu, ///< [in] CPU seconds per second, 0 for no limit
+                   double rate ///< [in] images per second, 0 for no limit
+                 );
+
+   ///Get the host-wide budget.
+   void budget( double & cpu, ///< [out] CPU seconds per second, 0 for no limit
+                double & rate ///< [out] images per second, 0 for no limit
+              );
+
+   ///Change this viewer's priority.
+   void priority( double p /**< [in] the new weight, > 0*/);
+
+   ///Set whether this viewer is showing anything.
+   void visible( bool vis /**< [in] false if nothing is being displayed*/);
+
+   ///Ask whether this viewer can display an image now.
+   /**
+     * \retval true if it can, or has not joined a budget
+     * \retval false if it is over its share and the pool is empty
+     */
+   bool admit();
+
+   ///Charge this viewer for an image displayed, or for work on one.
+   void charge( double cpu,        ///< [in] the CPU time the image took, in seconds
+                bool image = true  ///< [in] [optional] whether to count an image against the rate, false for CPU time only
+              );
+
+   ///Get the CPU time used by the calling thread, for measuring the cost of an image.
+   static double threadCPU();
+
+protected:
+   ///Get the time on CLOCK_MONOTONIC, which is the same for every process on the host.
+   static double now();
+
+   ///Open and map the segment, creating it if it does not exist.
+   /**
+     * \retval 0 on success
+     * \retval 1 if the segment was left uninitialized by a creator which died
+     * \retval -1 on an error
+     */
+   int attach( const std::string & name /**< [in] the name of the segment*/);
+
+   ///Lock the segment, recovering it if the holder died.
+   void lock();
+
+   ///Unlock the segment.
+   void unlock();
+
+   ///Fill the buckets for the time since the last fill.  Must be called locked.
+   void refill( double t /**< [in] the current time*/);
+};
+
+///The magic number marking an initialized \ref displayBudgetShared
+#define DISPLAYBUDGET_MAGIC (0x6d326462)
+
+inline
+displayBudget::~displayBudget()
+{
+   leave();
+}
+
+inline
+int displayBudget::attach( const std::string & name )
+{
+   bool created = true;
+   int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+   if(fd < 0 && errno == EEXIST)
+   {
+      created = false;
+      fd = shm_open(name.c_str(), O_RDWR, 0600);
+   }
+
+   if(fd < 0)
+   {
+      std::cerr << "displayBudget: could not open " << name << ": " << strerror(errno) << "\n";
+      return -1;
+   }
+
+   if(created)
+   {
+      if(ftruncate(fd, sizeof(displayBudgetShared)) < 0)
+      {
+         std::cerr << "displayBudget: could not size " << name << ": " << strerror(errno) << "\n";
+         close(fd);
+         shm_unlink(name.c_str());
+         return -1;
+      }
+   }
+   else
+   {
+      //Wait for the creator to size it
+      struct stat st;
+      st.st_size = 0;
+      for(int n = 0; n < 100; ++n)
+      {
+         if(fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(displayBudgetShared)) break;
+         usleep(10000);
+      }
+
+      if(st.st_size < (off_t) sizeof(displayBudgetShared))
+      {
+         close(fd);
+         return 1;
+      }
+   }
+
+   void * map = mmap(nullptr, sizeof(displayBudgetShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if(map == MAP_FAILED)
+   {
+      std::cerr << "displayBudget: could not map " << name << ": " << strerror(errno) << "\n";
+      return -1;
+   }
+
+   displayBudgetShared * sh = static_cast<displayBudgetShared *>(map);
+
+   if(created)
+   {
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init(&sh->mutex, &attr);
+      pthread_mutexattr_destroy(&attr);
+
+      //The new segment is zeroed, so there is no limit until one is set
+      sh->lastRefill = now();
+
+      sh->magic.store(DISPLAYBUDGET_MAGIC, std::memory_order_release);
+   }
+   else
+   {
+      for(int n = 0; n < 100 && sh->magic.load(std::memory_order_acquire) != DISPLAYBUDGET_MAGIC; ++n) usleep(10000);
+
+      if(sh->magic.load(std::memory_order_acquire) != DISPLAYBUDGET_MAGIC)
+      {
+         munmap(map, sizeof(displayBudgetShared));
+         return 1;
+      }
+   }
+
+   m_shared = sh;
+
+   return 0;
+}
+
+inline
+int displayBudget::join( double priority )
+{
+   leave();
+
+   if(priority <= 0)
+   {
+      std::cerr << "displayBudget: priority must be > 0\n";
+      return -1;
+   }
+
+   //Each user has a budget of their own, so no other user can hold its lock or change it
+   std::string name = DISPLAYBUDGET_NAME + std::string(".") + std::to_string(getuid());
+
+   int rv = attach(name);
+
+   //Left by a viewer which died creating it
+   if(rv > 0)
+   {
+      shm_unlink(name.c_str());
+      rv = attach(name);
+   }
+
+   if(rv != 0)
+   {
+      if(rv > 0) std::cerr << "displayBudget: " << name << " is not initialized\n";
+      return -1;
+   }
+
+   lock();
+
+   //A free slot, or one left by a viewer which has died
+   for(int n = 0; n < DISPLAYBUDGET_SLOTS; ++n)
+   {
+      pid_t pid = m_shared->slots[n].pid;
+      if(pid == 0 || (kill(pid, 0) < 0 && errno == ESRCH))
+      {
+         m_slot = n;
+         break;
+      }
+   }
+
+   if(m_slot >= 0)
+   {
+      displayBudgetSlot & s = m_shared->slots[m_slot];
+      s.pid = getpid();
+      s.priority = priority;
+      s.visible = m_visible;
+      s.lastSeen = now();
+      for(int k = 0; k < budgetKinds; ++k) s.tokens[k] = 0;
+   }
+
+   unlock();
+
+   if(m_slot < 0)
+   {
+      std::cerr << "displayBudget: all " << DISPLAYBUDGET_SLOTS << " slots are in use\n";
+      munmap(m_shared, sizeof(displayBudgetShared));
+      m_shared = nullptr;
+      return -1;
+   }
+
+   return 0;
+}
+
+inline
+void displayBudget::leave()
+{
+   if(!m_shared) return;
+
+   if(m_slot >= 0)
+   {
+      lock();
+      m_shared->slots[m_slot].pid = 0;
+      unlock();
+   }
+
+   munmap(m_shared, sizeof(displayBudgetShared));
+
+   m_shared = nullptr;
+   m_slot = -1;
+}
+
+inline
+bool displayBudget::joined() const
+{
+   return (m_shared != nullptr);
+}
+
+inline
+void displayBudget::setBudget( double cpu,
+                               double rate
+                             )
+{
+   if(!m_shared) return;
+
+   lock();
+
+   refill(now()); //the time so far at the old budget
+
+   m_shared->limit[budgetCPU] = (cpu > 0) ? cpu : 0;
+   m_shared->limit[budgetRate] = (rate > 0) ? rate : 0;
+
+   unlock();
+}
+
+inline
+void displayBudget::budget( double & cpu,
+                            double & rate
+                          )
+{
+   cpu = 0;
+   rate = 0;
+
+   if(!m_shared) return;
+
+   lock();
+   cpu = m_shared->limit[budgetCPU];
+   rate = m_shared->limit[budgetRate];
+   unlock();
+}
+
+inline
+void displayBudget::priority( double p )
+{
+   if(!m_shared || p <= 0) return;
+
+   lock();
+   m_shared->slots[m_slot].priority = p;
+   unlock();
+}
+
+inline
+void displayBudget::visible( bool vis )
+{
+   if(vis == m_visible) return;
+
+   m_visible = vis;
+
+   if(!m_shared) return;
+
+   lock();
+   refill(now());
+   m_shared->slots[m_slot].visible = vis;
+   unlock();
+}
+
+inline
+bool displayBudget::admit()
+{
+   if(!m_shared) return true;
+
+   double t = now();
+
+   lock();
+
+   refill(t);
+
+   displayBudgetSlot & s = m_shared->slots[m_slot];
+   s.lastSeen = t;
+
+   bool ok = true;
+   for(int k = 0; k < budgetKinds; ++k)
+   {
+      if(m_shared->limit[k] > 0 && s.tokens[k] <= 0 && m_shared->pool[k] <= 0) ok = false;
+   }
+
+   unlock();
+
+   return ok;
+}
+
+inline
+void displayBudget::charge( double cpu,
+                            bool image
+                          )
+{
+   if(!m_shared) return;
+
+   double cost[budgetKinds];
+   cost[budgetCPU] = cpu;
+   cost[budgetRate] = image ? 1 : 0;
+
+   lock();
+
+   displayBudgetSlot & s = m_shared->slots[m_slot];
+
+   for(int k = 0; k < budgetKinds; ++k)
+   {
+      if(m_shared->limit[k] <= 0) continue;
+
+      s.tokens[k] -= cost[k];
+
+      //Over its share, the pool pays what it can, and the rest is a debt on the viewer's next share
+      if(s.tokens[k] < 0 && m_shared->pool[k] > 0)
+      {
+         double take = (m_shared->pool[k] < -s.tokens[k]) ? m_shared->pool[k] : -s.tokens[k];
+         m_shared->pool[k] -= take;
+         s.tokens[k] += take;
+      }
+   }
+
+   unlock();
+}
+
+inline
+double displayBudget::threadCPU()
+{
+   timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+inline
+double displayBudget::now()
+{
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+inline
+void displayBudget::lock()
+{
+   if(pthread_mutex_lock(&m_shared->mutex) == EOWNERDEAD)
+   {
+      //The budget is just numbers, which are usable whatever the dead holder was doing
+      pthread_mutex_consistent(&m_shared->mutex);
+   }
+}
+
+inline
+void displayBudget::unlock()
+{
+   pthread_mutex_unlock(&m_shared->mutex);
+}
+
+inline
+void displayBudget::refill( double t )
+{
+   double dt = t - m_shared->lastRefill;
+   m_shared->lastRefill = t;
+
+   if(dt <= 0) return;
+   if(dt > DISPLAYBUDGET_BURST) dt = DISPLAYBUDGET_BURST; //nothing saved beyond a burst anyway
+
+   //The viewers which want to display, and their total weight
+   double total = 0;
+   for(int n = 0; n < DISPLAYBUDGET_SLOTS; ++n)
+   {
+      const displayBudgetSlot & s = m_shared->slots[n];
+      if(s.pid != 0 && s.visible && t - s.lastSeen < DISPLAYBUDGET_STALE) total += s.priority;
+   }
+
+   for(int k = 0; k < budgetKinds; ++k)
+   {
+      double limit = m_shared->limit[k];
+      if(limit <= 0) continue;
+
+      double & pool = m_shared->pool[k];
+
+      if(total <= 0) pool += limit*dt;
+      else
+      {
+         for(int n = 0; n < DISPLAYBUDGET_SLOTS; ++n)
+         {
+            displayBudgetSlot & s = m_shared->slots[n];
+            if(s.pid == 0 || !s.visible || t - s.lastSeen >= DISPLAYBUDGET_STALE) continue;
+
+            double share = limit*s.priority/total;
+            double cap = share*DISPLAYBUDGET_BURST;
+
+            s.tokens[k] += share*dt;
+            if(s.tokens[k] > cap)
+            {
+               pool += s.tokens[k] - cap;
+               s.tokens[k] = cap;
+            }
+         }
+      }
+
+      if(pool > limit*DISPLAYBUDGET_BURST) pool = limit*DISPLAYBUDGET_BURST;
+   }
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_displayBudget_hpp
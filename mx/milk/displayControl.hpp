@@ -0,0 +1,529 @@
+/** \file displayControl.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief An XPA access point for changing the display settings at runtime
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_displayControl_hpp
+#define milk_displayControl_hpp
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <xpa.h>
+
+#include "displayPipeline.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// The settings which can be changed through the control channel.
+struct displayControlState
+{
+   displayConfig config; ///< The display pipeline configuration
+
+   int waitTime {10000}; ///< The time, in usec, to wait after each image
+   int frameNo {1};      ///< The ds9 frame to display in
+   bool paused {false};  ///< Whether display updates are paused
+
+   bool frozen {false}; ///< Whether the history is frozen, showing the history image rather than the live one
+   size_t scrub {0};    ///< The history image shown when frozen, counted back from the newest
+   std::string dump;    ///< A file to write the history to, cleared once written
+
+   double priority {1};        ///< This viewer's weight in the host display budget
+   double budgetCPU {0};       ///< A new host display budget, in CPU seconds per second
+   double budgetRate {0};      ///< A new host display budget, in images per second
+   bool budgetChanged {false}; ///< Whether budgetCPU and budgetRate are to be applied, cleared once applied
+};
+
+/// An XPA access point which accepts commands to change the display settings.
+/** Commands are sent with xpaset, and the current settings and statistics are read with xpaget, e.g.
+  * \verbatim
+    xpaset -p milk2ds9 roi 100,100,64,64
+    xpaset -p milk2ds9 bin 2
+    xpaget milk2ds9 stats
+    \endverbatim
+  * Requests are only serviced when the owner calls \ref poll, so changes are never seen in the middle of an image.
+  * All the commands in one request, separated by newlines or semicolons, are applied together or not at all.
+  *
+  * The commands are:
+  * - rate Hz: the maximum display rate, 0 for no limit
+  * - roi x0,y0,w,h or roi full: the region of interest
+  * - bin N: the binning factor
+  * - precision name: native, float, linear, sqrt or log
+  * - component name: amplitude, phase, real or imag
+  * - pause [on|off]: pause or resume display updates
+  * - frame N: the ds9 frame
+  * - stats [on|off]: calculate image statistics
+  * - freeze [on|off]: stop recording history, and show the history rather than the live images
+  * - scrub N: show the history image N back from the newest
+  * - dump file: freeze, and write the history to a new FITS file, named without a directory
+  * - priority P: this viewer's weight in the host display budget
+  * - budget cpu[,rate]: the host display budget, for all viewers, in cores and images per second, 0 for no limit
+  *
+  * xpaget with no parameter returns all of the settings, and with "stats" returns the frame count and the
+  * statistics of the last image.
+  */
+class displayControl
+{
+protected:
+   XPA m_xpa {nullptr}; ///< The access point, nullptr if not open
+
+   displayControlState m_state; ///< The current settings
+
+   bool m_changed {false}; ///< Whether a request has changed the settings since the last poll
+
+   uint64_t m_frames {0}; ///< The number of images displayed
+   improc::imageStats m_stats; ///< The statistics of the last image
+
+public:
+
+   ~displayControl();
+
+   ///Open the access point, as milk2ds9:name.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int open( const std::string & name,          ///< [in] the name of the access point
+             const displayControlState & state  ///< [in] the initial settings
+           );
+
+   ///Close the access point.
+   void close();
+
+   ///Service any pending requests.
+   /**
+     * \retval 1 if the settings have changed
+     * \retval 0 if not
+     */
+   int poll();
+
+   ///Get the current settings.
+   const displayControlState & state() const;
+
+   ///Set the current settings, e.g. to undo a change which could not be applied.
+   void state( const displayControlState & st /**< [in] the new settings*/);
+
+   ///Record that an image was displayed, with its statistics.
+   void frameDone( const improc::imageStats & stats /**< [in] the statistics of the image*/);
+
+   ///Apply a request to the settings.
+   /** If any command fails, the settings are left unchanged.
+     *
+     * \retval 0 on success
+     * \retval -1 on an error, with a description in err
+     */
+   int request( std::string & err,           ///< [out] a description of the error, if any
+                const std::string & commands ///< [in] one or more commands, separated by newlines or semicolons
+              );
+
+   ///Format the settings, or the statistics, as text.
+   std::string report( const std::string & what /**< [in] "stats" for the statistics, otherwise the settings*/);
+
+protected:
+   ///Apply one command to a set of settings.
+   int command( std::string & err,
+                displayControlState & st,
+                const std::string & cmd
+              );
+
+   static int sendCallback( void * client_data,
+                            void * call_data,
+                            char * paramlist,
+                            char ** buf,
+                            size_t * len
+                          );
+
+   static int receiveCallback( void * client_data,
+                               void * call_data,
+                               char * paramlist,
+                               char * buf,
+                               size_t len
+                             );
+};
+
+inline
+displayControl::~displayControl()
+{
+   close();
+}
+
+inline
+int displayControl::open( const std::string & name,
+                          const displayControlState & state
+                        )
+{
+   close();
+
+   m_state = state;
+   m_changed = false;
+
+   m_xpa = XPANew( (char *) "milk2ds9", (char *) name.c_str(), (char *) "milk2ds9 display settings",
+                   sendCallback, this, (char *) "freebuf=true", receiveCallback, this, (char *) "fillbuf=true");
+
+   if(!m_xpa)
+   {
+      std::cerr << "displayControl: could not create access point milk2ds9:" << name << "\n";
+      return -1;
+   }
+
+   return 0;
+}
+
+inline
+void displayControl::close()
+{
+   if(m_xpa) XPAFree(m_xpa);
+
+   m_xpa = nullptr;
+}
+
+inline
+int displayControl::poll()
+{
+   if(!m_xpa) return 0;
+
+   //Service everything that is waiting, without blocking
+   XPAPoll(0, 0);
+
+   int changed = m_changed;
+   m_changed = false;
+
+   return changed;
+}
+
+inline
+const displayControlState & displayControl::state() const
+{
+   return m_state;
+}
+
+inline
+void displayControl::state( const displayControlState & st )
+{
+   m_state = st;
+}
+
+inline
+void displayControl::frameDone( const improc::imageStats & stats )
+{
+   ++m_frames;
+   m_stats = stats;
+}
+
+inline
+int displayControl::request( std::string & err,
+                             const std::string & commands
+                           )
+{
+   displayControlState st = m_state;
+
+   size_t start = 0;
+   while(start < commands.size())
+   {
+      size_t end = commands.find_first_of(";\n", start);
+      if(end == std::string::npos) end = commands.size();
+
+      std::string cmd = commands.substr(start, end-start);
+      start = end + 1;
+
+      if(cmd.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+      if(command(err, st, cmd) < 0) return -1;
+   }
+
+   m_state = st;
+   m_changed = true;
+
+   return 0;
+}
+
+inline
+int displayControl::command( std::string & err,
+                             displayControlState & st,
+                             const std::string & cmd
+                           )
+{
+   std::istringstream in(cmd);
+
+   std::string key, arg;
+   in >> key >> arg;
+
+   if(key == "rate")
+   {
+      double rate = strtod(arg.c_str(), nullptr);
+      if(arg == "" || rate < 0)
+      {
+         err = "rate requires a rate in Hz, or 0 for no limit";
+         return -1;
+      }
+
+      st.waitTime = (rate > 0) ? 1e6/rate : 0;
+   }
+   else if(key == "roi")
+   {
+      displayConfig & c = st.config;
+      if(arg == "full")
+      {
+         c.roiX = c.roiY = c.roiW = c.roiH = 0;
+      }
+      else if(sscanf(arg.c_str(), "%zu,%zu,%zu,%zu", &c.roiX, &c.roiY, &c.roiW, &c.roiH) != 4)
+      {
+         err = "roi requires x0,y0,w,h or full";
+         return -1;
+      }
+   }
+   else if(key == "bin")
+   {
+      int bin = atoi(arg.c_str());
+      if(bin < 1)
+      {
+         err = "bin requires a binning factor >= 1";
+         return -1;
+      }
+
+      st.config.bin = bin;
+   }
+   else if(key == "precision")
+   {
+      if(parsePrecision(st.config.precision, arg) < 0)
+      {
+         err = "precision must be one of native, float, linear, sqrt, or log";
+         return -1;
+      }
+   }
+   else if(key == "component")
+   {
+      if(parseComponent(st.config.component, arg) < 0)
+      {
+         err = "component must be one of amplitude, phase, real, or imag";
+         return -1;
+      }
+   }
+   else if(key == "pause")
+   {
+      if(arg == "" || arg == "on") st.paused = true;
+      else if(arg == "off") st.paused = false;
+      else
+      {
+         err = "pause takes on or off";
+         return -1;
+      }
+   }
+   else if(key == "frame")
+   {
+      int frame = atoi(arg.c_str());
+      if(frame < 1)
+      {
+         err = "frame requires a frame number >= 1";
+         return -1;
+      }
+
+      st.frameNo = frame;
+   }
+   else if(key == "stats")
+   {
+      if(arg == "" || arg == "on") st.config.stats = true;
+      else if(arg == "off") st.config.stats = false;
+      else
+      {
+         err = "stats takes on or off";
+         return -1;
+      }
+   }
+   else if(key == "freeze")
+   {
+      if(arg == "" || arg == "on") st.frozen = true;
+      else if(arg == "off") st.frozen = false;
+      else
+      {
+         err = "freeze takes on or off";
+         return -1;
+      }
+
+      st.scrub = 0;
+   }
+   else if(key == "scrub")
+   {
+      int back = atoi(arg.c_str());
+      if(arg == "" || back < 0)
+      {
+         err = "scrub requires the number of images back from the newest";
+         return -1;
+      }
+
+      st.scrub = back;
+   }
+   else if(key == "dump")
+   {
+      if(arg == "")
+      {
+         err = "dump requires a file name";
+         return -1;
+      }
+
+      //The caller chooses the directory, so a client can't write anywhere else
+      if(arg.find('/') != std::string::npos || arg == "." || arg == "..")
+      {
+         err = "dump file name can not contain a directory";
+         return -1;
+      }
+
+      st.frozen = true;
+      st.dump = arg;
+   }
+   else if(key == "priority")
+   {
+      double p = strtod(arg.c_str(), nullptr);
+      if(p <= 0)
+      {
+         err = "priority requires a weight > 0";
+         return -1;
+      }
+
+      st.priority = p;
+   }
+   else if(key == "budget")
+   {
+      double cpu = 0, rate = 0;
+      if(sscanf(arg.c_str(), "%lf,%lf", &cpu, &rate) < 1 || cpu < 0 || rate < 0)
+      {
+         err = "budget requires cpu[,rate], 0 for no limit";
+         return -1;
+      }
+
+      st.budgetCPU = cpu;
+      st.budgetRate = rate;
+      st.budgetChanged = true;
+   }
+   else
+   {
+      err = "unknown command: " + key;
+      return -1;
+   }
+
+   return 0;
+}
+
+inline
+std::string displayControl::report( const std::string & what )
+{
+   static const char * precisions[] = {"native", "float", "linear", "sqrt", "log"};
+   static const char * components[] = {"amplitude", "phase", "real", "imag"};
+
+   std::ostringstream out;
+
+   if(what == "stats")
+   {
+      out << "frames " << m_frames << "\n";
+      out << "min " << m_stats.min << "\n";
+      out << "max " << m_stats.max << "\n";
+      out << "mean " << m_stats.mean << "\n";
+
+      return out.str();
+   }
+
+   const displayConfig & c = m_state.config;
+
+   out << "rate " << ((m_state.waitTime > 0) ? 1e6/m_state.waitTime : 0) << "\n";
+   if(c.roiW == 0 && c.roiH == 0 && c.roiX == 0 && c.roiY == 0) out << "roi full\n";
+   else out << "roi " << c.roiX << "," << c.roiY << "," << c.roiW << "," << c.roiH << "\n";
+   out << "bin " << c.bin << "\n";
+   out << "precision " << precisions[c.precision] << "\n";
+   out << "component " << components[c.component] << "\n";
+   out << "pause " << (m_state.paused ? "on" : "off") << "\n";
+   out << "frame " << m_state.frameNo << "\n";
+   out << "stats " << (c.stats ? "on" : "off") << "\n";
+   out << "freeze " << (m_state.frozen ? "on" : "off") << "\n";
+   out << "scrub " << m_state.scrub << "\n";
+   out << "priority " << m_state.priority << "\n";
+
+   return out.str();
+}
+
+inline
+int displayControl::sendCallback( void * client_data,
+                                  void * call_data,
+                                  char * paramlist,
+                                  char ** buf,
+                                  size_t * len
+                                )
+{
+   static_cast<void>(call_data);
+
+   displayControl * dc = static_cast<displayControl *>(client_data);
+
+   std::string what = (paramlist) ? paramlist : "";
+   what.erase(0, what.find_first_not_of(" \t"));
+   what.erase(what.find_last_not_of(" \t") + 1);
+
+   std::string rep = dc->report(what);
+
+   //XPA frees the buffer
+   *buf = strdup(rep.c_str());
+   *len = rep.size();
+
+   return 0;
+}
+
+inline
+int displayControl::receiveCallback( void * client_data,
+                                     void * call_data,
+                                     char * paramlist,
+                                     char * buf,
+                                     size_t len
+                                   )
+{
+   displayControl * dc = static_cast<displayControl *>(client_data);
+
+   //Commands come as parameters (xpaset -p) or on stdin
+   std::string commands = (paramlist) ? paramlist : "";
+   if(buf && len > 0) commands += "\n" + std::string(buf, len);
+
+   std::string err;
+   if(dc->request(err, commands) < 0)
+   {
+      XPAError( (XPA) call_data, (char *) err.c_str());
+      return -1;
+   }
+
+   return 0;
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_displayControl_hpp
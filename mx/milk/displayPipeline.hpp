@@ -0,0 +1,682 @@
+/** \file displayPipeline.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief A per-datatype pipeline which prepares stream images for display
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_displayPipeline_hpp
+#define milk_displayPipeline_hpp
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "milkTypes.hpp"
+#include "remapTable.hpp"
+#include "../improc/imageKernels.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// The precision with which images are sent to the display
+enum displayPrecision
+{
+   precisionNative,   ///< The stream's own type
+   precisionFloat,    ///< 8 byte types are converted to single precision
+   precisionLinear16, ///< Types wider than 2 bytes are quantized to 16 bits, linearly
+   precisionSqrt16,   ///< Types wider than 2 bytes are quantized to 16 bits, with a square root stretch
+   precisionLog16     ///< Types wider than 2 bytes are quantized to 16 bits, with a log stretch
+};
+
+/// Parse a display precision name
+/** The names are native, float, linear, sqrt, and log.
+  *
+  * \retval 0 on success
+  * \retval -1 if the name is not recognized
+  */
+inline
+int parsePrecision( displayPrecision & prec, ///< [out] the precision
+                    const std::string & name ///< [in] the name
+                  )
+{
+   if(name == "native") prec = precisionNative;
+   else if(name == "float") prec = precisionFloat;
+   else if(name == "linear") prec = precisionLinear16;
+   else if(name == "sqrt") prec = precisionSqrt16;
+   else if(name == "log") prec = precisionLog16;
+   else return -1;
+
+   return 0;
+}
+
+/// Parse a complex component name
+/** The names are amplitude, phase, real, and imag.
+  *
+  * \retval 0 on success
+  * \retval -1 if the name is not recognized
+  */
+inline
+int parseComponent( improc::complexComponent & comp, ///< [out] the component
+                    const std::string & name         ///< [in] the name
+                  )
+{
+   if(name == "amplitude") comp = improc::componentAmplitude;
+   else if(name == "phase") comp = improc::componentPhase;
+   else if(name == "real") comp = improc::componentReal;
+   else if(name == "imag") comp = improc::componentImag;
+   else return -1;
+
+   return 0;
+}
+
+/// Configuration of the display pipeline stages.
+struct displayConfig
+{
+   size_t roiX {0}; ///< The first column of the region of interest
+   size_t roiY {0}; ///< The first row of the region of interest
+   size_t roiW {0}; ///< The width of the region of interest.  0 means the full image.
+   size_t roiH {0}; ///< The height of the region of interest.  0 means the full image.
+
+   improc::complexComponent component {improc::componentAmplitude}; ///< The component displayed for complex streams
+
+   size_t bin {1}; ///< The binning factor.  Bins are averaged.
+
+   displayPrecision precision {precisionNative}; ///< The precision sent to the display.  Quantization is auto-ranged on each image.
+
+   bool stats {false}; ///< Whether to calculate statistics of each displayed image
+
+   size_t psdAverage {1}; ///< For power spectra, the number of images averaged over (exponentially)
+   bool psdLog {true};    ///< For power spectra, whether the log10 of the power is displayed
+};
+
+/// Resolve the region of interest of a configuration within an image.
+/** An ROI starting outside the image starts at 0, and a width or height of 0, or one which runs past the edge of the
+  * image, runs to the edge.
+  */
+inline
+void displayROI( size_t & x0,                  ///< [out] the first column
+                 size_t & y0,                  ///< [out] the first row
+                 size_t & w,                   ///< [out] the width
+                 size_t & h,                   ///< [out] the height
+                 const displayConfig & config, ///< [in] the configuration
+                 size_t nx,                    ///< [in] the first dimension of the image
+                 size_t ny                     ///< [in] the second dimension of the image
+               )
+{
+   x0 = (config.roiX < nx) ? config.roiX : 0;
+   y0 = (config.roiY < ny) ? config.roiY : 0;
+
+   w = (config.roiW == 0 || x0 + config.roiW > nx) ? nx - x0 : config.roiW;
+   h = (config.roiH == 0 || y0 + config.roiH > ny) ? ny - y0 : config.roiH;
+}
+
+/// Prepares images from a stream for display.
+/** The pipeline is specialized for the pixel type of the stream when it is created by \ref makeDisplayPipeline,
+  * so the per-pixel stages are compiled for each type and no per-pixel branching on the type is needed.
+  * The last stage writes its output directly into the caller's buffer, typically the ds9 shared memory segment.
+  */
+class displayPipeline
+{
+protected:
+   displayConfig m_config;
+
+   size_t m_nx {0}; ///< The first dimension of the input images
+   size_t m_ny {0}; ///< The second dimension of the input images
+
+   size_t m_x0 {0}; ///< The first column of the ROI in use
+   size_t m_y0 {0}; ///< The first row of the ROI in use
+   size_t m_w {0};  ///< The width of the ROI in use
+   size_t m_h {0};  ///< The height of the ROI in use
+
+   size_t m_dim1 {0}; ///< The first dimension of the output
+   size_t m_dim2 {0}; ///< The second dimension of the output
+
+   improc::imageStats m_stats;
+
+public:
+
+   virtual ~displayPipeline() {}
+
+   ///Configure the pipeline for the input image size.
+   /** The ROI is clipped to the image, see \ref displayROI, and the output size is calculated.
+     *
+     * \retval 0 on success
+     * \retval -1 if the configuration results in an empty output
+     */
+   virtual int configure( size_t nx,                    ///< [in] the first dimension of the input images
+                          size_t ny,                    ///< [in] the second dimension of the input images
+                          const displayConfig & config  ///< [in] the stage configuration
+                        );
+
+   ///Get the current configuration.
+   const displayConfig & config() const;
+
+   ///Get the first column of the ROI in use.
+   size_t roiX() const;
+
+   ///Get the first row of the ROI in use.
+   size_t roiY() const;
+
+   ///Get the width of the ROI in use.
+   size_t roiW() const;
+
+   ///Get the height of the ROI in use.
+   size_t roiH() const;
+
+   ///Get the first dimension of the output image.
+   size_t dim1() const;
+
+   ///Get the second dimension of the output image.
+   size_t dim2() const;
+
+   ///Get the cfitsio image type of the output.
+   virtual int bitpix() const = 0;
+
+   ///Get the size of an output pixel in bytes.
+   virtual size_t pixsz() const = 0;
+
+   ///Get the statistics of the last image, if enabled.
+   const improc::imageStats & stats() const;
+
+   ///Process one input image into the output buffer.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   virtual int process( void * out,     ///< [out] the output buffer, which must hold dim1()*dim2()*pixsz() bytes
+                        const void * in ///< [in] the input image, nx x ny pixels
+                      ) = 0;
+};
+
+inline
+int displayPipeline::configure( size_t nx,
+                                size_t ny,
+                                const displayConfig & config
+                              )
+{
+   m_config = config;
+   if(m_config.bin < 1) m_config.bin = 1;
+
+   m_nx = nx;
+   m_ny = ny;
+
+   displayROI(m_x0, m_y0, m_w, m_h, m_config, nx, ny);
+
+   m_dim1 = m_w/m_config.bin;
+   m_dim2 = m_h/m_config.bin;
+
+   if(m_dim1 == 0 || m_dim2 == 0) return -1;
+
+   return 0;
+}
+
+inline
+const displayConfig & displayPipeline::config() const
+{
+   return m_config;
+}
+
+inline
+size_t displayPipeline::roiX() const
+{
+   return m_x0;
+}
+
+inline
+size_t displayPipeline::roiY() const
+{
+   return m_y0;
+}
+
+inline
+size_t displayPipeline::roiW() const
+{
+   return m_w;
+}
+
+inline
+size_t displayPipeline::roiH() const
+{
+   return m_h;
+}
+
+inline
+size_t displayPipeline::dim1() const
+{
+   return m_dim1;
+}
+
+inline
+size_t displayPipeline::dim2() const
+{
+   return m_dim2;
+}
+
+inline
+const improc::imageStats & displayPipeline::stats() const
+{
+   return m_stats;
+}
+
+/// The display pipeline specialized for one pixel type.
+/**
+  * \tparam dataT is the pixel type of the stream
+  */
+template<typename dataT>
+class displayPipelineT : public displayPipeline
+{
+protected:
+   std::vector<typename improc::binAccumType<dataT>::type> m_acc; ///< Working space for binning
+
+   std::vector<dataT> m_work; ///< Working space for ROI and binning output when it is not the last stage
+
+   std::vector<int16_t> m_lut; ///< The quantization lookup table
+   improc::imageStretch m_lutStretch {improc::stretchLinear}; ///< The stretch the table was made for
+
+public:
+
+   virtual int bitpix() const;
+
+   virtual size_t pixsz() const;
+
+   virtual int process( void * out,
+                        const void * in
+                      );
+
+protected:
+   ///Whether the configured precision converts this type to single precision
+   bool toFloat() const;
+
+   ///Whether the configured precision quantizes this type to 16 bits
+   bool toInt16() const;
+};
+
+template<typename dataT>
+bool displayPipelineT<dataT>::toFloat() const
+{
+   return (m_config.precision == precisionFloat && sizeof(dataT) > sizeof(float));
+}
+
+template<typename dataT>
+bool displayPipelineT<dataT>::toInt16() const
+{
+   return (m_config.precision >= precisionLinear16 && sizeof(dataT) > sizeof(int16_t));
+}
+
+template<typename dataT>
+int displayPipelineT<dataT>::bitpix() const
+{
+   if(toFloat()) return FLOAT_IMG;
+   if(toInt16()) return SHORT_IMG;
+   return milkType<milkDatatype<dataT>::value>::bitpix;
+}
+
+template<typename dataT>
+size_t displayPipelineT<dataT>::pixsz() const
+{
+   if(toFloat()) return sizeof(float);
+   if(toInt16()) return sizeof(int16_t);
+   return sizeof(dataT);
+}
+
+template<typename dataT>
+int displayPipelineT<dataT>::process( void * out,
+                                      const void * in
+                                    )
+{
+   const dataT * i = static_cast<const dataT *>(in);
+   size_t n = m_dim1*m_dim2;
+
+   bool convert = (toFloat() || toInt16());
+
+   //The ROI/binning stage writes to the output unless a conversion follows
+   dataT * o;
+   if(convert)
+   {
+      m_work.resize(n);
+      o = m_work.data();
+   }
+   else
+   {
+      o = static_cast<dataT *>(out);
+   }
+
+   const dataT * src = o; //the input to the following stages
+
+   if(m_config.bin > 1)
+   {
+      improc::imageBinROI(o, i, m_nx, m_x0, m_y0, m_w, m_h, m_config.bin, m_acc);
+   }
+   else if(m_w != m_nx || m_h != m_ny)
+   {
+      improc::imageCopyROI(o, i, m_nx, m_x0, m_y0, m_w, m_h);
+   }
+   else if(convert)
+   {
+      src = i; //convert straight from the input
+   }
+   else
+   {
+      memcpy(o, i, n*sizeof(dataT));
+   }
+
+   //Quantization is auto-ranged, so needs the statistics
+   if(m_config.stats || toInt16()) improc::imageMinMaxMean(m_stats, src, n);
+
+   if(toFloat())
+   {
+      improc::imageToFloat(static_cast<float *>(out), src, n);
+   }
+   else if(toInt16())
+   {
+      if(m_config.precision == precisionLinear16)
+      {
+         improc::imageQuantizeLinear(static_cast<int16_t *>(out), src, n, m_stats.min, m_stats.max);
+      }
+      else
+      {
+         improc::imageStretch stretch = (m_config.precision == precisionSqrt16) ? improc::stretchSqrt : improc::stretchLog;
+
+         if(m_lut.size() == 0 || stretch != m_lutStretch)
+         {
+            improc::imageQuantizeLUT(m_lut, stretch);
+            m_lutStretch = stretch;
+         }
+
+         improc::imageQuantize(static_cast<int16_t *>(out), src, n, m_stats.min, m_stats.max, m_lut);
+      }
+   }
+
+   return 0;
+}
+
+/// The display pipeline for complex streams.
+/** The configured component of the ROI is extracted first, then the remaining stages are those of the
+  * real component type.  If no other stage is active the component is extracted straight into the output.
+  *
+  * \tparam complexT is the complex pixel type of the stream
+  * \tparam realT is the type of its components
+  */
+template<typename complexT, typename realT>
+class displayPipelineComplexT : public displayPipeline
+{
+protected:
+   displayPipelineT<realT> m_real; ///< The stages after extraction, configured for the ROI
+
+   std::vector<realT> m_component; ///< Working space for the component, when other stages follow
+
+public:
+
+   virtual int configure( size_t nx,
+                          size_t ny,
+                          const displayConfig & config
+                        );
+
+   virtual int bitpix() const;
+
+   virtual size_t pixsz() const;
+
+   virtual int process( void * out,
+                        const void * in
+                      );
+};
+
+template<typename complexT, typename realT>
+int displayPipelineComplexT<complexT, realT>::configure( size_t nx,
+                                                         size_t ny,
+                                                         const displayConfig & config
+                                                       )
+{
+   if(displayPipeline::configure(nx, ny, config) < 0) return -1;
+
+   //The real stages see the extracted ROI as their full input
+   displayConfig rconfig = m_config;
+   rconfig.roiX = 0;
+   rconfig.roiY = 0;
+   rconfig.roiW = 0;
+   rconfig.roiH = 0;
+
+   return m_real.configure(m_w, m_h, rconfig);
+}
+
+template<typename complexT, typename realT>
+int displayPipelineComplexT<complexT, realT>::bitpix() const
+{
+   return m_real.bitpix();
+}
+
+template<typename complexT, typename realT>
+size_t displayPipelineComplexT<complexT, realT>::pixsz() const
+{
+   return m_real.pixsz();
+}
+
+template<typename complexT, typename realT>
+int displayPipelineComplexT<complexT, realT>::process( void * out,
+                                                       const void * in
+                                                     )
+{
+   const complexT * i = static_cast<const complexT *>(in);
+
+   bool direct = (m_config.bin == 1 && m_real.pixsz() == sizeof(realT) && !m_config.stats);
+
+   realT * o;
+   if(direct)
+   {
+      o = static_cast<realT *>(out);
+   }
+   else
+   {
+      m_component.resize(m_w*m_h);
+      o = m_component.data();
+   }
+
+   if(m_w == m_nx)
+   {
+      improc::imageComplexComponent(o, i + m_y0*m_nx, m_w*m_h, m_config.component);
+   }
+   else
+   {
+      for(size_t j = 0; j < m_h; ++j)
+      {
+         improc::imageComplexComponent(o + j*m_w, i + (m_y0+j)*m_nx + m_x0, m_w, m_config.component);
+      }
+   }
+
+   if(direct) return 0;
+
+   int rv = m_real.process(out, o);
+
+   m_stats = m_real.stats();
+
+   return rv;
+}
+
+/// The display pipeline for streams remapped into a 2D layout through a \ref remapTable.
+/** The stream is gathered into a float image (double for double streams), with NaN where unused, and the remaining
+  * stages are those of that type, with the ROI taken in the remapped image.  If no other stage is active the gather
+  * writes straight into the output.  Since the whole stream is read, \ref roiX etc. give the whole stream.
+  *
+  * \tparam dataT is the pixel type of the stream
+  */
+template<typename dataT>
+class displayPipelineRemapT : public displayPipeline
+{
+public:
+   ///The type of the remapped image, which must hold NaN
+   typedef typename std::conditional<std::is_same<dataT, double>::value, double, float>::type outT;
+
+protected:
+   std::shared_ptr<const remapTable> m_table; ///< The table
+
+   displayPipelineT<outT> m_out; ///< The stages after remapping
+
+   std::vector<outT> m_remapped; ///< Working space for the remapped image, when other stages follow
+
+public:
+
+   explicit displayPipelineRemapT( const std::shared_ptr<const remapTable> & table /**< [in] the table*/);
+
+   virtual int configure( size_t nx,
+                          size_t ny,
+                          const displayConfig & config
+                        );
+
+   virtual int bitpix() const;
+
+   virtual size_t pixsz() const;
+
+   virtual int process( void * out,
+                        const void * in
+                      );
+
+protected:
+   ///Whether the gather is the only stage
+   bool direct() const;
+};
+
+template<typename dataT>
+displayPipelineRemapT<dataT>::displayPipelineRemapT( const std::shared_ptr<const remapTable> & table ) : m_table(table)
+{
+}
+
+template<typename dataT>
+int displayPipelineRemapT<dataT>::configure( size_t nx,
+                                             size_t ny,
+                                             const displayConfig & config
+                                           )
+{
+   if(m_table->size > nx*ny)
+   {
+      std::cerr << "displayPipeline: remap table needs " << m_table->size << " pixels, stream has " << nx*ny << "\n";
+      return -1;
+   }
+
+   m_nx = nx;
+   m_ny = ny;
+
+   //The ROI is applied in the remapped image, so the whole stream is read
+   m_x0 = 0;
+   m_y0 = 0;
+   m_w = nx;
+   m_h = ny;
+
+   if(m_out.configure(m_table->width, m_table->height, config) < 0) return -1;
+
+   m_config = m_out.config();
+   m_dim1 = m_out.dim1();
+   m_dim2 = m_out.dim2();
+
+   return 0;
+}
+
+template<typename dataT>
+int displayPipelineRemapT<dataT>::bitpix() const
+{
+   return m_out.bitpix();
+}
+
+template<typename dataT>
+size_t displayPipelineRemapT<dataT>::pixsz() const
+{
+   return m_out.pixsz();
+}
+
+template<typename dataT>
+bool displayPipelineRemapT<dataT>::direct() const
+{
+   return (m_dim1 == m_table->width && m_dim2 == m_table->height && m_out.pixsz() == sizeof(outT) && !m_config.stats);
+}
+
+template<typename dataT>
+int displayPipelineRemapT<dataT>::process( void * out,
+                                           const void * in
+                                         )
+{
+   size_t n = m_table->width*m_table->height;
+
+   if(direct())
+   {
+      improc::imageRemapGather(static_cast<outT *>(out), static_cast<const dataT *>(in), m_table->idx.data(), m_table->use.data(), n);
+      return 0;
+   }
+
+   m_remapped.resize(n);
+   improc::imageRemapGather(m_remapped.data(), static_cast<const dataT *>(in), m_table->idx.data(), m_table->use.data(), n);
+
+   int rv = m_out.process(out, m_remapped.data());
+
+   m_stats = m_out.stats();
+
+   return rv;
+}
+
+/// Functor for \ref milkTypeDispatch which creates the pipeline for a type.
+template<typename dataT>
+struct makeDisplayPipelineT
+{
+   static displayPipeline * call( const std::shared_ptr<const remapTable> & remap )
+   {
+      if(remap) return new displayPipelineRemapT<dataT>(remap);
+
+      return new displayPipelineT<dataT>;
+   }
+};
+
+/// Create the display pipeline for an ImageStreamIO datatype
+/**
+  * \returns the pipeline
+  * \returns nullptr if the datatype is not supported, or remapping is requested for a complex datatype
+  */
+inline
+std::unique_ptr<displayPipeline> makeDisplayPipeline( uint8_t datatype,                                   ///< [in] the ImageStreamIO _DATATYPE_ constant
+                                                      const std::shared_ptr<const remapTable> & remap = nullptr ///< [in] [optional] a table to remap the stream through
+                                                    )
+{
+   switch(datatype)
+   {
+      case _DATATYPE_COMPLEX_FLOAT:
+         if(remap) return nullptr;
+         return std::unique_ptr<displayPipeline>(new displayPipelineComplexT<complex_float, float>);
+      case _DATATYPE_COMPLEX_DOUBLE:
+         if(remap) return nullptr;
+         return std::unique_ptr<displayPipeline>(new displayPipelineComplexT<complex_double, double>);
+      default:
+         return std::unique_ptr<displayPipeline>(milkTypeDispatch<makeDisplayPipelineT>(datatype, remap));
+   }
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_displayPipeline_hpp
@@ -0,0 +1,392 @@
+/** \file displayPipelinePSD.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief A display pipeline showing the spatial power spectrum of each image
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_displayPipelinePSD_hpp
+#define milk_displayPipelinePSD_hpp
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <fftw3.h>
+
+#include "displayPipeline.hpp"
+
+/// The number of geometries for which psdFFT keeps plans
+#ifndef PSDFFT_MAX_PLANS
+#define PSDFFT_MAX_PLANS (8)
+#endif
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// A single precision real-to-complex 2D FFT, with its plans and aligned buffers.
+/** Plans are kept for the last PSDFFT_MAX_PLANS geometries, so going back to an ROI, e.g. as the QoS ladder steps down
+  * and up again, costs nothing.  Only the first plan is made with FFTW_MEASURE.  Later geometries are planned on the
+  * display thread while images wait, so they use FFTW_ESTIMATE, which takes microseconds rather than seconds.
+  */
+class psdFFT
+{
+protected:
+   ///A plan with its buffers
+   struct entry
+   {
+      size_t w {0}; ///< The first (fastest) dimension
+      size_t h {0}; ///< The second dimension
+
+      float * in {nullptr};          ///< The input, w x h
+      fftwf_complex * out {nullptr}; ///< The output, (w/2+1) x h
+      fftwf_plan plan {nullptr};     ///< The plan
+   };
+
+   std::vector<entry> m_plans; ///< The plans, least recently used first.  The current one is last.
+
+   bool m_measured {false}; ///< Whether a plan has been measured
+
+public:
+
+   ~psdFFT()
+   {
+      free();
+   }
+
+   ///Plan for a geometry, if it has changed.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int plan( size_t w, ///< [in] the first dimension
+             size_t h  ///< [in] the second dimension
+           )
+   {
+      for(size_t n = 0; n < m_plans.size(); ++n)
+      {
+         if(m_plans[n].w != w || m_plans[n].h != h) continue;
+
+         entry e = m_plans[n];
+         m_plans.erase(m_plans.begin() + n);
+         m_plans.push_back(e);
+
+         return 0;
+      }
+
+      entry e;
+      e.w = w;
+      e.h = h;
+      e.in = static_cast<float *>(fftwf_malloc(w*h*sizeof(float)));
+      e.out = static_cast<fftwf_complex *>(fftwf_malloc((w/2+1)*h*sizeof(fftwf_complex)));
+
+      //FFTW takes the slowest dimension first
+      unsigned flags = (m_measured ? FFTW_ESTIMATE : FFTW_MEASURE) | FFTW_DESTROY_INPUT;
+      if(e.in && e.out) e.plan = fftwf_plan_dft_r2c_2d(h, w, e.in, e.out, flags);
+
+      if(e.plan == nullptr)
+      {
+         release(e);
+         return -1;
+      }
+
+      m_measured = true;
+
+      if(m_plans.size() >= PSDFFT_MAX_PLANS)
+      {
+         release(m_plans[0]);
+         m_plans.erase(m_plans.begin());
+      }
+
+      m_plans.push_back(e);
+
+      return 0;
+   }
+
+   ///Release the plans and buffers.
+   void free()
+   {
+      for(size_t n = 0; n < m_plans.size(); ++n) release(m_plans[n]);
+
+      m_plans.clear();
+   }
+
+   ///Get the input buffer.
+   float * in()
+   {
+      return m_plans.back().in;
+   }
+
+   ///Get the output buffer.
+   const fftwf_complex * out() const
+   {
+      return m_plans.back().out;
+   }
+
+   ///Transform the input buffer.
+   void execute()
+   {
+      fftwf_execute(m_plans.back().plan);
+   }
+
+protected:
+   ///Release a plan and its buffers.
+   static void release( entry & e /**< [in] the plan*/)
+   {
+      if(e.plan) fftwf_destroy_plan(e.plan);
+      if(e.in) fftwf_free(e.in);
+      if(e.out) fftwf_free(e.out);
+
+      e.plan = nullptr;
+      e.in = nullptr;
+      e.out = nullptr;
+   }
+};
+
+/// The display pipeline for the spatial power spectrum of a stream.
+/** The ROI is windowed (Hann) as it is converted to single precision, transformed, and the power of the full
+  * spectrum, with zero frequency at the center (fftshift), is formed from the half spectrum in one pass, along with
+  * the average and log.  The remaining stages, binning and precision, are then applied to the spectrum.  If there are
+  * none the spectrum is written straight into the output.
+  *
+  * \tparam dataT is the pixel type of the stream
+  */
+template<typename dataT>
+class displayPipelinePSDT : public displayPipeline
+{
+protected:
+   psdFFT m_fft; ///< The transform
+
+   std::vector<float> m_winX; ///< The window along the first dimension
+   std::vector<float> m_winY; ///< The window along the second dimension
+   float m_norm {1};          ///< Normalizes the power by the window
+
+   std::vector<float> m_avg; ///< The averaged power, when averaging
+   size_t m_navg {0};        ///< The number of images in the average, up to psdAverage
+
+   displayPipelineT<float> m_out; ///< The stages after the spectrum
+
+   std::vector<float> m_spectrum; ///< Working space for the spectrum, when other stages follow
+
+public:
+
+   virtual int configure( size_t nx,
+                          size_t ny,
+                          const displayConfig & config
+                        );
+
+   virtual int bitpix() const;
+
+   virtual size_t pixsz() const;
+
+   virtual int process( void * out,
+                        const void * in
+                      );
+
+protected:
+   ///Whether the spectrum is the only stage
+   bool direct() const;
+};
+
+template<typename dataT>
+int displayPipelinePSDT<dataT>::configure( size_t nx,
+                                           size_t ny,
+                                           const displayConfig & config
+                                         )
+{
+   if(displayPipeline::configure(nx, ny, config) < 0) return -1;
+
+   if(m_fft.plan(m_w, m_h) < 0)
+   {
+      std::cerr << "displayPipeline: could not plan a " << m_w << " x " << m_h << " FFT\n";
+      return -1;
+   }
+
+   m_winX.resize(m_w);
+   m_winY.resize(m_h);
+   double sx = 0, sy = 0;
+   for(size_t i = 0; i < m_w; ++i)
+   {
+      m_winX[i] = 0.5 - 0.5*cos(2*M_PI*(i+0.5)/m_w);
+      sx += m_winX[i]*m_winX[i];
+   }
+   for(size_t j = 0; j < m_h; ++j)
+   {
+      m_winY[j] = 0.5 - 0.5*cos(2*M_PI*(j+0.5)/m_h);
+      sy += m_winY[j]*m_winY[j];
+   }
+   m_norm = 1.0/(sx*sy);
+
+   m_avg.assign(m_w*m_h, 0);
+   m_navg = 0;
+
+   //The later stages see the whole spectrum as their input
+   displayConfig sconfig = m_config;
+   sconfig.roiX = 0;
+   sconfig.roiY = 0;
+   sconfig.roiW = 0;
+   sconfig.roiH = 0;
+
+   if(m_out.configure(m_w, m_h, sconfig) < 0) return -1;
+
+   m_dim1 = m_out.dim1();
+   m_dim2 = m_out.dim2();
+
+   return 0;
+}
+
+template<typename dataT>
+int displayPipelinePSDT<dataT>::bitpix() const
+{
+   return m_out.bitpix();
+}
+
+template<typename dataT>
+size_t displayPipelinePSDT<dataT>::pixsz() const
+{
+   return m_out.pixsz();
+}
+
+template<typename dataT>
+bool displayPipelinePSDT<dataT>::direct() const
+{
+   return (m_config.bin == 1 && m_out.pixsz() == sizeof(float) && !m_config.stats);
+}
+
+template<typename dataT>
+int displayPipelinePSDT<dataT>::process( void * out,
+                                         const void * in
+                                       )
+{
+   const dataT * im = static_cast<const dataT *>(in);
+
+   //Pre pass: ROI, conversion and window
+   float * f = m_fft.in();
+   for(size_t j = 0; j < m_h; ++j)
+   {
+      const dataT * row = im + (m_y0 + j)*m_nx + m_x0;
+      float wy = m_winY[j];
+
+      for(size_t i = 0; i < m_w; ++i) f[j*m_w + i] = static_cast<float>(row[i])*m_winX[i]*wy;
+   }
+
+   m_fft.execute();
+
+   float * o;
+   if(direct())
+   {
+      o = static_cast<float *>(out);
+   }
+   else
+   {
+      m_spectrum.resize(m_w*m_h);
+      o = m_spectrum.data();
+   }
+
+   //Exponential average, starting as a plain average so the first images count fully
+   size_t navg = (m_config.psdAverage < 1) ? 1 : m_config.psdAverage;
+   if(m_navg < navg) ++m_navg;
+   float a = 1.0f/m_navg;
+
+   //Post pass: power, mirror, fftshift, average and log.  Output (ox,oy) shows frequency (ox-w/2, oy-h/2).
+   const fftwf_complex * X = m_fft.out();
+   size_t hw = m_w/2 + 1;
+   size_t sw = m_w/2;
+   size_t sh = m_h/2;
+
+   for(size_t oy = 0; oy < m_h; ++oy)
+   {
+      size_t ky = (oy + m_h - sh) % m_h;
+      size_t kym = (m_h - ky) % m_h; //the row holding the conjugate of the negative frequencies
+
+      const fftwf_complex * pos = X + ky*hw;
+      const fftwf_complex * neg = X + kym*hw;
+
+      float * avg = m_avg.data() + oy*m_w;
+      float * orow = o + oy*m_w;
+
+      for(size_t ox = 0; ox < m_w; ++ox)
+      {
+         size_t kx = (ox + m_w - sw) % m_w;
+
+         float re, im;
+         if(kx < hw)
+         {
+            re = pos[kx][0];
+            im = pos[kx][1];
+         }
+         else
+         {
+            re = neg[m_w - kx][0];
+            im = neg[m_w - kx][1];
+         }
+
+         float p = (re*re + im*im)*m_norm;
+
+         avg[ox] += a*(p - avg[ox]);
+
+         orow[ox] = m_config.psdLog ? log10f(avg[ox]) : avg[ox];
+      }
+   }
+
+   if(direct()) return 0;
+
+   int rv = m_out.process(out, o);
+
+   m_stats = m_out.stats();
+
+   return rv;
+}
+
+/// Functor for \ref milkTypeDispatch which creates the power spectrum pipeline for a type.
+template<typename dataT>
+struct makeDisplayPipelinePSDT
+{
+   static displayPipeline * call()
+   {
+      return new displayPipelinePSDT<dataT>;
+   }
+};
+
+/// Create the power spectrum display pipeline for an ImageStreamIO datatype
+/**
+  * \returns the pipeline
+  * \returns nullptr if the datatype is not supported, which includes complex types
+  */
+inline
+std::unique_ptr<displayPipeline> makeDisplayPipelinePSD( uint8_t datatype /**< [in] the ImageStreamIO _DATATYPE_ constant*/)
+{
+   return std::unique_ptr<displayPipeline>(milkTypeDispatch<makeDisplayPipelinePSDT>(datatype));
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_displayPipelinePSD_hpp
@@ -0,0 +1,375 @@
+/** \file eventGate.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Picks out the images of a stream with pixels above a threshold
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_eventGate_hpp
+#define milk_eventGate_hpp
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "streamFollower.hpp"
+#include "../improc/fitsMmapCube.hpp"
+#include "../improc/imageKernels.hpp"
+
+#ifndef EVENTGATE_MAX_QUEUE
+/// The most images waiting to be displayed.  Beyond this the oldest are dropped.
+#define EVENTGATE_MAX_QUEUE (64)
+#endif
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// Functor for \ref milkTypeDispatch which counts the pixels of an image above a threshold.
+template<typename dataT>
+struct eventGateCountT
+{
+   static size_t call( const void * im,      ///< [in] the image
+                       const uint8_t * mask, ///< [in] the mask, or nullptr for the whole image
+                       size_t n,             ///< [in] the number of pixels
+                       double thresh         ///< [in] the threshold
+                     )
+   {
+      const dataT * d = static_cast<const dataT *>(im);
+
+      //Compare in the native type, so the scan vectorizes.  For integers v > t is the same as v > floor(t).
+      if(thresh >= static_cast<double>(std::numeric_limits<dataT>::max())) return 0;
+
+      if(thresh < static_cast<double>(std::numeric_limits<dataT>::lowest()))
+      {
+         if(mask == nullptr) return n;
+
+         size_t count = 0;
+         for(size_t i = 0; i < n; ++i) count += mask[i];
+         return count;
+      }
+
+      dataT t = std::numeric_limits<dataT>::is_integer ? static_cast<dataT>(floor(thresh)) : static_cast<dataT>(thresh);
+
+      if(mask) return improc::imageCountAbove(d, mask, n, t);
+
+      return improc::imageCountAbove(d, n, t);
+   }
+};
+
+/// Functor for \ref milkTypeDispatch which converts a FITS image to a mask, 1 where it is non-zero.
+template<typename dataT>
+struct eventGateMaskT
+{
+   static int call( std::vector<uint8_t> & mask,
+                    const void * im,
+                    size_t n
+                  )
+   {
+      const dataT * d = static_cast<const dataT *>(im);
+
+      mask.resize(n);
+      for(size_t i = 0; i < n; ++i) mask[i] = (d[i] != 0 && d[i] == d[i]); //NaN is excluded
+
+      return 0;
+   }
+};
+
+/// Scans every image of a stream, and queues those with enough pixels above a threshold for display.
+/** A \ref streamFollower thread scans each image at the full stream rate.  When an image has at least the required
+  * number of pixels above the threshold (within the mask, if one is loaded) it is an event: it is queued, along with
+  * up to \ref m_pre images before it and \ref m_post images after it.  The display takes the queued images with
+  * \ref next, so it need only show the live stream at a low rate until something happens.
+  *
+  * The most recent images are kept in a small ring for the pre-event window, so between events the thread only
+  * copies and scans.
+  */
+class eventGate : public streamFollower
+{
+protected:
+   double m_threshold {0}; ///< Pixels above this are counted
+   size_t m_minCount {1};  ///< The number of pixels above the threshold which makes an event
+   size_t m_pre {0};       ///< The number of images before an event to show
+   size_t m_post {0};      ///< The number of images after an event to show
+
+   std::vector<uint8_t> m_mask; ///< The pixels to scan, empty for all
+   size_t m_maskW {0};          ///< The first dimension of the mask
+   size_t m_maskH {0};          ///< The second dimension of the mask
+
+   uint8_t m_datatype {0}; ///< The stream datatype
+   size_t m_npix {0};      ///< The number of pixels in an image
+
+   std::vector<char> m_ring;     ///< The last m_pre+1 images
+   std::vector<uint64_t> m_cnt0; ///< The cnt0 of each image in the ring
+   size_t m_next {0};            ///< The ring slot the next image goes in
+   size_t m_count {0};           ///< The number of valid images in the ring
+
+   uint64_t m_queuedThrough {0}; ///< One more than the cnt0 of the last image queued
+   size_t m_postLeft {0};        ///< Images still to queue after the last event
+
+   std::mutex m_mutex;                        ///< Protects the queue
+   std::deque<std::vector<char>> m_queue;     ///< Images waiting to be displayed
+   std::vector<std::vector<char>> m_spare;    ///< Buffers to reuse for the queue
+
+   std::atomic<uint64_t> m_events {0}; ///< The number of events found
+
+public:
+
+   ~eventGate();
+
+   ///Set the event criteria and window.
+   void setup( double threshold, ///< [in] pixels above this are counted
+               size_t minCount,  ///< [in] the number of pixels above the threshold which makes an event, at least 1
+               size_t pre,       ///< [in] the number of images before an event to show
+               size_t post       ///< [in] the number of images after an event to show
+             );
+
+   ///Load a mask of the pixels to scan from a FITS file, non-zero for pixels to scan.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int mask( const std::string & fname /**< [in] the FITS file*/);
+
+   ///Start scanning a stream.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int start( IMAGE & image, ///< [in] the open stream
+              int semNum     ///< [in] the semaphore to wait on, which should not be used by another reader
+            );
+
+   ///Take the next image to display, if any.
+   /**
+     * \retval true if im holds an image
+     * \retval false if nothing is waiting
+     */
+   bool next( std::vector<char> & im /**< [out] the image, in the stream's type and size*/);
+
+   ///Check whether there are images waiting to be displayed.
+   bool waiting();
+
+   ///Get the number of events found.
+   uint64_t events() const;
+
+protected:
+   ///Queue an image for display.
+   void enqueue( const void * im );
+
+   virtual void newImage( const void * im,
+                          uint64_t cnt0
+                        );
+};
+
+inline
+eventGate::~eventGate()
+{
+   stop();
+}
+
+inline
+void eventGate::setup( double threshold,
+                       size_t minCount,
+                       size_t pre,
+                       size_t post
+                     )
+{
+   m_threshold = threshold;
+   m_minCount = (minCount < 1) ? 1 : minCount;
+   m_pre = pre;
+   m_post = post;
+}
+
+inline
+int eventGate::mask( const std::string & fname )
+{
+   improc::fitsMmapCube map;
+   if(map.open(fname) < 0) return -1;
+
+   uint8_t datatype = milkDatatypeFromBitpix(map.bitpix());
+   if(datatype == 0)
+   {
+      std::cerr << "eventGate: BITPIX of " << fname << " is not supported\n";
+      return -1;
+   }
+
+   m_maskW = map.dim1();
+   m_maskH = map.dim2();
+
+   std::vector<char> native(m_maskW*m_maskH*map.pixsz());
+   map.image(native.data(), 0);
+
+   milkTypeDispatch<eventGateMaskT>(datatype, m_mask, native.data(), m_maskW*m_maskH);
+
+   return 0;
+}
+
+inline
+int eventGate::start( IMAGE & image,
+                      int semNum
+                    )
+{
+   stop();
+
+   m_datatype = image.md[0].datatype;
+   m_npix = image.md[0].size[0]*image.md[0].size[1];
+
+   if(milkDatatypeFromBitpix(milkBitpix(m_datatype)) != m_datatype || milkTypeSize(m_datatype) == 0)
+   {
+      std::cerr << "eventGate: datatype " << (int) m_datatype << " can not be gated\n";
+      return -1;
+   }
+
+   if(m_mask.size() > 0 && (m_maskW != image.md[0].size[0] || m_maskH != image.md[0].size[1]))
+   {
+      std::cerr << "eventGate: the mask is " << m_maskW << " x " << m_maskH << " but the stream is " << image.md[0].size[0] << " x " << image.md[0].size[1] << "\n";
+      return -1;
+   }
+
+   size_t bytes = m_npix*milkTypeSize(m_datatype);
+
+   m_ring.resize((m_pre+1)*bytes);
+   m_cnt0.resize(m_pre+1);
+   m_next = 0;
+   m_count = 0;
+   m_queuedThrough = 0;
+   m_postLeft = 0;
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_queue.clear();
+
+   return follow(image, semNum);
+}
+
+inline
+bool eventGate::next( std::vector<char> & im )
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(m_queue.size() == 0) return false;
+
+   //Hand back the caller's old buffer for reuse
+   if(im.size() > 0) m_spare.push_back(std::move(im));
+
+   im = std::move(m_queue.front());
+   m_queue.pop_front();
+
+   return true;
+}
+
+inline
+bool eventGate::waiting()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   return (m_queue.size() > 0);
+}
+
+inline
+uint64_t eventGate::events() const
+{
+   return m_events;
+}
+
+inline
+void eventGate::enqueue( const void * im )
+{
+   size_t bytes = m_npix*milkTypeSize(m_datatype);
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   std::vector<char> buf;
+   if(m_queue.size() >= EVENTGATE_MAX_QUEUE)
+   {
+      buf = std::move(m_queue.front());
+      m_queue.pop_front();
+   }
+   else if(m_spare.size() > 0)
+   {
+      buf = std::move(m_spare.back());
+      m_spare.pop_back();
+   }
+
+   buf.resize(bytes);
+   memcpy(buf.data(), im, bytes);
+
+   m_queue.push_back(std::move(buf));
+}
+
+inline
+void eventGate::newImage( const void * im,
+                          uint64_t cnt0
+                        )
+{
+   size_t bytes = m_npix*milkTypeSize(m_datatype);
+
+   //Keep the image for the next event's pre-window
+   memcpy(m_ring.data() + m_next*bytes, im, bytes);
+   m_cnt0[m_next] = cnt0;
+   m_next = (m_next + 1) % (m_pre + 1);
+   if(m_count < m_pre + 1) ++m_count;
+
+   const uint8_t * mask = (m_mask.size() > 0) ? m_mask.data() : nullptr;
+   size_t above = milkTypeDispatch<eventGateCountT>(m_datatype, im, mask, m_npix, m_threshold);
+
+   if(above >= m_minCount)
+   {
+      ++m_events;
+
+      //The pre-window, oldest first, and this image, skipping any already queued
+      for(size_t k = m_count; k > 0; --k)
+      {
+         size_t slot = (m_next + m_pre + 1 - k) % (m_pre + 1);
+         if(m_cnt0[slot] + 1 <= m_queuedThrough) continue;
+
+         enqueue(m_ring.data() + slot*bytes);
+         m_queuedThrough = m_cnt0[slot] + 1;
+      }
+
+      m_postLeft = m_post;
+   }
+   else if(m_postLeft > 0)
+   {
+      enqueue(im);
+      m_queuedThrough = cnt0 + 1;
+      --m_postLeft;
+   }
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_eventGate_hpp
@@ -0,0 +1,484 @@
+/** \file fitsRecorder.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Records a stream to FITS cubes, writing from a separate thread
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_fitsRecorder_hpp
+#define milk_fitsRecorder_hpp
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "streamFollower.hpp"
+#include "../improc/fitsMemHeader.hpp"
+
+/// The size of each of the two write buffers, in bytes
+#ifndef FITSRECORDER_BUFFER_SIZE
+#define FITSRECORDER_BUFFER_SIZE (33554432)
+#endif
+
+/// The alignment of the write buffers, in bytes
+#ifndef FITSRECORDER_ALIGNMENT
+#define FITSRECORDER_ALIGNMENT (4096)
+#endif
+
+/// The time, in seconds, to wait before trying again to open a file which could not be opened
+#ifndef FITSRECORDER_RETRY_TIME
+#define FITSRECORDER_RETRY_TIME (5.0)
+#endif
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// Records every image, or every Nth image, of a stream to a sequence of FITS cubes.
+/** A \ref streamFollower thread converts each image to FITS byte order into one of two large aligned buffers.  When
+  * a buffer is full it is handed to a writer thread, which writes it with a single call while the other buffer fills,
+  * so the stream is followed at the full rate as long as the disk keeps up.  If it does not, the follower waits for
+  * the writer, and catches up from the circular buffer where it can.  The display is not involved either way.
+  *
+  * Files are named base_NNNN.fits, skipping numbers already taken so that earlier recordings are never overwritten.
+  * A new file is started when the next image would take the current one past the size limit.  Each header is written
+  * with NAXIS3 = 0 in front of the data, then rewritten in place with the number of images when the file is closed.
+  *
+  * If a file can not be opened, e.g. the directory is missing, the error is reported once and images are dropped
+  * until the next try, FITSRECORDER_RETRY_TIME seconds later.
+  */
+class fitsRecorder : public streamFollower
+{
+protected:
+   std::string m_base; ///< The base of the file names
+   size_t m_decimate {1}; ///< Record every this many images
+   size_t m_maxBytes {0}; ///< The size limit of each file, 0 for none
+
+   improc::fitsMemHeader m_extra; ///< Cards added to each header
+   improc::fitsMemHeader m_head;  ///< The header of the current file
+
+   int m_bitpix {0};      ///< The cfitsio image type of the images
+   size_t m_pixels {0};   ///< The number of pixels in an image
+
+   //Follower state
+   size_t m_count {0};      ///< Images since the last recorded one
+   int m_fileNo {0};        ///< The number of the current file
+   int m_fd {-1};           ///< The current file, -1 if none
+   size_t m_fileBytes {0};  ///< Bytes queued for the current file
+   size_t m_fileFrames {0}; ///< Images in the current file
+
+   bool m_openFailed {false}; ///< Whether the last attempt to open a file failed, and has been reported
+   std::chrono::steady_clock::time_point m_retryTime; ///< When to next try to open a file, after a failure
+
+   char * m_bufs[2] {nullptr, nullptr}; ///< The double buffers
+   size_t m_bufSize {0};    ///< The size of each buffer
+   int m_fill {0};          ///< The buffer being filled
+   size_t m_used {0};       ///< Bytes used in the buffer being filled
+
+   ///A buffer handed to the writer
+   struct writeJob
+   {
+      int buf {-1};             ///< The buffer to write, -1 for none
+      size_t bytes {0};         ///< The number of bytes to write
+      int fd {-1};              ///< The file to write to
+      bool close {false};       ///< Whether to finish and close the file after writing
+      size_t dataBytes {0};     ///< The size of the data in the file, for padding
+      std::string header;       ///< The final header, for closing
+   };
+
+   //Writer state, shared
+   std::mutex m_mutex;
+   std::condition_variable m_cond;
+   writeJob m_job;           ///< The job waiting for the writer
+   bool m_writing {false};   ///< Whether the writer is busy
+   bool m_writerStop {false}; ///< Request for the writer to exit
+   std::thread m_writer;     ///< The writer thread
+
+public:
+
+   ~fitsRecorder();
+
+   ///Set up the recorder.  Does not start recording.
+   void setup( const std::string & base, ///< [in] the base of the file names.  Recording is disabled if empty.
+               size_t decimate,          ///< [in] record every this many images, >= 1
+               size_t maxBytes           ///< [in] the size limit of each file, 0 for none
+             );
+
+   ///Get the base of the file names, which is empty if recording is disabled.
+   const std::string & base() const;
+
+   ///Start recording a stream.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int start( IMAGE & image,                      ///< [in] the open stream
+              int semNum,                         ///< [in] the semaphore to wait on, which should not be used by another reader
+              const improc::fitsMemHeader & extra ///< [in] cards to add to each header
+            );
+
+protected:
+   ///Allocate the buffers and start the writer.
+   virtual int begin();
+
+   ///Convert an image into the write buffer.
+   virtual void newImage( const void * im,
+                          uint64_t cnt0
+                        );
+
+   ///Close the last file and stop the writer.
+   virtual void end();
+
+   ///Open the next file, queueing its header.
+   int openFile();
+
+   ///Queue the current file to be closed.
+   void closeFile();
+
+   ///Hand the buffer being filled to the writer, waiting for the other one to be written.
+   void handoff( bool close /**< [in] whether to close the current file after this buffer*/);
+
+   ///The writer thread
+   void writer();
+
+   ///Write a whole buffer, retrying short writes.
+   static bool writeAll( int fd,
+                         const char * buf,
+                         size_t bytes
+                       );
+};
+
+inline
+fitsRecorder::~fitsRecorder()
+{
+   stop();
+}
+
+inline
+void fitsRecorder::setup( const std::string & base,
+                          size_t decimate,
+                          size_t maxBytes
+                        )
+{
+   m_base = base;
+   m_decimate = (decimate < 1) ? 1 : decimate;
+   m_maxBytes = maxBytes;
+}
+
+inline
+const std::string & fitsRecorder::base() const
+{
+   return m_base;
+}
+
+inline
+int fitsRecorder::start( IMAGE & image,
+                         int semNum,
+                         const improc::fitsMemHeader & extra
+                       )
+{
+   stop();
+
+   if(m_base == "") return 0;
+
+   m_extra = extra;
+
+   //Complex images are written as interleaved real and imaginary parts
+   m_bitpix = milkBitpix(image.md[0].datatype);
+   m_pixels = image.md[0].size[0]*image.md[0].size[1]*milkTypeSize(image.md[0].datatype)/(abs(m_bitpix)/8);
+
+   if(m_head.image(m_bitpix, m_pixels/image.md[0].size[1], image.md[0].size[1], 2) < 0)
+   {
+      std::cerr << "fitsRecorder: datatype " << (int) image.md[0].datatype << " can not be written to FITS\n";
+      return -1;
+   }
+
+   return follow(image, semNum);
+}
+
+inline
+int fitsRecorder::begin()
+{
+   m_bufSize = FITSRECORDER_BUFFER_SIZE;
+   if(m_bufSize < m_head.size() + m_frameBytes + fitsBlockSize) m_bufSize = m_head.size() + m_frameBytes + fitsBlockSize;
+   m_bufSize = ((m_bufSize + FITSRECORDER_ALIGNMENT - 1)/FITSRECORDER_ALIGNMENT)*FITSRECORDER_ALIGNMENT;
+
+   for(int i = 0; i < 2; ++i)
+   {
+      void * b;
+      if(posix_memalign(&b, FITSRECORDER_ALIGNMENT, m_bufSize) != 0)
+      {
+         std::cerr << "fitsRecorder: could not allocate buffers\n";
+         free(m_bufs[0]);
+         m_bufs[0] = nullptr;
+         return -1;
+      }
+      m_bufs[i] = static_cast<char *>(b);
+   }
+
+   m_fill = 0;
+   m_used = 0;
+   m_count = 0;
+   m_fd = -1;
+   m_openFailed = false;
+
+   m_job = writeJob();
+   m_writing = false;
+   m_writerStop = false;
+   m_writer = std::thread(&fitsRecorder::writer, this);
+
+   return 0;
+}
+
+inline
+void fitsRecorder::end()
+{
+   if(m_fd >= 0) closeFile();
+
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cond.wait(lock, [this]{ return m_job.buf < 0 && !m_writing; });
+      m_writerStop = true;
+   }
+   m_cond.notify_all();
+
+   m_writer.join();
+
+   free(m_bufs[0]);
+   free(m_bufs[1]);
+   m_bufs[0] = m_bufs[1] = nullptr;
+}
+
+inline
+void fitsRecorder::newImage( const void * im,
+                             uint64_t cnt0
+                           )
+{
+   static_cast<void>(cnt0);
+
+   if(++m_count < m_decimate) return;
+   m_count = 0;
+
+   //Roll to a new file at the size limit, but always put at least one image in a file
+   if(m_fd >= 0 && m_maxBytes > 0 && m_fileFrames > 0 && m_head.size() + m_fileBytes + m_frameBytes > m_maxBytes) closeFile();
+
+   if(m_fd < 0)
+   {
+      if(m_openFailed && std::chrono::steady_clock::now() < m_retryTime) return;
+      if(openFile() < 0) return;
+   }
+
+   if(m_used + m_frameBytes > m_bufSize) handoff(false);
+
+   improc::fitsBigEndianCopy(m_bufs[m_fill] + m_used, im, m_pixels, m_bitpix);
+   m_used += m_frameBytes;
+
+   m_fileBytes += m_frameBytes;
+   ++m_fileFrames;
+}
+
+inline
+int fitsRecorder::openFile()
+{
+   char fname[1024];
+
+   //Files of an earlier recording with the same base are kept, and numbering continues past them
+   while(1)
+   {
+      snprintf(fname, sizeof(fname), "%s_%04d.fits", m_base.c_str(), m_fileNo);
+      m_fd = ::open(fname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+      if(m_fd >= 0 || errno != EEXIST) break;
+
+      ++m_fileNo;
+   }
+
+   if(m_fd < 0)
+   {
+      //Reported once, rather than for every image
+      if(!m_openFailed)
+      {
+         std::cerr << "fitsRecorder: could not open " << fname << ": " << strerror(errno) << ".  Retrying every ";
+         std::cerr << FITSRECORDER_RETRY_TIME << " s.\n";
+      }
+
+      m_openFailed = true;
+      m_retryTime = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(FITSRECORDER_RETRY_TIME));
+      return -1;
+   }
+
+   if(m_openFailed)
+   {
+      std::cerr << "fitsRecorder: recording resumed in " << fname << "\n";
+      m_openFailed = false;
+   }
+
+   ++m_fileNo;
+   m_fileBytes = 0;
+   m_fileFrames = 0;
+
+   //NAXIS3 is filled in on close
+   m_head.replace("NAXIS3", "0", "");
+   improc::fitsMemHeader head = m_head;
+   head.append(m_extra);
+
+   if(m_used + head.size() > m_bufSize) handoff(false);
+
+   head.write(m_bufs[m_fill] + m_used);
+   m_used += head.size();
+
+   return 0;
+}
+
+inline
+void fitsRecorder::closeFile()
+{
+   handoff(true);
+   m_fd = -1;
+}
+
+inline
+void fitsRecorder::handoff( bool close )
+{
+   improc::fitsMemHeader head;
+   if(close)
+   {
+      m_head.replace("NAXIS3", std::to_string(m_fileFrames), "");
+      head = m_head;
+      head.append(m_extra);
+   }
+
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      //The other buffer is the one we fill next, so it must have been written
+      m_cond.wait(lock, [this]{ return m_job.buf < 0 && !m_writing; });
+
+      m_job.buf = m_fill;
+      m_job.bytes = m_used;
+      m_job.fd = m_fd;
+      m_job.close = close;
+      m_job.dataBytes = m_fileBytes;
+      m_job.header.clear();
+
+      if(close)
+      {
+         m_job.header.resize(head.size());
+         head.write(&m_job.header[0]);
+      }
+   }
+   m_cond.notify_all();
+
+   m_fill = 1 - m_fill;
+   m_used = 0;
+}
+
+inline
+bool fitsRecorder::writeAll( int fd,
+                             const char * buf,
+                             size_t bytes
+                           )
+{
+   while(bytes > 0)
+   {
+      ssize_t rv = ::write(fd, buf, bytes);
+      if(rv < 0)
+      {
+         if(errno == EINTR) continue;
+         return false;
+      }
+
+      buf += rv;
+      bytes -= rv;
+   }
+
+   return true;
+}
+
+inline
+void fitsRecorder::writer()
+{
+   std::vector<char> pad;
+
+   while(true)
+   {
+      writeJob job;
+
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+         m_cond.wait(lock, [this]{ return m_job.buf >= 0 || m_writerStop; });
+
+         if(m_job.buf < 0) return;
+
+         job = m_job;
+         m_job.buf = -1;
+         m_writing = true;
+      }
+
+      if(job.fd >= 0)
+      {
+         if(!writeAll(job.fd, m_bufs[job.buf], job.bytes))
+         {
+            std::cerr << "fitsRecorder: write error: " << strerror(errno) << "\n";
+         }
+
+         if(job.close)
+         {
+            pad.assign(improc::fitsBlockPad(job.dataBytes) - job.dataBytes, 0);
+            if(!writeAll(job.fd, pad.data(), pad.size()) || pwrite(job.fd, job.header.data(), job.header.size(), 0) != (ssize_t) job.header.size())
+            {
+               std::cerr << "fitsRecorder: error finishing file: " << strerror(errno) << "\n";
+            }
+
+            ::close(job.fd);
+         }
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_writing = false;
+      }
+      m_cond.notify_all();
+   }
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_fitsRecorder_hpp
@@ -0,0 +1,295 @@
+/** \file frameMetrics.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Measures the PSF in every image of a stream
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_frameMetrics_hpp
+#define milk_frameMetrics_hpp
+
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+#include "streamFollower.hpp"
+#include "streamRelay.hpp"
+#include "../improc/imageKernels.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// The measurements of one image, in pixels of the full image with 0 at the center of the first pixel.
+/** Published in this order, as a vector of doubles.
+  */
+struct frameMetricsResult
+{
+   double cnt0 {0};  ///< The cnt0 of the image
+   double x {0};     ///< The column of the centroid
+   double y {0};     ///< The row of the centroid
+   double peak {0};  ///< The largest pixel
+   double peakX {0}; ///< The column of the largest pixel
+   double peakY {0}; ///< The row of the largest pixel
+   double flux {0};  ///< The sum of the pixels
+   double fwhm {0};  ///< The FWHM of a Gaussian with the same second moment
+   double ee {0};    ///< The fraction of the flux within the encircled energy radius
+};
+
+/// Functor for \ref milkTypeDispatch which calculates the moments of an image.
+template<typename dataT>
+struct frameMetricsMomentsT
+{
+   static int call( improc::imageMoments & m,
+                    const void * im,
+                    size_t nx,
+                    size_t x0,
+                    size_t y0,
+                    size_t w,
+                    size_t h,
+                    double cx,
+                    double cy,
+                    double radius
+                  )
+   {
+      improc::imageMomentsROI(m, static_cast<const dataT *>(im), nx, x0, y0, w, h, cx, cy, radius);
+      return 0;
+   }
+};
+
+/// Measures the centroid, peak, flux, FWHM and encircled energy of every image of a stream, and publishes them.
+/** A \ref streamFollower thread measures each image at the full stream rate, within the region of interest, in one
+  * pass.  The encircled energy is the fraction of the flux within the radius of the previous image's centroid, which
+  * is what lets it be found in the same pass.  No background is subtracted, so the stream should be dark subtracted
+  * for the FWHM and encircled energy to be meaningful.
+  *
+  * The measurements are published as a 9 x 1 double stream (see \ref frameMetricsResult), and the latest can be read
+  * with \ref latest, e.g. to mark the centroid in ds9.
+  */
+class frameMetrics : public streamFollower
+{
+protected:
+   double m_radius {5}; ///< The encircled energy radius, in pixels
+
+   streamRelay m_out; ///< Publishes the measurements
+
+   std::mutex m_mutex; ///< Protects the ROI and the latest result
+
+   size_t m_x0 {0}; ///< The first column of the ROI
+   size_t m_y0 {0}; ///< The first row of the ROI
+   size_t m_w {0};  ///< The width of the ROI
+   size_t m_h {0};  ///< The height of the ROI
+
+   frameMetricsResult m_latest; ///< The measurements of the latest image
+   bool m_valid {false};        ///< Whether m_latest holds a measurement
+
+   double m_cx {0}; ///< The center of the encircled energy circle
+   double m_cy {0}; ///< The center of the encircled energy circle
+
+public:
+
+   ~frameMetrics();
+
+   ///Set the output stream and the encircled energy radius.
+   void setup( const std::string & name, ///< [in] the stream to publish to, empty to disable
+               double radius             ///< [in] the encircled energy radius, in pixels
+             );
+
+   ///Get the name of the output stream, which is empty if measuring is disabled.
+   const std::string & name() const;
+
+   ///Set the region of interest to measure within.
+   void roi( size_t x0, ///< [in] the first column
+             size_t y0, ///< [in] the first row
+             size_t w,  ///< [in] the width
+             size_t h   ///< [in] the height
+           );
+
+   ///Start measuring a stream.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int start( IMAGE & image, ///< [in] the open stream
+              int semNum     ///< [in] the semaphore to wait on, which should not be used by another reader
+            );
+
+   ///Get the latest measurements.
+   /**
+     * \retval true if there are measurements
+     * \retval false if no image has been measured yet
+     */
+   bool latest( frameMetricsResult & res /**< [out] the measurements*/);
+
+protected:
+   virtual void newImage( const void * im,
+                          uint64_t cnt0
+                        );
+};
+
+inline
+frameMetrics::~frameMetrics()
+{
+   stop();
+}
+
+inline
+void frameMetrics::setup( const std::string & name,
+                          double radius
+                        )
+{
+   m_out.setup(name, 1, 1);
+   m_radius = radius;
+}
+
+inline
+const std::string & frameMetrics::name() const
+{
+   return m_out.name();
+}
+
+inline
+void frameMetrics::roi( size_t x0,
+                        size_t y0,
+                        size_t w,
+                        size_t h
+                      )
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(x0 != m_x0 || y0 != m_y0 || w != m_w || h != m_h)
+   {
+      m_cx = x0 + 0.5*w;
+      m_cy = y0 + 0.5*h;
+   }
+
+   m_x0 = x0;
+   m_y0 = y0;
+   m_w = w;
+   m_h = h;
+}
+
+inline
+int frameMetrics::start( IMAGE & image,
+                         int semNum
+                       )
+{
+   stop();
+
+   if(name() == "") return 0;
+
+   if(milkDatatypeFromBitpix(milkBitpix(image.md[0].datatype)) != image.md[0].datatype)
+   {
+      std::cerr << "frameMetrics: datatype " << (int) image.md[0].datatype << " can not be measured\n";
+      return -1;
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_valid = false;
+
+   return follow(image, semNum);
+}
+
+inline
+bool frameMetrics::latest( frameMetricsResult & res )
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   res = m_latest;
+
+   return m_valid;
+}
+
+inline
+void frameMetrics::newImage( const void * im,
+                             uint64_t cnt0
+                           )
+{
+   size_t x0, y0, w, h;
+   double cx, cy;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      x0 = m_x0;
+      y0 = m_y0;
+      w = m_w;
+      h = m_h;
+      cx = m_cx;
+      cy = m_cy;
+   }
+
+   size_t nx = m_image->md[0].size[0];
+   size_t ny = m_image->md[0].size[1];
+   if(x0 + w > nx || y0 + h > ny) return;
+
+   improc::imageMoments m;
+   milkTypeDispatch<frameMetricsMomentsT>(m_image->md[0].datatype, m, im, nx, x0, y0, w, h, cx, cy, m_radius);
+
+   frameMetricsResult res;
+   res.cnt0 = cnt0;
+   res.peak = m.peak;
+   res.peakX = m.peakX;
+   res.peakY = m.peakY;
+   res.flux = m.flux;
+
+   if(m.flux != 0)
+   {
+      res.x = m.sumX/m.flux;
+      res.y = m.sumY/m.flux;
+
+      double var = 0.5*((m.sumXX/m.flux - res.x*res.x) + (m.sumYY/m.flux - res.y*res.y));
+      res.fwhm = (var > 0) ? 2*sqrt(2*log(2.0))*sqrt(var) : 0;
+
+      res.ee = m.inside/m.flux;
+   }
+   else
+   {
+      res.x = cx;
+      res.y = cy;
+   }
+
+   m_out.publish(&res, DOUBLE_IMG, sizeof(res)/sizeof(double), 1);
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   m_latest = res;
+   m_valid = true;
+
+   //The next image's circle, kept inside the ROI
+   if(res.x >= x0 && res.x <= x0 + w && res.y >= y0 && res.y <= y0 + h)
+   {
+      m_cx = res.x;
+      m_cy = res.y;
+   }
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_frameMetrics_hpp
@@ -0,0 +1,463 @@
+/** \file historyRing.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief A ring of the most recent images from a stream, recorded at the full stream rate
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_historyRing_hpp
+#define milk_historyRing_hpp
+
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "streamFollower.hpp"
+#include "../improc/fitsMemHeader.hpp"
+
+/// The time, in seconds, over which the stream rate is measured to size the ring
+#ifndef HISTORYRING_RATE_TIME
+#define HISTORYRING_RATE_TIME (1.0)
+#endif
+
+/// The number of images which must be seen for a measured rate to be trusted
+#ifndef HISTORYRING_RATE_IMAGES
+#define HISTORYRING_RATE_IMAGES (10)
+#endif
+
+/// The fewest images the ring holds, whatever the measured rate
+#ifndef HISTORYRING_MIN_DEPTH
+#define HISTORYRING_MIN_DEPTH (16)
+#endif
+
+/// The largest ring, in bytes, that will be allocated
+#ifndef HISTORYRING_MAX_BYTES
+#define HISTORYRING_MAX_BYTES (2147483648UL)
+#endif
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// A ring of the most recent images of a stream, which can be frozen, examined and dumped to a FITS cube.
+/** A \ref streamFollower thread copies every new image into the ring, so the ring holds the stream at its full rate
+  * independently of how often images are displayed.
+  *
+  * The ring is sized for the requested number of seconds from the stream rate measured when recording starts.  All
+  * of its memory is allocated then, in one block, so recording does no allocation.  If the stream is idle or slow
+  * then, so that fewer than HISTORYRING_RATE_IMAGES images are seen, the ring starts at HISTORYRING_MIN_DEPTH images
+  * and is re-sized, once, when that many have arrived, keeping the images already recorded.
+  *
+  * Freezing stops recording.  Once \ref frozen returns true the recording thread is no longer writing, and the
+  * images can be read with \ref frame or written out with \ref dump, while the stream continues.
+  */
+class historyRing : public streamFollower
+{
+protected:
+   double m_seconds {0}; ///< The length of history requested
+
+   size_t m_depth {0}; ///< The number of images the ring holds
+
+   std::vector<char> m_arena;     ///< The images, m_depth of them
+   std::vector<uint64_t> m_cnt0;  ///< The cnt0 of each image
+   std::vector<timespec> m_atime; ///< The acquisition time of each image
+
+   size_t m_next {0};  ///< The slot the next image goes in
+   size_t m_count {0}; ///< The number of valid images
+
+   bool m_rateKnown {false}; ///< Whether the ring has been sized from a trusted rate
+   uint64_t m_rateCnt0 {0};  ///< The cnt0 at the start of the rate measurement
+   timespec m_rateStart;     ///< The time of the start of the rate measurement
+
+   std::atomic<bool> m_freezeReq {false}; ///< Request to stop recording
+   std::atomic<bool> m_frozen {false};    ///< Acknowledgement that recording has stopped
+
+public:
+
+   ~historyRing();
+
+   ///Set the length of history to record.  0 disables recording.
+   void setup( double seconds /**< [in] the length of history, in seconds*/);
+
+   ///Get the length of history requested.
+   double seconds() const;
+
+   ///Start recording a stream.
+   /** The ring is emptied, and is allocated once the stream rate has been measured.
+     *
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int start( IMAGE & image, ///< [in] the open stream
+              int semNum     ///< [in] the semaphore to wait on, which should not be used by another reader
+            );
+
+   ///Freeze or resume recording.
+   void freeze( bool fr /**< [in] true to stop recording, false to resume it*/);
+
+   ///Check whether recording has stopped, so the ring can be read.
+   bool frozen() const;
+
+   ///Get the number of images in the ring.
+   size_t count() const;
+
+   ///Get an image from the ring, only valid when frozen.
+   /**
+     * \returns a pointer to the image
+     * \returns nullptr if there is no such image
+     */
+   const void * frame( size_t back /**< [in] how many images back from the newest, 0 is the newest*/) const;
+
+   ///Get the cnt0 of an image in the ring, only valid when frozen.
+   uint64_t cnt0( size_t back /**< [in] how many images back from the newest, 0 is the newest*/) const;
+
+   ///Write the ring to a FITS cube, oldest image first.  Only valid when frozen.
+   /** The file must not already exist.
+     *
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int dump( const std::string & fname,           ///< [in] the file to write
+             const improc::fitsMemHeader & extra  ///< [in] cards to add to the header
+           ) const;
+
+protected:
+   ///Measure the stream rate and allocate the ring.
+   virtual int begin();
+
+   ///Acknowledge freeze requests.
+   virtual void idle();
+
+   ///Copy one image into the ring.
+   virtual void newImage( const void * im,
+                          uint64_t cnt0
+                        );
+
+   ///Get the depth which holds the requested history at a rate, within the limits.
+   size_t depthFor( double rate /**< [in] the stream rate, in Hz*/) const;
+
+   ///Re-size the ring, keeping the newest images which fit.
+   void resize( size_t depth /**< [in] the new depth*/);
+};
+
+inline
+historyRing::~historyRing()
+{
+   stop();
+}
+
+inline
+void historyRing::setup( double seconds )
+{
+   m_seconds = seconds;
+}
+
+inline
+double historyRing::seconds() const
+{
+   return m_seconds;
+}
+
+inline
+int historyRing::start( IMAGE & image,
+                        int semNum
+                      )
+{
+   stop();
+
+   if(m_seconds <= 0) return 0;
+
+   m_next = 0;
+   m_count = 0;
+
+   m_frozen = m_freezeReq.load();
+
+   return follow(image, semNum);
+}
+
+inline
+void historyRing::freeze( bool fr )
+{
+   m_freezeReq = fr;
+
+   //Without a recording thread there is nothing to wait for
+   if(!following()) m_frozen = fr;
+}
+
+inline
+bool historyRing::frozen() const
+{
+   return m_frozen;
+}
+
+inline
+size_t historyRing::count() const
+{
+   return m_count;
+}
+
+inline
+const void * historyRing::frame( size_t back ) const
+{
+   if(back >= m_count) return nullptr;
+
+   size_t slot = (m_next + m_depth - 1 - back) % m_depth;
+
+   return m_arena.data() + slot*m_frameBytes;
+}
+
+inline
+uint64_t historyRing::cnt0( size_t back ) const
+{
+   if(back >= m_count) return 0;
+
+   return m_cnt0[(m_next + m_depth - 1 - back) % m_depth];
+}
+
+inline
+int historyRing::begin()
+{
+   uint64_t cnt0 = m_image->md[0].cnt0;
+
+   timespec ts0, ts1;
+   clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+   double dt = 0;
+   while(!m_stop && dt < HISTORYRING_RATE_TIME)
+   {
+      //The ring is still empty, so freezing needs no wait
+      if(m_freezeReq != m_frozen) m_frozen = m_freezeReq.load();
+
+      usleep(10000);
+      clock_gettime(CLOCK_MONOTONIC, &ts1);
+      dt = (ts1.tv_sec - ts0.tv_sec) + 1e-9*(ts1.tv_nsec - ts0.tv_nsec);
+   }
+
+   if(m_stop) return -1;
+
+   uint64_t seen = m_image->md[0].cnt0 - cnt0;
+   double rate = seen/dt;
+
+   m_depth = depthFor(rate);
+   if(m_depth < 1)
+   {
+      std::cerr << "historyRing: images of " << m_frameBytes << " bytes are too large to record\n";
+      return -1;
+   }
+
+   m_arena.assign(m_depth*m_frameBytes, 0);
+   m_cnt0.assign(m_depth, 0);
+   m_atime.resize(m_depth);
+
+   //Too few images to trust the rate, so measure again from here
+   m_rateKnown = (seen >= HISTORYRING_RATE_IMAGES);
+   m_rateCnt0 = m_image->md[0].cnt0;
+   m_rateStart = ts1;
+
+   if(m_rateKnown)
+   {
+      std::cerr << "historyRing: holding " << m_depth << " images, " << m_depth/rate << " s at " << rate << " Hz\n";
+   }
+   else
+   {
+      std::cerr << "historyRing: the stream is idle or slow, holding " << m_depth << " images until its rate is known\n";
+   }
+
+   return 0;
+}
+
+inline
+size_t historyRing::depthFor( double rate ) const
+{
+   size_t depth = ceil(m_seconds*rate);
+   if(depth < HISTORYRING_MIN_DEPTH) depth = HISTORYRING_MIN_DEPTH;
+
+   if(depth*m_frameBytes > HISTORYRING_MAX_BYTES)
+   {
+      depth = HISTORYRING_MAX_BYTES/m_frameBytes;
+      std::cerr << "historyRing: limiting history to " << depth << " images\n";
+   }
+
+   return depth;
+}
+
+inline
+void historyRing::resize( size_t depth )
+{
+   if(depth == m_depth || depth < 1) return;
+
+   size_t keep = (m_count < depth) ? m_count : depth;
+
+   std::vector<char> arena(depth*m_frameBytes, 0);
+   std::vector<uint64_t> cnt0s(depth, 0);
+   std::vector<timespec> atimes(depth);
+
+   //Oldest first, from the start of the new ring
+   for(size_t n = 0; n < keep; ++n)
+   {
+      size_t back = keep - 1 - n;
+      size_t slot = (m_next + m_depth - 1 - back) % m_depth;
+
+      memcpy(arena.data() + n*m_frameBytes, m_arena.data() + slot*m_frameBytes, m_frameBytes);
+      cnt0s[n] = m_cnt0[slot];
+      atimes[n] = m_atime[slot];
+   }
+
+   m_arena.swap(arena);
+   m_cnt0.swap(cnt0s);
+   m_atime.swap(atimes);
+
+   m_depth = depth;
+   m_count = keep;
+   m_next = keep % depth;
+}
+
+inline
+void historyRing::idle()
+{
+   if(m_freezeReq != m_frozen) m_frozen = m_freezeReq.load();
+}
+
+inline
+void historyRing::newImage( const void * im,
+                            uint64_t cnt0
+                          )
+{
+   if(m_frozen) return;
+
+   memcpy(m_arena.data() + m_next*m_frameBytes, im, m_frameBytes);
+
+   m_cnt0[m_next] = cnt0;
+   m_atime[m_next] = m_image->md[0].atime;
+
+   m_next = (m_next + 1) % m_depth;
+   if(m_count < m_depth) ++m_count;
+
+   //Sized while the stream was idle or slow, so re-size once its rate is known
+   if(!m_rateKnown && cnt0 - m_rateCnt0 >= HISTORYRING_RATE_IMAGES)
+   {
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      double dt = (ts.tv_sec - m_rateStart.tv_sec) + 1e-9*(ts.tv_nsec - m_rateStart.tv_nsec);
+
+      double rate = (cnt0 - m_rateCnt0)/dt;
+      resize(depthFor(rate));
+      m_rateKnown = true;
+
+      std::cerr << "historyRing: holding " << m_depth << " images, " << m_depth/rate << " s at " << rate << " Hz\n";
+   }
+}
+
+inline
+int historyRing::dump( const std::string & fname,
+                       const improc::fitsMemHeader & extra
+                     ) const
+{
+   if(!m_frozen)
+   {
+      std::cerr << "historyRing: must be frozen to dump\n";
+      return -1;
+   }
+
+   if(m_count == 0 || m_image == nullptr)
+   {
+      std::cerr << "historyRing: nothing to dump\n";
+      return -1;
+   }
+
+   uint8_t datatype = m_image->md[0].datatype;
+   size_t nx = m_image->md[0].size[0];
+   size_t ny = m_image->md[0].size[1];
+
+   //Complex images are written as interleaved real and imaginary parts
+   int bitpix = milkBitpix(datatype);
+   size_t pixels = m_frameBytes/(abs(bitpix)/8);
+   size_t dim1 = pixels/ny;
+
+   improc::fitsMemHeader head;
+   if(head.image(bitpix, dim1, ny, m_count) < 0)
+   {
+      std::cerr << "historyRing: datatype " << (int) datatype << " can not be written to FITS\n";
+      return -1;
+   }
+
+   if(dim1 != nx) head.appendString("COMPLEX", "RE,IM", "components interleaved along NAXIS1");
+   head.append("CNT0FRST", std::to_string(cnt0(m_count-1)), "cnt0 of the first image");
+   head.append("CNT0LAST", std::to_string(cnt0(0)), "cnt0 of the last image");
+   head.append(extra);
+
+   int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+   FILE * fout = (fd < 0) ? nullptr : fdopen(fd, "wb");
+   if(fout == nullptr)
+   {
+      std::cerr << "historyRing: could not create " << fname << ": " << strerror(errno) << "\n";
+      if(fd >= 0) close(fd);
+      return -1;
+   }
+
+   std::vector<char> buf(head.size());
+   head.write(buf.data());
+
+   bool ok = (fwrite(buf.data(), 1, buf.size(), fout) == buf.size());
+
+   buf.resize(m_frameBytes);
+   for(size_t n = m_count; n > 0 && ok; --n)
+   {
+      improc::fitsBigEndianCopy(buf.data(), frame(n-1), pixels, bitpix);
+      ok = (fwrite(buf.data(), 1, m_frameBytes, fout) == m_frameBytes);
+   }
+
+   size_t pad = improc::fitsBlockPad(m_count*m_frameBytes) - m_count*m_frameBytes;
+   buf.assign(pad, 0);
+   if(ok && pad > 0) ok = (fwrite(buf.data(), 1, pad, fout) == pad);
+
+   if(fclose(fout) != 0) ok = false;
+
+   if(!ok)
+   {
+      std::cerr << "historyRing: error writing " << fname << "\n";
+      return -1;
+   }
+
+   return 0;
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_historyRing_hpp
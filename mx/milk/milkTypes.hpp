@@ -0,0 +1,300 @@
+/** \file milkTypes.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Compile-time mapping between ImageStreamIO datatypes, c++ types, and FITS BITPIX
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_milkTypes_hpp
+#define milk_milkTypes_hpp
+
+#include <cstdint>
+#include <cstddef>
+
+#include <ImageStruct.h>
+
+#include "../improc/fitsUtils.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// Traits of an ImageStreamIO datatype.
+/** Specialized for each supported datatype, providing
+  * - type: the c++ type of a pixel
+  * - realT: the c++ type of a real component, which is type except for complex data
+  * - bitpix: the cfitsio image type of a pixel (or of a component for complex data)
+  * - isComplex: true for complex data
+  *
+  * The primary template is left undefined, so an unsupported datatype is a compile error.
+  *
+  * \tparam datatype is the ImageStreamIO _DATATYPE_ constant
+  */
+template<uint8_t datatype>
+struct milkType;
+
+template<>
+struct milkType<_DATATYPE_UINT8>
+{
+   typedef uint8_t type;
+   typedef uint8_t realT;
+   static constexpr int bitpix = BYTE_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_INT8>
+{
+   typedef int8_t type;
+   typedef int8_t realT;
+   static constexpr int bitpix = SBYTE_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_UINT16>
+{
+   typedef uint16_t type;
+   typedef uint16_t realT;
+   static constexpr int bitpix = USHORT_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_INT16>
+{
+   typedef int16_t type;
+   typedef int16_t realT;
+   static constexpr int bitpix = SHORT_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_UINT32>
+{
+   typedef uint32_t type;
+   typedef uint32_t realT;
+   static constexpr int bitpix = ULONG_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_INT32>
+{
+   typedef int32_t type;
+   typedef int32_t realT;
+   static constexpr int bitpix = LONG_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_UINT64>
+{
+   typedef uint64_t type;
+   typedef uint64_t realT;
+   static constexpr int bitpix = ULONGLONG_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_INT64>
+{
+   typedef int64_t type;
+   typedef int64_t realT;
+   static constexpr int bitpix = LONGLONG_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_FLOAT>
+{
+   typedef float type;
+   typedef float realT;
+   static constexpr int bitpix = FLOAT_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_DOUBLE>
+{
+   typedef double type;
+   typedef double realT;
+   static constexpr int bitpix = DOUBLE_IMG;
+   static constexpr bool isComplex = false;
+};
+
+template<>
+struct milkType<_DATATYPE_COMPLEX_FLOAT>
+{
+   typedef complex_float type;
+   typedef float realT;
+   static constexpr int bitpix = FLOAT_IMG;
+   static constexpr bool isComplex = true;
+};
+
+template<>
+struct milkType<_DATATYPE_COMPLEX_DOUBLE>
+{
+   typedef complex_double type;
+   typedef double realT;
+   static constexpr int bitpix = DOUBLE_IMG;
+   static constexpr bool isComplex = true;
+};
+
+/// The reverse mapping, from a c++ pixel type to its ImageStreamIO datatype
+/**
+  * \tparam dataT is the c++ type
+  */
+template<typename dataT>
+struct milkDatatype;
+
+template<> struct milkDatatype<uint8_t> { static constexpr uint8_t value = _DATATYPE_UINT8; };
+template<> struct milkDatatype<int8_t> { static constexpr uint8_t value = _DATATYPE_INT8; };
+template<> struct milkDatatype<uint16_t> { static constexpr uint8_t value = _DATATYPE_UINT16; };
+template<> struct milkDatatype<int16_t> { static constexpr uint8_t value = _DATATYPE_INT16; };
+template<> struct milkDatatype<uint32_t> { static constexpr uint8_t value = _DATATYPE_UINT32; };
+template<> struct milkDatatype<int32_t> { static constexpr uint8_t value = _DATATYPE_INT32; };
+template<> struct milkDatatype<uint64_t> { static constexpr uint8_t value = _DATATYPE_UINT64; };
+template<> struct milkDatatype<int64_t> { static constexpr uint8_t value = _DATATYPE_INT64; };
+template<> struct milkDatatype<float> { static constexpr uint8_t value = _DATATYPE_FLOAT; };
+template<> struct milkDatatype<double> { static constexpr uint8_t value = _DATATYPE_DOUBLE; };
+template<> struct milkDatatype<complex_float> { static constexpr uint8_t value = _DATATYPE_COMPLEX_FLOAT; };
+template<> struct milkDatatype<complex_double> { static constexpr uint8_t value = _DATATYPE_COMPLEX_DOUBLE; };
+
+/// Get the size of a pixel of an ImageStreamIO datatype.
+/**
+  * \returns the size in bytes
+  * \returns 0 if the datatype is not supported
+  */
+constexpr size_t milkTypeSize( uint8_t datatype /**< [in] the ImageStreamIO _DATATYPE_ constant */)
+{
+   return datatype == _DATATYPE_UINT8 ? sizeof(milkType<_DATATYPE_UINT8>::type) :
+          datatype == _DATATYPE_INT8 ? sizeof(milkType<_DATATYPE_INT8>::type) :
+          datatype == _DATATYPE_UINT16 ? sizeof(milkType<_DATATYPE_UINT16>::type) :
+          datatype == _DATATYPE_INT16 ? sizeof(milkType<_DATATYPE_INT16>::type) :
+          datatype == _DATATYPE_UINT32 ? sizeof(milkType<_DATATYPE_UINT32>::type) :
+          datatype == _DATATYPE_INT32 ? sizeof(milkType<_DATATYPE_INT32>::type) :
+          datatype == _DATATYPE_UINT64 ? sizeof(milkType<_DATATYPE_UINT64>::type) :
+          datatype == _DATATYPE_INT64 ? sizeof(milkType<_DATATYPE_INT64>::type) :
+          datatype == _DATATYPE_FLOAT ? sizeof(milkType<_DATATYPE_FLOAT>::type) :
+          datatype == _DATATYPE_DOUBLE ? sizeof(milkType<_DATATYPE_DOUBLE>::type) :
+          datatype == _DATATYPE_COMPLEX_FLOAT ? sizeof(milkType<_DATATYPE_COMPLEX_FLOAT>::type) :
+          datatype == _DATATYPE_COMPLEX_DOUBLE ? sizeof(milkType<_DATATYPE_COMPLEX_DOUBLE>::type) :
+          0;
+}
+
+/// Get the cfitsio image type of an ImageStreamIO datatype.
+/** For complex data this is the type of one component.
+  *
+  * \returns the cfitsio image type
+  * \returns 0 if the datatype is not supported
+  */
+constexpr int milkBitpix( uint8_t datatype /**< [in] the ImageStreamIO _DATATYPE_ constant */)
+{
+   return datatype == _DATATYPE_UINT8 ? milkType<_DATATYPE_UINT8>::bitpix :
+          datatype == _DATATYPE_INT8 ? milkType<_DATATYPE_INT8>::bitpix :
+          datatype == _DATATYPE_UINT16 ? milkType<_DATATYPE_UINT16>::bitpix :
+          datatype == _DATATYPE_INT16 ? milkType<_DATATYPE_INT16>::bitpix :
+          datatype == _DATATYPE_UINT32 ? milkType<_DATATYPE_UINT32>::bitpix :
+          datatype == _DATATYPE_INT32 ? milkType<_DATATYPE_INT32>::bitpix :
+          datatype == _DATATYPE_UINT64 ? milkType<_DATATYPE_UINT64>::bitpix :
+          datatype == _DATATYPE_INT64 ? milkType<_DATATYPE_INT64>::bitpix :
+          datatype == _DATATYPE_FLOAT ? milkType<_DATATYPE_FLOAT>::bitpix :
+          datatype == _DATATYPE_DOUBLE ? milkType<_DATATYPE_DOUBLE>::bitpix :
+          datatype == _DATATYPE_COMPLEX_FLOAT ? milkType<_DATATYPE_COMPLEX_FLOAT>::bitpix :
+          datatype == _DATATYPE_COMPLEX_DOUBLE ? milkType<_DATATYPE_COMPLEX_DOUBLE>::bitpix :
+          0;
+}
+
+/// Get the ImageStreamIO datatype for a cfitsio image type
+/** This is the inverse of \ref milkBitpix for real types.
+  *
+  * \returns the ImageStreamIO _DATATYPE_ constant
+  * \returns 0 if the image type is not supported
+  */
+constexpr uint8_t milkDatatypeFromBitpix( int bitpix /**< [in] the cfitsio image type */)
+{
+   return bitpix == milkType<_DATATYPE_UINT8>::bitpix ? _DATATYPE_UINT8 :
+          bitpix == milkType<_DATATYPE_INT8>::bitpix ? _DATATYPE_INT8 :
+          bitpix == milkType<_DATATYPE_UINT16>::bitpix ? _DATATYPE_UINT16 :
+          bitpix == milkType<_DATATYPE_INT16>::bitpix ? _DATATYPE_INT16 :
+          bitpix == milkType<_DATATYPE_UINT32>::bitpix ? _DATATYPE_UINT32 :
+          bitpix == milkType<_DATATYPE_INT32>::bitpix ? _DATATYPE_INT32 :
+          bitpix == milkType<_DATATYPE_UINT64>::bitpix ? _DATATYPE_UINT64 :
+          bitpix == milkType<_DATATYPE_INT64>::bitpix ? _DATATYPE_INT64 :
+          bitpix == milkType<_DATATYPE_FLOAT>::bitpix ? _DATATYPE_FLOAT :
+          bitpix == milkType<_DATATYPE_DOUBLE>::bitpix ? _DATATYPE_DOUBLE :
+          0;
+}
+
+/// Call a functor template with the c++ type of an ImageStreamIO datatype.
+/** This is the one place a runtime datatype is turned into a compile-time type.  It is meant to be
+  * called once, e.g. when a stream is opened, to select fully specialized code.
+  *
+  * \tparam funcT is a class template with a static member function call(argsT...), instantiated for each pixel type
+  *
+  * \returns the return value of funcT<type>::call
+  * \returns a value-initialized return value if the datatype is not supported
+  */
+template<template<typename> class funcT, typename... argsT>
+auto milkTypeDispatch( uint8_t datatype, ///< [in] the ImageStreamIO _DATATYPE_ constant
+                       argsT &&... args  ///< [in] the arguments to pass to funcT::call
+                     ) -> decltype(funcT<float>::call(args...))
+{
+   switch(datatype)
+   {
+      case _DATATYPE_UINT8:
+         return funcT<milkType<_DATATYPE_UINT8>::type>::call(args...);
+      case _DATATYPE_INT8:
+         return funcT<milkType<_DATATYPE_INT8>::type>::call(args...);
+      case _DATATYPE_UINT16:
+         return funcT<milkType<_DATATYPE_UINT16>::type>::call(args...);
+      case _DATATYPE_INT16:
+         return funcT<milkType<_DATATYPE_INT16>::type>::call(args...);
+      case _DATATYPE_UINT32:
+         return funcT<milkType<_DATATYPE_UINT32>::type>::call(args...);
+      case _DATATYPE_INT32:
+         return funcT<milkType<_DATATYPE_INT32>::type>::call(args...);
+      case _DATATYPE_UINT64:
+         return funcT<milkType<_DATATYPE_UINT64>::type>::call(args...);
+      case _DATATYPE_INT64:
+         return funcT<milkType<_DATATYPE_INT64>::type>::call(args...);
+      case _DATATYPE_FLOAT:
+         return funcT<milkType<_DATATYPE_FLOAT>::type>::call(args...);
+      case _DATATYPE_DOUBLE:
+         return funcT<milkType<_DATATYPE_DOUBLE>::type>::call(args...);
+      default:
+         return decltype(funcT<float>::call(args...))();
+   }
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_milkTypes_hpp
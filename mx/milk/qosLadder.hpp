@@ -0,0 +1,284 @@
+/** \file qosLadder.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Degrades the display step by step when the viewer falls behind
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_qosLadder_hpp
+#define milk_qosLadder_hpp
+
+#include <chrono>
+#include <iostream>
+
+#include <time.h>
+
+#include "displayPipeline.hpp"
+
+#ifndef QOSLADDER_WINDOW
+/// The time, in seconds, over which latency and skipped updates are averaged before the level is reconsidered
+#define QOSLADDER_WINDOW (1.0)
+#endif
+
+#ifndef QOSLADDER_HOLD
+/// The number of consecutive windows with headroom needed to climb back a level
+#define QOSLADDER_HOLD (5)
+#endif
+
+#ifndef QOSLADDER_MIN_WAIT
+/// The least time, in usec, to wait after each image when the rate is reduced (i.e. at most 20 Hz)
+#define QOSLADDER_MIN_WAIT (50000)
+#endif
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// The levels of the \ref qosLadder, each adding to the ones before it.
+enum qosLevel
+{
+   qosFull,      ///< The display as configured
+   qosRate,      ///< The display rate is reduced
+   qosPrecision, ///< Types wider than 2 bytes are quantized to 16 bits
+   qosBin,       ///< The binning is doubled
+   qosROI,       ///< Only the central quarter of the region of interest is shown
+   qosLevels     ///< The number of levels
+};
+
+/// Steps the display down a ladder of cheaper settings when it falls behind, and back up when it catches up.
+/** The display reports each image it shows with \ref frame: the latency, from acquisition to ds9 having it, and
+  * whether ds9 was too slow to be told (see \ref improc::ds9Interface::setPacing).  Once per \ref QOSLADDER_WINDOW
+  * \ref update compares the averages to the limits.  If either is over, the ladder steps down a level at once.  It
+  * steps back up only after \ref QOSLADDER_HOLD windows in a row with both under half their limits, so it does not
+  * oscillate about a limit.  Each transition is logged to stderr.
+  */
+class qosLadder
+{
+protected:
+   double m_maxLatency {0}; ///< The most latency allowed, in seconds.  0 disables the ladder.
+   double m_maxSkip {0.5};  ///< The largest fraction of updates which may be skipped
+
+   int m_level {qosFull}; ///< The current level
+
+   std::chrono::steady_clock::time_point m_windowStart; ///< The start of the current window
+
+   double m_latencySum {0}; ///< The sum of the latencies in the current window
+   size_t m_frames {0};     ///< The number of images shown in the current window
+   size_t m_skipped {0};    ///< The number of those ds9 was not told about
+
+   int m_good {0}; ///< The number of consecutive windows with headroom
+
+public:
+
+   ///Set the limits.
+   void setup( double maxLatency, ///< [in] the most latency allowed, in seconds.  0 disables the ladder.
+               double maxSkip     ///< [in] the largest fraction of updates which may be skipped
+             );
+
+   ///Check whether the ladder is in use.
+   bool enabled() const;
+
+   ///Get the current level.
+   int level() const;
+
+   ///Get the name of a level.
+   static const char * levelName( int level /**< [in] the level*/);
+
+   ///Record an image shown.
+   void frame( double latency, ///< [in] the time from acquisition until ds9 had the image, in seconds
+               bool skipped    ///< [in] whether the update was skipped because ds9 was behind
+             );
+
+   ///Reconsider the level, at the end of each window.
+   /**
+     * \retval 1 if the level changed
+     * \retval 0 otherwise
+     */
+   int update();
+
+   ///Get the display configuration for the current level.
+   displayConfig config( const displayConfig & base, ///< [in] the configuration requested
+                         size_t nx,                  ///< [in] the first dimension of the image the ROI is in, e.g. the remapped image
+                         size_t ny                   ///< [in] the second dimension of the image the ROI is in
+                       ) const;
+
+   ///Get the time to wait after each image for the current level.
+   int waitTime( int base /**< [in] the time requested, in usec*/) const;
+};
+
+inline
+void qosLadder::setup( double maxLatency,
+                       double maxSkip
+                     )
+{
+   m_maxLatency = maxLatency;
+   m_maxSkip = maxSkip;
+   m_level = qosFull;
+   m_windowStart = std::chrono::steady_clock::now();
+   m_latencySum = 0;
+   m_frames = 0;
+   m_skipped = 0;
+   m_good = 0;
+}
+
+inline
+bool qosLadder::enabled() const
+{
+   return (m_maxLatency > 0);
+}
+
+inline
+int qosLadder::level() const
+{
+   return m_level;
+}
+
+inline
+const char * qosLadder::levelName( int level )
+{
+   switch(level)
+   {
+      case qosFull:
+         return "full";
+      case qosRate:
+         return "rate";
+      case qosPrecision:
+         return "precision";
+      case qosBin:
+         return "bin";
+      case qosROI:
+         return "roi";
+      default:
+         return "unknown";
+   }
+}
+
+inline
+void qosLadder::frame( double latency,
+                       bool skipped
+                     )
+{
+   m_latencySum += latency;
+   ++m_frames;
+   if(skipped) ++m_skipped;
+}
+
+inline
+int qosLadder::update()
+{
+   if(!enabled()) return 0;
+
+   auto now = std::chrono::steady_clock::now();
+   if(std::chrono::duration<double>(now - m_windowStart).count() < QOSLADDER_WINDOW) return 0;
+
+   m_windowStart = now;
+
+   //Nothing shown, e.g. the stream is idle, says nothing about the viewer
+   if(m_frames == 0) return 0;
+
+   double latency = m_latencySum/m_frames;
+   double skip = static_cast<double>(m_skipped)/m_frames;
+
+   m_latencySum = 0;
+   m_frames = 0;
+   m_skipped = 0;
+
+   int level = m_level;
+
+   if(latency > m_maxLatency || skip > m_maxSkip)
+   {
+      m_good = 0;
+      if(m_level < qosLevels - 1) ++level;
+   }
+   else if(latency < 0.5*m_maxLatency && skip < 0.5*m_maxSkip)
+   {
+      if(++m_good >= QOSLADDER_HOLD && m_level > qosFull)
+      {
+         --level;
+         m_good = 0;
+      }
+   }
+   else m_good = 0;
+
+   if(level == m_level) return 0;
+
+   time_t t = time(nullptr);
+   char ts[32];
+   strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+
+   std::cerr << ts << " qosLadder: " << levelName(m_level) << " -> " << levelName(level) << " (latency " << latency*1000 << " ms, ";
+   std::cerr << skip*100 << "% of updates skipped)\n";
+
+   m_level = level;
+
+   return 1;
+}
+
+inline
+displayConfig qosLadder::config( const displayConfig & base,
+                                 size_t nx,
+                                 size_t ny
+                               ) const
+{
+   displayConfig config = base;
+
+   if(m_level >= qosPrecision && (config.precision == precisionNative || config.precision == precisionFloat))
+   {
+      config.precision = precisionLinear16;
+   }
+
+   if(m_level >= qosBin) config.bin = 2*(config.bin < 1 ? 1 : config.bin);
+
+   if(m_level >= qosROI)
+   {
+      //The central quarter of the ROI
+      size_t x0, y0, w, h;
+      displayROI(x0, y0, w, h, config, nx, ny);
+
+      config.roiX = x0 + w/4;
+      config.roiY = y0 + h/4;
+      config.roiW = w/2;
+      config.roiH = h/2;
+   }
+
+   return config;
+}
+
+inline
+int qosLadder::waitTime( int base ) const
+{
+   if(m_level < qosRate) return base;
+
+   return (4*base > QOSLADDER_MIN_WAIT) ? 4*base : QOSLADDER_MIN_WAIT;
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_qosLadder_hpp
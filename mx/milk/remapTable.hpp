@@ -0,0 +1,144 @@
+/** \file remapTable.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief A table mapping the pixels of a stream into a 2D display layout
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_remapTable_hpp
+#define milk_remapTable_hpp
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "milkTypes.hpp"
+#include "../improc/fitsMmapCube.hpp"
+#include "../improc/imageKernels.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// Functor for \ref milkTypeDispatch which converts an index map to table entries.
+/** Returns -1 if an index does not fit in the table.
+  */
+template<typename dataT>
+struct remapTableConvertT
+{
+   static int call( std::vector<int32_t> & idx,
+                    std::vector<uint8_t> & use,
+                    const void * map,
+                    size_t n
+                  )
+   {
+      const dataT * m = static_cast<const dataT *>(map);
+
+      for(size_t i = 0; i < n; ++i)
+      {
+         double v = m[i];
+
+         //Negative and non-finite entries are unused
+         if(!improc::imageIsFinite(m[i]) || v < 0)
+         {
+            idx[i] = 0;
+            use[i] = 0;
+            continue;
+         }
+
+         if(v > INT32_MAX)
+         {
+            std::cerr << "remapTable: index " << v << " at pixel " << i << " is too large\n";
+            return -1;
+         }
+
+         idx[i] = lround(v);
+         use[i] = 1;
+      }
+
+      return 0;
+   }
+};
+
+/// A table giving, for each pixel of a 2D display image, the index of the stream pixel shown there.
+/** The table is read from a FITS image of the display size, whose pixels are 0-based indices into the stream
+  * image (taken as a flat vector).  Negative or non-finite pixels are unused, and are displayed as NaN.
+  */
+struct remapTable
+{
+   size_t width {0};  ///< The first dimension of the display image
+   size_t height {0}; ///< The second dimension of the display image
+
+   std::vector<int32_t> idx; ///< The stream index of each display pixel, 0 where unused
+   std::vector<uint8_t> use; ///< 1 where the display pixel is used, 0 where it is NaN
+
+   size_t size {0}; ///< One more than the largest index, i.e. the smallest stream which can be remapped
+
+   ///Load the table from a FITS file.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int load( const std::string & fname /**< [in] the FITS index map*/)
+   {
+      improc::fitsMmapCube map;
+      if(map.open(fname) < 0) return -1;
+
+      uint8_t datatype = milkDatatypeFromBitpix(map.bitpix());
+      if(datatype == 0)
+      {
+         std::cerr << "remapTable: BITPIX of " << fname << " is not supported\n";
+         return -1;
+      }
+
+      width = map.dim1();
+      height = map.dim2();
+
+      size_t n = width*height;
+
+      std::vector<char> native(n*map.pixsz());
+      map.image(native.data(), 0);
+
+      idx.resize(n);
+      use.resize(n);
+      if(milkTypeDispatch<remapTableConvertT>(datatype, idx, use, native.data(), n) < 0) return -1;
+
+      size = 0;
+      for(size_t i = 0; i < n; ++i) if(use[i] && (size_t) idx[i] + 1 > size) size = idx[i] + 1;
+
+      return 0;
+   }
+};
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_remapTable_hpp
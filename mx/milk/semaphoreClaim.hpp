@@ -0,0 +1,320 @@
+/** \file semaphoreClaim.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Claims a semaphore of a stream which no other reader is using
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_semaphoreClaim_hpp
+#define milk_semaphoreClaim_hpp
+
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ImageStruct.h>
+#include <ImageStreamIO.h>
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// Claims a semaphore of a stream for one reader, so that readers don't take each other's posts.
+/** A post is consumed by whichever reader waits on it first, so two readers of one semaphore each see only some of
+  * the images.  A claim finds an index no other reader holds, trying a preferred one first.
+  *
+  * Where the stream has ImageStreamIO's reader registration, the semReadPID array, the claim follows its convention:
+  * the reader's PID is stamped in the entry, which is free if it is 0 or the process no longer exists.  The stamp is
+  * made with an atomic compare-and-swap, so two readers can't both take an entry.  Otherwise each index is claimed
+  * with an exclusive lock on a file next to the stream file, holding the reader's PID, which the kernel releases if
+  * the reader dies.  The file is removed when the claim is released.  Within one process the indices already claimed are tracked, since they all have the same PID.
+  *
+  * The claim is released by \ref release or the destructor, and a crashed reader's claim is taken over by the next
+  * one to look for an index.
+  */
+class semaphoreClaim
+{
+protected:
+   IMAGE * m_image {nullptr}; ///< The stream
+   std::string m_name;        ///< The stream name, for the claims made in this process
+   int m_index {-1};          ///< The claimed index, -1 if none
+   int m_lockFd {-1};         ///< The claim file, if locking
+   std::string m_lockName;    ///< The path of the claim file, if locking
+
+public:
+
+   ~semaphoreClaim();
+
+   ///Claim a semaphore of a stream.
+   /**
+     * \returns the index claimed
+     * \returns -1 if every semaphore is in use
+     */
+   int claim( IMAGE & image,      ///< [in] the open stream
+              int preferred = -1  ///< [in] [optional] the index to try first, -1 for any
+            );
+
+   ///Release the claim.  This must be done before the stream is closed.
+   void release();
+
+   ///Get the claimed index, -1 if none.
+   int index() const;
+
+   ///Get the claimed semaphore, nullptr if none.
+   sem_t * sem() const;
+
+   ///Wait for a post, then take any others waiting, since the stream's counters cover all of the images they stand for.
+   /**
+     * \retval true if there was a post
+     * \retval false if the wait timed out, or nothing is claimed
+     */
+   bool wait( long usec /**< [in] the longest time to wait*/);
+
+   ///Take all of the posts waiting.
+   void drain();
+
+protected:
+   ///Try to claim one index.
+   bool tryClaim( int n /**< [in] the index*/);
+
+   ///The indices claimed in this process, per stream
+   static std::set<std::string> & claimed();
+
+   ///Protects \ref claimed
+   static std::mutex & claimedMutex();
+
+   ///The key of an index in \ref claimed
+   std::string key( int n ) const;
+};
+
+inline
+semaphoreClaim::~semaphoreClaim()
+{
+   release();
+}
+
+inline
+int semaphoreClaim::claim( IMAGE & image,
+                           int preferred
+                         )
+{
+   release();
+
+   m_image = &image;
+   m_name = image.md[0].name;
+
+   int nsem = image.md[0].sem;
+
+   if(preferred >= 0 && preferred < nsem && tryClaim(preferred)) m_index = preferred;
+
+   for(int n = 0; n < nsem && m_index < 0; ++n)
+   {
+      if(tryClaim(n)) m_index = n;
+   }
+
+   if(m_index < 0)
+   {
+      std::cerr << "semaphoreClaim: all " << nsem << " semaphores of " << image.md[0].name << " are in use\n";
+      m_image = nullptr;
+      return -1;
+   }
+
+   if(preferred >= 0 && m_index != preferred)
+   {
+      std::cerr << "semaphoreClaim: semaphore " << preferred << " of " << image.md[0].name << " is in use, using " << m_index << "\n";
+   }
+
+   //Posts from before the claim are stale
+   drain();
+
+   return m_index;
+}
+
+inline
+void semaphoreClaim::release()
+{
+   if(m_index < 0) return;
+
+   if(m_image->semReadPID)
+   {
+      pid_t me = getpid();
+      __atomic_compare_exchange_n(&m_image->semReadPID[m_index], &me, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+   }
+
+   if(m_lockFd >= 0)
+   {
+      //Removed while still locked, so no other reader can have locked it in the meantime
+      unlink(m_lockName.c_str());
+      close(m_lockFd); //which drops the lock
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(claimedMutex());
+      claimed().erase(key(m_index));
+   }
+
+   m_index = -1;
+   m_lockFd = -1;
+   m_lockName.clear();
+   m_image = nullptr;
+}
+
+inline
+int semaphoreClaim::index() const
+{
+   return m_index;
+}
+
+inline
+sem_t * semaphoreClaim::sem() const
+{
+   if(m_index < 0) return nullptr;
+
+   return m_image->semptr[m_index];
+}
+
+inline
+bool semaphoreClaim::wait( long usec )
+{
+   if(m_index < 0) return false;
+
+   timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += usec/1000000;
+   ts.tv_nsec += (usec % 1000000)*1000;
+   if(ts.tv_nsec >= 1000000000)
+   {
+      ts.tv_nsec -= 1000000000;
+      ++ts.tv_sec;
+   }
+
+   if(sem_timedwait(sem(), &ts) != 0) return false;
+
+   drain();
+
+   return true;
+}
+
+inline
+void semaphoreClaim::drain()
+{
+   if(m_index < 0) return;
+
+   while(sem_trywait(sem()) == 0);
+}
+
+inline
+bool semaphoreClaim::tryClaim( int n )
+{
+   std::lock_guard<std::mutex> lock(claimedMutex());
+
+   if(claimed().count(key(n)) > 0) return false;
+
+   pid_t me = getpid();
+
+   if(m_image->semReadPID)
+   {
+      pid_t cur = __atomic_load_n(&m_image->semReadPID[n], __ATOMIC_ACQUIRE);
+
+      //Our own PID not in our claimed set is left from a previous open of the stream in this process
+      if(cur != 0 && cur != me && !(kill(cur, 0) < 0 && errno == ESRCH)) return false;
+
+      if(!__atomic_compare_exchange_n(&m_image->semReadPID[n], &cur, me, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return false;
+   }
+   else
+   {
+      char fname[256];
+      ImageStreamIO_filename(fname, sizeof(fname), m_image->md[0].name);
+
+      char lname[300];
+      snprintf(lname, sizeof(lname), "%s.sem%02d.claim", fname, n);
+
+      int fd = open(lname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if(fd < 0) return false;
+
+      if(flock(fd, LOCK_EX | LOCK_NB) < 0)
+      {
+         close(fd);
+         return false;
+      }
+
+      //A file the holder removed on release, after we opened it, is no longer the claim
+      struct stat fst, lst;
+      if(fstat(fd, &fst) < 0 || stat(lname, &lst) < 0 || fst.st_dev != lst.st_dev || fst.st_ino != lst.st_ino)
+      {
+         close(fd);
+         return false;
+      }
+
+      if(ftruncate(fd, 0) == 0) dprintf(fd, "%d\n", (int) me);
+
+      m_lockFd = fd;
+      m_lockName = lname;
+   }
+
+   claimed().insert(key(n));
+
+   return true;
+}
+
+inline
+std::set<std::string> & semaphoreClaim::claimed()
+{
+   static std::set<std::string> s;
+   return s;
+}
+
+inline
+std::mutex & semaphoreClaim::claimedMutex()
+{
+   static std::mutex m;
+   return m;
+}
+
+inline
+std::string semaphoreClaim::key( int n ) const
+{
+   return m_name + ":" + std::to_string(n);
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_semaphoreClaim_hpp
@@ -0,0 +1,209 @@
+/** \file streamFollower.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief A thread which receives every image of a stream
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_streamFollower_hpp
+#define milk_streamFollower_hpp
+
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include <semaphore.h>
+#include <time.h>
+
+#include <ImageStruct.h>
+#include <ImageStreamIO.h>
+
+#include "milkTypes.hpp"
+#include "semaphoreClaim.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// A thread which waits on one of a stream's semaphores and passes each new image to \ref newImage.
+/** For a circular buffer, the slices written since the last post are passed in order, as far back as the buffer
+  * goes, so the images are received at the full stream rate even if the thread is briefly late.
+  *
+  * Derived classes must call \ref stop in their destructors, before their members are destroyed.
+  */
+class streamFollower
+{
+protected:
+   IMAGE * m_image {nullptr}; ///< The stream being followed
+   semaphoreClaim m_claim;    ///< The semaphore the thread waits on
+
+   size_t m_frameBytes {0}; ///< The size of one image
+
+   std::atomic<bool> m_stop {false}; ///< Request for the thread to exit
+
+   std::thread m_thread; ///< The thread
+
+public:
+
+   virtual ~streamFollower() {}
+
+   ///Start following a stream.
+   /**
+     * \retval 0 on success
+     * \retval -1 on an error
+     */
+   int follow( IMAGE & image, ///< [in] the open stream
+               int semNum     ///< [in] the semaphore to try first, -1 for any which no other reader has claimed
+             );
+
+   ///Stop the thread and wait for it to exit.
+   void stop();
+
+   ///Check whether the thread is running.
+   bool following() const;
+
+protected:
+   ///Called in the thread before following starts.  Return < 0 to exit.
+   virtual int begin()
+   {
+      return 0;
+   }
+
+   ///Called in the thread after each wait, whether or not there was a post.
+   virtual void idle()
+   {
+   }
+
+   ///Called in the thread for each new image.
+   virtual void newImage( const void * im, ///< [in] the image, in the stream
+                          uint64_t cnt0    ///< [in] the cnt0 of the image
+                        ) = 0;
+
+   ///Called in the thread before it exits.
+   virtual void end()
+   {
+   }
+
+   ///The thread
+   void run();
+};
+
+inline
+int streamFollower::follow( IMAGE & image,
+                            int semNum
+                          )
+{
+   stop();
+
+   if(image.semptr == nullptr || m_claim.claim(image, semNum) < 0)
+   {
+      std::cerr << "streamFollower: no semaphore of " << image.md[0].name << " is free to follow it\n";
+      return -1;
+   }
+
+   m_image = &image;
+   m_frameBytes = image.md[0].size[0]*image.md[0].size[1]*milkTypeSize(image.md[0].datatype);
+
+   m_stop = false;
+
+   m_thread = std::thread(&streamFollower::run, this);
+
+   return 0;
+}
+
+inline
+void streamFollower::stop()
+{
+   if(m_thread.joinable())
+   {
+      m_stop = true;
+      m_thread.join();
+   }
+
+   m_claim.release();
+   m_image = nullptr;
+}
+
+inline
+bool streamFollower::following() const
+{
+   return m_thread.joinable();
+}
+
+inline
+void streamFollower::run()
+{
+   if(begin() < 0) return;
+
+   //Posts from before we started are stale
+   m_claim.drain();
+
+   uint64_t last_cnt0 = m_image->md[0].cnt0;
+
+   while(!m_stop)
+   {
+      //A burst of posts is one wake up, as every slice written since the last is picked up below
+      bool posted = m_claim.wait(100000);
+
+      idle();
+
+      if(!posted) continue;
+
+      uint64_t cnt0 = m_image->md[0].cnt0;
+      if(cnt0 == last_cnt0) continue;
+
+      size_t nz = m_image->md[0].size[2];
+
+      if(nz > 1)
+      {
+         //Pick up every slice written since the last post, as far back as the buffer goes
+         uint64_t missed = cnt0 - last_cnt0;
+         if(missed > nz) missed = nz;
+
+         int64_t curr = m_image->md[0].cnt1 - 1;
+         if(curr < 0) curr = nz - 1;
+
+         for(uint64_t k = missed; k > 0; --k)
+         {
+            size_t slice = (curr + nz + 1 - k) % nz;
+            newImage(m_image->array.SI8 + slice*m_frameBytes, cnt0 + 1 - k);
+         }
+      }
+      else newImage(m_image->array.raw, cnt0);
+
+      last_cnt0 = cnt0;
+   }
+
+   end();
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_streamFollower_hpp
@@ -0,0 +1,650 @@
+/** \file streamMosaic.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Composes several streams into tiles of one image
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_streamMosaic_hpp
+#define milk_streamMosaic_hpp
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "displayBudget.hpp"
+#include "displayPipeline.hpp"
+#include "streamFollower.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+#ifndef STREAMMOSAIC_ALIGN_DEPTH
+/// The number of recent images each tile keeps for alignment.
+#define STREAMMOSAIC_ALIGN_DEPTH (8)
+#endif
+
+/// How the tiles of a \ref streamMosaic are matched to each other.
+enum mosaicAlign
+{
+   alignNone, ///< Each tile shows its stream's latest image
+   alignTime, ///< Tiles show images whose acquisition times agree within a tolerance, in seconds
+   alignCnt0  ///< Tiles show images whose cnt0 values agree within a tolerance
+};
+
+/// One recent image of a tile, kept for alignment.
+/** Written by the tile's thread and read by the display without a lock: \ref seq is odd while the slot is being
+  * written, and a reader which sees it change during its copy discards the copy.
+  */
+struct mosaicSlot
+{
+   std::atomic<uint64_t> seq {0}; ///< Incremented before and after each write
+   uint64_t cnt0 {0};             ///< The cnt0 of the image
+   double atime {0};              ///< The acquisition time of the image, in seconds
+   std::vector<float> pix;        ///< The processed tile
+};
+
+/// Functor for \ref milkTypeDispatch which copies a processed tile into the mosaic as floats.
+template<typename dataT>
+struct mosaicTileCopyT
+{
+   static int call( float * dest,      ///< [out] the tile's first pixel in the mosaic
+                    size_t stride,     ///< [in] the mosaic row length
+                    const void * tile, ///< [in] the processed tile
+                    size_t w,          ///< [in] the tile width
+                    size_t h           ///< [in] the tile height
+                  )
+   {
+      const dataT * t = static_cast<const dataT *>(tile);
+
+      for(size_t j = 0; j < h; ++j) improc::imageToFloat(dest + j*stride, t + j*w, w);
+
+      return 0;
+   }
+};
+
+/// One stream of a \ref streamMosaic, processed into its tile by its own thread as the stream posts.
+class mosaicTile : public streamFollower
+{
+public:
+   std::string m_name; ///< The name of the stream
+   IMAGE m_stream;     ///< The stream
+   bool m_open {false}; ///< Whether the stream is open
+
+   size_t m_nx {0}; ///< The first dimension of the stream when opened
+   size_t m_ny {0}; ///< The second dimension of the stream when opened
+   size_t m_nz {0}; ///< The third dimension of the stream when opened
+
+   std::unique_ptr<displayPipeline> m_pipeline; ///< The stages for this stream
+   std::vector<char> m_out;                      ///< The processed tile, in the pipeline's output type
+
+   float * m_dest {nullptr}; ///< The tile's first pixel in the mosaic
+   size_t m_stride {0};      ///< The mosaic row length
+
+   std::mutex m_mutex;                       ///< Held while the tile is written, or copied out
+   std::atomic<bool> * m_changed {nullptr};  ///< Set when the tile has been written
+
+   bool m_align {false};                               ///< Whether images go to \ref m_slots rather than the mosaic
+   std::unique_ptr<mosaicSlot[]> m_slots;              ///< The most recent images, when aligning
+   std::atomic<uint64_t> m_head {0};                   ///< The number of images written to \ref m_slots
+
+   displayBudget * m_budget {nullptr}; ///< The host display budget, asked before each image is processed, if any
+
+   ~mosaicTile();
+
+   ///Try to open the stream, without waiting.
+   /**
+     * \retval 0 on success
+     * \retval -1 if the stream is not available yet
+     * \retval -2 if the stream can not be displayed
+     */
+   int open( const displayConfig & config,                  ///< [in] the pipeline configuration
+             const std::shared_ptr<const remapTable> & remap ///< [in] the remap table, if any
+           );
+
+   ///Stop the thread and close the stream.
+   void close();
+
+   ///Check whether the stream is unchanged since it was opened.
+   bool valid() const;
+
+protected:
+   virtual void newImage( const void * im,
+                          uint64_t cnt0
+                        );
+};
+
+inline
+mosaicTile::~mosaicTile()
+{
+   close();
+}
+
+inline
+int mosaicTile::open( const displayConfig & config,
+                      const std::shared_ptr<const remapTable> & remap
+                    )
+{
+   close();
+
+   //As in milk2ds9, check for the file first to keep ImageStreamIO quiet
+   char fname[200];
+   ImageStreamIO_filename(fname, sizeof(fname), m_name.c_str());
+   int fd = ::open(fname, O_RDWR);
+   if(fd < 0) return -1;
+   ::close(fd);
+
+   if(ImageStreamIO_openIm(&m_stream, m_name.c_str()) != 0) return -1;
+   m_open = true;
+
+   if(m_stream.md[0].sem < 1)
+   {
+      close();
+      return -1;
+   }
+
+   m_nx = m_stream.md[0].size[0];
+   m_ny = m_stream.md[0].size[1];
+   m_nz = m_stream.md[0].size[2];
+
+   m_pipeline = makeDisplayPipeline(m_stream.md[0].datatype, remap);
+
+   if(!m_pipeline || milkDatatypeFromBitpix(m_pipeline->bitpix()) == 0)
+   {
+      std::cerr << "streamMosaic: datatype of " << m_name << " is not supported.\n";
+      close();
+      return -2;
+   }
+
+   if(m_pipeline->configure(m_nx, m_ny, config) < 0)
+   {
+      std::cerr << "streamMosaic: ROI and binning leave nothing to display of " << m_name << ".\n";
+      close();
+      return -2;
+   }
+
+   m_out.resize(m_pipeline->dim1()*m_pipeline->dim2()*m_pipeline->pixsz());
+
+   if(m_align)
+   {
+      m_slots.reset(new mosaicSlot[STREAMMOSAIC_ALIGN_DEPTH]);
+      for(size_t n = 0; n < STREAMMOSAIC_ALIGN_DEPTH; ++n) m_slots[n].pix.resize(m_pipeline->dim1()*m_pipeline->dim2());
+   }
+   m_head = 0;
+
+   return 0;
+}
+
+inline
+void mosaicTile::close()
+{
+   stop();
+
+   if(m_open) ImageStreamIO_closeIm(&m_stream);
+   m_open = false;
+}
+
+inline
+bool mosaicTile::valid() const
+{
+   if(!m_open) return false;
+
+   return (m_stream.md[0].sem > 0 && m_stream.md[0].size[0] == m_nx && m_stream.md[0].size[1] == m_ny && m_stream.md[0].size[2] == m_nz);
+}
+
+inline
+void mosaicTile::newImage( const void * im,
+                           uint64_t cnt0
+                         )
+{
+   //Processing is most of the cost of a mosaic, so it is asked for, and charged, here rather than by the display
+   if(m_budget && !m_budget->admit()) return;
+
+   double cpu = displayBudget::threadCPU();
+
+   m_pipeline->process(m_out.data(), im);
+
+   if(m_align)
+   {
+      //Never waits on the display: the oldest slot is overwritten, and a reader copying it will notice
+      uint64_t head = m_head.load(std::memory_order_relaxed);
+      mosaicSlot & slot = m_slots[head % STREAMMOSAIC_ALIGN_DEPTH];
+
+      slot.seq.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      //Slices caught up from a circular buffer share the stream's latest time
+      slot.cnt0 = cnt0;
+      slot.atime = m_image->md[0].atime.tv_sec + m_image->md[0].atime.tv_nsec/1e9;
+      milkTypeDispatch<mosaicTileCopyT>(milkDatatypeFromBitpix(m_pipeline->bitpix()), slot.pix.data(), m_pipeline->dim1(), m_out.data(), m_pipeline->dim1(), m_pipeline->dim2());
+
+      slot.seq.fetch_add(1, std::memory_order_release);
+      m_head.store(head + 1, std::memory_order_release);
+
+      *m_changed = true;
+   }
+   else
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      milkTypeDispatch<mosaicTileCopyT>(milkDatatypeFromBitpix(m_pipeline->bitpix()), m_dest, m_stride, m_out.data(), m_pipeline->dim1(), m_pipeline->dim2());
+
+      *m_changed = true;
+   }
+
+   //The mosaic sent is the image counted against the rate, so only the CPU time is charged
+   if(m_budget) m_budget->charge(displayBudget::threadCPU() - cpu, false);
+}
+
+/// Several streams, with independent sizes and types, composed into tiles of one float image.
+/** Each stream is followed by its own thread (see \ref streamFollower), which processes new images into its tile as
+  * they post, so the tiles are written in parallel.  The display then copies the whole mosaic into one ds9 frame,
+  * taking each tile's lock in turn so no tile is copied half written, and sends a single update.
+  *
+  * The tiles are laid out on a grid of equal cells, large enough for the largest tile, filled by rows.  Pixels outside
+  * the tiles are NaN.
+  *
+  * With alignment, each tile instead keeps its last \ref STREAMMOSAIC_ALIGN_DEPTH images in a lock-free ring, and the
+  * display shows the newest set, one image per stream, whose timestamps or cnt0 values all agree within the
+  * tolerance.  The threads never wait for the display, so the newest image is buffered as soon as it posts.
+  *
+  * With a display budget, each thread asks it before processing an image, and skips the image if refused.
+  */
+class streamMosaic
+{
+protected:
+   std::vector<std::unique_ptr<mosaicTile>> m_tiles; ///< The tiles
+
+   size_t m_cols {0}; ///< The number of columns of tiles
+
+   size_t m_cellW {0}; ///< The width of a cell
+   size_t m_cellH {0}; ///< The height of a cell
+
+   size_t m_width {0};  ///< The first dimension of the mosaic
+   size_t m_height {0}; ///< The second dimension of the mosaic
+
+   std::vector<float> m_mosaic; ///< The mosaic
+
+   std::atomic<bool> m_changed {false}; ///< Whether any tile has been written since the last copy
+
+   mosaicAlign m_align {alignNone}; ///< How tiles are matched
+   double m_tolerance {0};          ///< The largest difference allowed between matched images
+
+   std::vector<uint64_t> m_shown; ///< The cnt0 of each tile's image in the last aligned set copied
+
+   displayBudget * m_budget {nullptr}; ///< The host display budget, if any
+
+public:
+
+   ~streamMosaic();
+
+   ///Set the streams and layout.
+   void setup( const std::vector<std::string> & names, ///< [in] the stream names
+               size_t cols                             ///< [in] the number of columns, 0 for a square grid
+             );
+
+   ///Set how the tiles are matched, before opening.
+   void align( mosaicAlign how, ///< [in] how to match the tiles
+               double tolerance ///< [in] the largest difference allowed, in seconds or cnt0
+             );
+
+   ///Set the display budget the tiles' threads ask before processing an image, before opening.
+   void budget( displayBudget * b /**< [in] the budget, which must outlive the mosaic, or nullptr for none*/);
+
+   ///Try to open all of the streams, and start following them if successful.
+   /** Streams which are already open are kept.
+     *
+     * \retval 0 if all of the streams are open and being followed
+     * \retval 1 if some are not available yet
+     * \retval -1 on an error
+     */
+   int open( const displayConfig & config,                   ///< [in] the pipeline configuration
+             const std::shared_ptr<const remapTable> & remap, ///< [in] the remap table, if any
+             int semNum                                       ///< [in] the semaphore each tile's thread waits on
+           );
+
+   ///Stop following and close all the streams.
+   void close();
+
+   ///Check whether all of the streams are unchanged since they were opened.
+   bool valid() const;
+
+   ///Check whether any tile has been written since the last copy.
+   bool changed() const;
+
+   ///Get the first dimension of the mosaic.
+   size_t width() const;
+
+   ///Get the second dimension of the mosaic.
+   size_t height() const;
+
+   ///Copy the mosaic, if any tile has changed.
+   /**
+     * \retval true if the mosaic was copied
+     * \retval false if nothing has changed
+     */
+   bool copy( float * dest,      ///< [out] the destination, width() x height()
+              bool force = false ///< [in] [optional] copy even if nothing has changed
+            );
+
+protected:
+   ///Copy the newest aligned set, if it differs from the last one.
+   bool copyAligned( float * dest,
+                     bool force
+                   );
+
+   ///The value matched between tiles.
+   double alignKey( const mosaicSlot & slot ) const;
+};
+
+inline
+streamMosaic::~streamMosaic()
+{
+   close();
+}
+
+inline
+void streamMosaic::setup( const std::vector<std::string> & names,
+                          size_t cols
+                        )
+{
+   close();
+
+   m_tiles.clear();
+   for(size_t n = 0; n < names.size(); ++n)
+   {
+      m_tiles.emplace_back(new mosaicTile);
+      m_tiles.back()->m_name = names[n];
+      m_tiles.back()->m_changed = &m_changed;
+      m_tiles.back()->m_align = (m_align != alignNone);
+      m_tiles.back()->m_budget = m_budget;
+   }
+
+   m_cols = cols;
+   if(m_cols == 0) m_cols = ceil(sqrt(names.size()));
+   if(m_cols > names.size()) m_cols = names.size();
+}
+
+inline
+void streamMosaic::align( mosaicAlign how,
+                          double tolerance
+                        )
+{
+   close();
+
+   m_align = how;
+   m_tolerance = tolerance;
+
+   for(size_t n = 0; n < m_tiles.size(); ++n) m_tiles[n]->m_align = (m_align != alignNone);
+}
+
+inline
+void streamMosaic::budget( displayBudget * b )
+{
+   close();
+
+   m_budget = b;
+
+   for(size_t n = 0; n < m_tiles.size(); ++n) m_tiles[n]->m_budget = m_budget;
+}
+
+inline
+int streamMosaic::open( const displayConfig & config,
+                        const std::shared_ptr<const remapTable> & remap,
+                        int semNum
+                      )
+{
+   bool all = true;
+   for(size_t n = 0; n < m_tiles.size(); ++n)
+   {
+      if(m_tiles[n]->m_open) continue;
+
+      int rv = m_tiles[n]->open(config, remap);
+      if(rv == -2) return -1;
+      if(rv < 0) all = false;
+   }
+
+   if(!all) return 1;
+
+   m_cellW = 0;
+   m_cellH = 0;
+   for(size_t n = 0; n < m_tiles.size(); ++n)
+   {
+      if(m_tiles[n]->m_pipeline->dim1() > m_cellW) m_cellW = m_tiles[n]->m_pipeline->dim1();
+      if(m_tiles[n]->m_pipeline->dim2() > m_cellH) m_cellH = m_tiles[n]->m_pipeline->dim2();
+   }
+
+   size_t rows = (m_tiles.size() + m_cols - 1)/m_cols;
+
+   m_width = m_cols*m_cellW;
+   m_height = rows*m_cellH;
+
+   m_mosaic.assign(m_width*m_height, std::numeric_limits<float>::quiet_NaN());
+
+   //ds9 puts the first row at the bottom, so the first tile goes top left
+   for(size_t n = 0; n < m_tiles.size(); ++n)
+   {
+      size_t col = n % m_cols;
+      size_t row = rows - 1 - n/m_cols;
+
+      m_tiles[n]->m_dest = m_mosaic.data() + row*m_cellH*m_width + col*m_cellW;
+      m_tiles[n]->m_stride = m_width;
+
+      if(m_tiles[n]->follow(m_tiles[n]->m_stream, semNum) < 0)
+      {
+         close();
+         return -1;
+      }
+   }
+
+   m_shown.assign(m_tiles.size(), -1);
+   m_changed = true;
+
+   return 0;
+}
+
+inline
+void streamMosaic::close()
+{
+   for(size_t n = 0; n < m_tiles.size(); ++n) m_tiles[n]->close();
+}
+
+inline
+bool streamMosaic::valid() const
+{
+   for(size_t n = 0; n < m_tiles.size(); ++n) if(!m_tiles[n]->valid()) return false;
+
+   return true;
+}
+
+inline
+bool streamMosaic::changed() const
+{
+   return m_changed;
+}
+
+inline
+size_t streamMosaic::width() const
+{
+   return m_width;
+}
+
+inline
+size_t streamMosaic::height() const
+{
+   return m_height;
+}
+
+inline
+bool streamMosaic::copy( float * dest,
+                         bool force
+                       )
+{
+   if(!m_changed.exchange(false) && !force) return false;
+
+   if(m_align != alignNone) return copyAligned(dest, force);
+
+   size_t rows = (m_tiles.size() + m_cols - 1)/m_cols;
+
+   //Copy cell by cell, taking each tile's lock so it is consistent.  Cells without a tile are all NaN.
+   for(size_t n = 0; n < m_cols*rows; ++n)
+   {
+      size_t off = (rows - 1 - n/m_cols)*m_cellH*m_width + (n % m_cols)*m_cellW;
+
+      std::unique_lock<std::mutex> lock;
+      if(n < m_tiles.size()) lock = std::unique_lock<std::mutex>(m_tiles[n]->m_mutex);
+
+      for(size_t j = 0; j < m_cellH; ++j)
+      {
+         memcpy(dest + off + j*m_width, m_mosaic.data() + off + j*m_width, m_cellW*sizeof(float));
+      }
+   }
+
+   return true;
+}
+
+inline
+double streamMosaic::alignKey( const mosaicSlot & slot ) const
+{
+   if(m_align == alignCnt0) return slot.cnt0;
+
+   return slot.atime;
+}
+
+inline
+bool streamMosaic::copyAligned( float * dest,
+                                bool force
+                              )
+{
+   size_t nt = m_tiles.size();
+
+   //Snapshot the keys of each tile's buffered images, newest first
+   std::vector<std::vector<double>> keys(nt);
+   std::vector<std::vector<uint64_t>> heads(nt);
+   for(size_t t = 0; t < nt; ++t)
+   {
+      uint64_t head = m_tiles[t]->m_head.load(std::memory_order_acquire);
+      for(uint64_t h = head; h > 0 && head - h < STREAMMOSAIC_ALIGN_DEPTH; --h)
+      {
+         const mosaicSlot & slot = m_tiles[t]->m_slots[(h-1) % STREAMMOSAIC_ALIGN_DEPTH];
+
+         uint64_t seq = slot.seq.load(std::memory_order_acquire);
+         double key = alignKey(slot);
+         std::atomic_thread_fence(std::memory_order_acquire);
+         if((seq & 1) || slot.seq.load(std::memory_order_relaxed) != seq) continue;
+
+         keys[t].push_back(key);
+         heads[t].push_back(h-1);
+      }
+
+      if(keys[t].size() == 0) return false;
+   }
+
+   //The newest reference image, from any tile, which every other tile has a match for
+   std::vector<uint64_t> best;
+   double bestKey = 0;
+   for(size_t r = 0; r < nt; ++r)
+   {
+      for(size_t i = 0; i < keys[r].size(); ++i)
+      {
+         if(best.size() > 0 && keys[r][i] <= bestKey) break;
+
+         std::vector<uint64_t> set(nt);
+         bool matched = true;
+         for(size_t t = 0; t < nt && matched; ++t)
+         {
+            double diff = -1;
+            for(size_t j = 0; j < keys[t].size(); ++j)
+            {
+               double d = fabs(keys[t][j] - keys[r][i]);
+               if(d <= m_tolerance && (diff < 0 || d < diff))
+               {
+                  diff = d;
+                  set[t] = heads[t][j];
+               }
+            }
+            matched = (diff >= 0);
+         }
+
+         if(matched)
+         {
+            best = set;
+            bestKey = keys[r][i];
+            break;
+         }
+      }
+   }
+
+   if(best.size() == 0) return false;
+
+   //Stage the set in the mosaic, then check no slot was overwritten while it was copied
+   bool same = true;
+   for(size_t t = 0; t < nt; ++t)
+   {
+      const mosaicSlot & slot = m_tiles[t]->m_slots[best[t] % STREAMMOSAIC_ALIGN_DEPTH];
+
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      uint64_t cnt0 = slot.cnt0;
+      size_t w = m_tiles[t]->m_pipeline->dim1();
+      for(size_t j = 0; j < m_tiles[t]->m_pipeline->dim2(); ++j)
+      {
+         memcpy(m_tiles[t]->m_dest + j*m_tiles[t]->m_stride, slot.pix.data() + j*w, w*sizeof(float));
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if((seq & 1) || slot.seq.load(std::memory_order_relaxed) != seq)
+      {
+         m_changed = true; //try again next time
+         return false;
+      }
+
+      if(cnt0 != m_shown[t]) same = false;
+      m_shown[t] = cnt0;
+   }
+
+   if(same && !force) return false;
+
+   memcpy(dest, m_mosaic.data(), m_width*m_height*sizeof(float));
+
+   return true;
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_streamMosaic_hpp
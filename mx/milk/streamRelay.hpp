@@ -0,0 +1,274 @@
+/** \file streamRelay.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Republishes processed images as a new ImageStreamIO stream
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_streamRelay_hpp
+#define milk_streamRelay_hpp
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include <ImageStruct.h>
+#include <ImageStreamIO.h>
+
+#include "milkTypes.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// Functor for \ref milkTypeDispatch which adds an image to a float accumulator.
+template<typename dataT>
+struct relayAccumulateT
+{
+   static int call( float * acc,
+                    const void * im,
+                    size_t n
+                  )
+   {
+      float * __restrict__ a = acc;
+      const dataT * __restrict__ d = static_cast<const dataT *>(im);
+
+      for(size_t i = 0; i < n; ++i) a[i] += d[i];
+
+      return 0;
+   }
+};
+
+/// Republishes images as an ImageStreamIO stream, optionally decimated and averaged.
+/** The stream is created on the first publish, and re-created if the shape or type of the images changes.
+  * Each published image increments cnt0, sets atime, and posts all of the stream's semaphores, so downstream
+  * readers attach to it like any other stream.
+  *
+  * With averaging, each block of N images is averaged in single precision and published as a float image.
+  * Decimation then publishes every Nth image or block.
+  */
+class streamRelay
+{
+protected:
+   std::string m_name; ///< The name of the output stream
+
+   size_t m_decimate {1}; ///< Publish every this many images (or blocks, if averaging)
+   size_t m_average {1}; ///< Average blocks of this many images
+
+   IMAGE m_image; ///< The output stream
+   bool m_open {false}; ///< Whether the output stream has been created
+
+   uint8_t m_datatype {0}; ///< The datatype of the output stream
+   size_t m_dim1 {0}; ///< The first dimension of the output stream
+   size_t m_dim2 {0}; ///< The second dimension of the output stream
+
+   std::vector<float> m_acc; ///< The accumulator for averaging
+   size_t m_nacc {0}; ///< The number of images in the accumulator
+   size_t m_count {0}; ///< The number of images or blocks since the last publish
+
+public:
+
+   ~streamRelay();
+
+   ///Set up the relay.  Does not create the stream.
+   void setup( const std::string & name, ///< [in] the name of the output stream
+               size_t decimate,          ///< [in] publish every this many images (or blocks), >= 1
+               size_t average            ///< [in] average blocks of this many images, >= 1
+             );
+
+   ///Get the name of the output stream, which is empty if the relay is not set up.
+   const std::string & name() const;
+
+   ///Add an image to the relay, publishing it if due.
+   /**
+     * \retval 1 if the image was published
+     * \retval 0 if not yet due
+     * \retval -1 on an error
+     */
+   int publish( const void * im, ///< [in] the image
+                int bitpix,      ///< [in] the cfitsio image type of the image
+                size_t dim1,     ///< [in] the first dimension of the image
+                size_t dim2      ///< [in] the second dimension of the image
+              );
+
+   ///Destroy the output stream, if open.
+   void close();
+
+protected:
+   ///Create the stream with the given shape and type, destroying any existing one.
+   int create( uint8_t datatype,
+               size_t dim1,
+               size_t dim2
+             );
+
+   ///Copy an image into the stream and notify readers.
+   void post( const void * im,
+              size_t bytes
+            );
+};
+
+inline
+streamRelay::~streamRelay()
+{
+   close();
+}
+
+inline
+void streamRelay::setup( const std::string & name,
+                         size_t decimate,
+                         size_t average
+                       )
+{
+   close();
+
+   m_name = name;
+   m_decimate = (decimate < 1) ? 1 : decimate;
+   m_average = (average < 1) ? 1 : average;
+
+   m_nacc = 0;
+   m_count = 0;
+}
+
+inline
+const std::string & streamRelay::name() const
+{
+   return m_name;
+}
+
+inline
+void streamRelay::close()
+{
+   if(m_open) ImageStreamIO_destroyIm(&m_image);
+
+   m_open = false;
+}
+
+inline
+int streamRelay::create( uint8_t datatype,
+                         size_t dim1,
+                         size_t dim2
+                       )
+{
+   close();
+
+   uint32_t size[2];
+   size[0] = dim1;
+   size[1] = dim2;
+
+   if(ImageStreamIO_createIm(&m_image, m_name.c_str(), 2, size, datatype, 1, 0) != 0)
+   {
+      std::cerr << "streamRelay: could not create stream " << m_name << "\n";
+      return -1;
+   }
+
+   m_open = true;
+   m_datatype = datatype;
+   m_dim1 = dim1;
+   m_dim2 = dim2;
+
+   return 0;
+}
+
+inline
+void streamRelay::post( const void * im,
+                        size_t bytes
+                      )
+{
+   m_image.md[0].write = 1;
+
+   memcpy(m_image.array.raw, im, bytes);
+
+   clock_gettime(CLOCK_REALTIME, &m_image.md[0].atime);
+   m_image.md[0].cnt1 = 0;
+   ++m_image.md[0].cnt0;
+
+   m_image.md[0].write = 0;
+
+   ImageStreamIO_sempost(&m_image, -1);
+}
+
+inline
+int streamRelay::publish( const void * im,
+                          int bitpix,
+                          size_t dim1,
+                          size_t dim2
+                        )
+{
+   if(m_name == "") return 0;
+
+   uint8_t datatype = (m_average > 1) ? _DATATYPE_FLOAT : milkDatatypeFromBitpix(bitpix);
+
+   if(datatype == 0)
+   {
+      std::cerr << "streamRelay: bitpix " << bitpix << " not supported\n";
+      return -1;
+   }
+
+   size_t n = dim1*dim2;
+
+   //A new shape or type starts over
+   if(!m_open || datatype != m_datatype || dim1 != m_dim1 || dim2 != m_dim2)
+   {
+      if(create(datatype, dim1, dim2) < 0) return -1;
+
+      m_nacc = 0;
+      m_count = 0;
+   }
+
+   if(m_average > 1)
+   {
+      if(m_nacc == 0) m_acc.assign(n, 0.0f);
+
+      milkTypeDispatch<relayAccumulateT>(milkDatatypeFromBitpix(bitpix), m_acc.data(), im, n);
+
+      if(++m_nacc < m_average) return 0;
+
+      float norm = 1.0f/m_nacc;
+      for(size_t i = 0; i < n; ++i) m_acc[i] *= norm;
+
+      m_nacc = 0;
+   }
+
+   if(++m_count < m_decimate) return 0;
+
+   m_count = 0;
+
+   if(m_average > 1) post(m_acc.data(), n*sizeof(float));
+   else post(im, n*milkTypeSize(datatype));
+
+   return 1;
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_streamRelay_hpp
@@ -0,0 +1,277 @@
+/** \file streamWindow.hpp
+  * \author Jared R. Males (jaredmales@gmail.com)
+  * \brief Maps a window of the slices of a stream, rather than the whole stream
+  * \ingroup milk_files
+  *
+*/
+
+//***********************************************************************//
+// Copyright 2015, 2016, 2017, 2018 Jared R. Males (jaredmales@gmail.com)
+//
+// This file is part of mxlib.
+//
+// mxlib is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// mxlib is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with mxlib.  If not, see <http://www.gnu.org/licenses/>.
+//***********************************************************************//
+
+#ifndef milk_streamWindow_hpp
+#define milk_streamWindow_hpp
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ImageStruct.h>
+#include <ImageStreamIO.h>
+
+#include "milkTypes.hpp"
+
+namespace mx
+{
+namespace milk
+{
+
+/** \addtogroup milk
+  * @{
+  */
+
+/// Maps the metadata and keywords of a stream, and only a window of its slices, moving the window as needed.
+/** ImageStreamIO_openIm maps the whole stream file, so showing the newest slice of a deep circular buffer maps all of
+  * it, and as the buffer wraps every page of it ends up in the viewer's page tables and resident set.  This maps the
+  * metadata and keywords, which are all that is needed to follow the stream, and a window of slices which is moved,
+  * by unmapping and mapping again, when a slice outside it is wanted.  The memory used is then set by the window,
+  * whatever the depth of the buffer.
+  *
+  * The file layout is that written by ImageStreamIO: the metadata, then the data, then the keywords.  The semaphores
+  * are not opened, so the stream must be polled on cnt0.
+  */
+class streamWindow
+{
+protected:
+   size_t m_window {1}; ///< The number of slices to map
+
+   IMAGE_METADATA * m_md {nullptr}; ///< The mapped metadata
+
+   void * m_kwMap {nullptr}; ///< The mapping holding the keywords
+   size_t m_kwMapSize {0};   ///< The size of the keyword mapping
+
+   int m_fd {-1}; ///< The stream file, kept open for moving the window
+
+   size_t m_sliceSize {0}; ///< The size of one slice, in bytes
+   size_t m_depth {1};     ///< The number of slices in the stream
+   off_t m_dataOffset {0}; ///< The offset of the data in the file
+
+   void * m_map {nullptr}; ///< The mapping holding the window
+   size_t m_mapSize {0};   ///< The size of the window mapping
+   char * m_first {nullptr}; ///< The first slice in the window
+   size_t m_firstSlice {0};  ///< The index of the first slice in the window
+   size_t m_slices {0};      ///< The number of slices in the window
+
+public:
+
+   ~streamWindow();
+
+   ///Set the number of slices to map.
+   void setup( size_t window /**< [in] the number of slices, at least 1*/);
+
+   ///Check whether a stream is open.
+   bool isOpen() const;
+
+   ///Open a stream, filling in image as ImageStreamIO_openIm would, except for the data and semaphores.
+   /** image.md and image.kw point into the mappings, and image.array and image.semptr are nullptr.
+     *
+     * \retval 0 on success
+     * \retval -1 if the stream could not be opened
+     */
+   int open( IMAGE & image,             ///< [out] the stream
+             const std::string & name   ///< [in] the stream name
+           );
+
+   ///Close the stream and release the mappings.
+   void close();
+
+   ///Get a slice, moving the window to it if needed.
+   /**
+     * \returns a pointer to the slice
+     * \returns nullptr if it could not be mapped
+     */
+   const void * slice( size_t n /**< [in] the slice*/);
+
+protected:
+   ///Map a region of the file, which need not be page aligned.
+   /**
+     * \returns a pointer to the start of the region
+     * \returns nullptr on an error
+     */
+   char * mapRegion( void * & map,    ///< [out] the mapping, to unmap
+                     size_t & mapSize, ///< [out] the size of the mapping
+                     off_t offset,     ///< [in] the offset of the region
+                     size_t size       ///< [in] the size of the region
+                   );
+};
+
+inline
+streamWindow::~streamWindow()
+{
+   close();
+}
+
+inline
+void streamWindow::setup( size_t window )
+{
+   m_window = (window < 1) ? 1 : window;
+}
+
+inline
+bool streamWindow::isOpen() const
+{
+   return (m_md != nullptr);
+}
+
+inline
+int streamWindow::open( IMAGE & image,
+                        const std::string & name
+                      )
+{
+   close();
+
+   char path[200];
+   ImageStreamIO_filename(path, sizeof(path), name.c_str());
+
+   m_fd = ::open(path, O_RDONLY);
+   if(m_fd < 0) return -1;
+
+   struct stat st;
+   if(fstat(m_fd, &st) < 0 || st.st_size < (off_t) sizeof(IMAGE_METADATA))
+   {
+      close();
+      return -1;
+   }
+
+   void * md = mmap(nullptr, sizeof(IMAGE_METADATA), PROT_READ, MAP_SHARED, m_fd, 0);
+   if(md == MAP_FAILED)
+   {
+      std::cerr << "streamWindow: could not map " << path << ": " << strerror(errno) << "\n";
+      close();
+      return -1;
+   }
+   m_md = static_cast<IMAGE_METADATA *>(md);
+
+   size_t typeSize = milkTypeSize(m_md->datatype);
+   m_sliceSize = m_md->size[0]*m_md->size[1]*typeSize;
+   m_depth = (m_md->naxis == 3 && m_md->size[2] > 0) ? m_md->size[2] : 1;
+   m_dataOffset = sizeof(IMAGE_METADATA);
+
+   off_t kwOffset = m_dataOffset + m_md->nelement*typeSize;
+   size_t kwSize = m_md->NBkw*sizeof(IMAGE_KEYWORD);
+
+   if(typeSize == 0 || m_sliceSize == 0 || st.st_size < kwOffset + (off_t) kwSize)
+   {
+      std::cerr << "streamWindow: " << path << " does not have the expected layout\n";
+      close();
+      return -1;
+   }
+
+   char * kw = nullptr;
+   if(kwSize > 0 && (kw = mapRegion(m_kwMap, m_kwMapSize, kwOffset, kwSize)) == nullptr)
+   {
+      close();
+      return -1;
+   }
+
+   memset(&image, 0, sizeof(image));
+   strncpy(image.name, name.c_str(), sizeof(image.name)-1);
+   image.used = 1;
+   image.md = m_md;
+   image.kw = reinterpret_cast<IMAGE_KEYWORD *>(kw);
+
+   return 0;
+}
+
+inline
+void streamWindow::close()
+{
+   if(m_map) munmap(m_map, m_mapSize);
+   if(m_kwMap) munmap(m_kwMap, m_kwMapSize);
+   if(m_md) munmap(m_md, sizeof(IMAGE_METADATA));
+   if(m_fd >= 0) ::close(m_fd);
+
+   m_map = nullptr;
+   m_mapSize = 0;
+   m_first = nullptr;
+   m_slices = 0;
+
+   m_kwMap = nullptr;
+   m_kwMapSize = 0;
+
+   m_md = nullptr;
+   m_fd = -1;
+}
+
+inline
+const void * streamWindow::slice( size_t n )
+{
+   if(!m_md || n >= m_depth) return nullptr;
+
+   if(m_first && n >= m_firstSlice && n < m_firstSlice + m_slices) return m_first + (n - m_firstSlice)*m_sliceSize;
+
+   if(m_map) munmap(m_map, m_mapSize);
+   m_map = nullptr;
+   m_first = nullptr;
+
+   //The writer moves forward, so the window starts at the slice wanted, until it runs into the end
+   m_slices = (m_window < m_depth) ? m_window : m_depth;
+   m_firstSlice = (n + m_slices <= m_depth) ? n : m_depth - m_slices;
+
+   m_first = mapRegion(m_map, m_mapSize, m_dataOffset + m_firstSlice*m_sliceSize, m_slices*m_sliceSize);
+   if(!m_first) return nullptr;
+
+   return m_first + (n - m_firstSlice)*m_sliceSize;
+}
+
+inline
+char * streamWindow::mapRegion( void * & map,
+                                size_t & mapSize,
+                                off_t offset,
+                                size_t size
+                              )
+{
+   static const off_t page = sysconf(_SC_PAGESIZE);
+
+   off_t start = (offset/page)*page;
+   mapSize = size + (offset - start);
+
+   map = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, m_fd, start);
+   if(map == MAP_FAILED)
+   {
+      std::cerr << "streamWindow: could not map " << mapSize << " bytes: " << strerror(errno) << "\n";
+      map = nullptr;
+      mapSize = 0;
+      return nullptr;
+   }
+
+   return static_cast<char *>(map) + (offset - start);
+}
+
+/// @}
+
+} //namespace milk
+} //namespace mx
+
+#endif //milk_streamWindow_hpp